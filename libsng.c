@@ -0,0 +1,1000 @@
+/*****************************************************************************
+
+NAME
+   libsng.c -- support code and embedding interface for the SNG library.
+
+*****************************************************************************/
+#include <errno.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+#include <sys/time.h>
+#include "config.h"
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif /* HAVE_UNISTD_H */
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif /* HAVE_MMAP */
+#include "png.h"
+#include "sng.h"
+#include "libsng.h"
+
+SNG_TLS int verbose;
+SNG_TLS int idat;
+SNG_TLS int no_pixels;
+SNG_TLS int stream;
+SNG_TLS int timing;
+SNG_TLS int data_format = DATA_AUTO;
+SNG_TLS int sidecar_files;
+SNG_TLS sng_excerpt excerpt;
+SNG_TLS sng_compression compression_override = {-1, -1, -1, -1, -1, -1};
+SNG_TLS int threads = 1;
+SNG_TLS size_t memory_budget;
+
+SNG_TLS png_struct *png_ptr;
+SNG_TLS png_info *info_ptr;
+
+/*************************************************************************
+ *
+ * Error and allocation functions
+ *
+ ************************************************************************/
+
+SNG_TLS int linenum;
+SNG_TLS char *file;
+SNG_TLS sng_input *yyin;
+
+/* where diagnostics go when not to stderr; see SNG_STDERR */
+SNG_TLS FILE *errfp;
+
+/* where fatal() goes when there is no png_ptr to unwind through */
+static SNG_TLS jmp_buf *fatal_jmp;
+
+void fatal(const char *fmt, ... )
+/* throw an error distinguishable from PNG library errors */
+{
+    char buf[BUFSIZ];
+    va_list ap;
+
+    /* error message format can be stepped through by Emacs */
+    if (!file)
+	buf[0] = '\0';
+    else if (linenum == EOF)
+	sprintf(buf, "%s:EOF: ", file);
+    else
+	sprintf(buf, "%s:%d: ", file, linenum);
+
+    va_start(ap, fmt);
+    vsprintf(buf + strlen(buf), fmt, ap);
+    va_end(ap);
+
+    strcat(buf, "\n");
+    fputs(buf, SNG_STDERR);
+
+    if (png_ptr)
+	longjmp(png_jmpbuf(png_ptr), 2);
+    else if (fatal_jmp)
+	longjmp(*fatal_jmp, 2);
+    else
+	exit(2);
+}
+
+void sng_png_error(png_structp png_ptr, png_const_charp msg)
+/* report a libpng error the way libpng would, then bail out */
+{
+    fprintf(SNG_STDERR, "libpng error: %s\n", msg);
+    png_longjmp(png_ptr, 1);
+}
+
+void sng_png_warning(png_structp png_ptr, png_const_charp msg)
+/* report a libpng warning the way libpng would */
+{
+    fprintf(SNG_STDERR, "libpng warning: %s\n", msg);
+}
+
+void *xalloc(unsigned long s)
+{
+    void *p=malloc((size_t)s);
+
+    if (p==NULL) {
+	fatal("out of memory");
+    }
+
+    note_memory(s);
+    return p;
+}
+
+void *xrealloc(void *p, unsigned long s)
+{
+    p=realloc(p,(size_t)s);
+
+    if (p==NULL) {
+	fatal("out of memory");
+    }
+
+    return p;
+}
+
+/*
+ * libpng, and the zlib streams it runs, get their memory through these so
+ * that it's counted with sng's own.  Each block carries its size in front.
+ */
+#define PNG_MEM_HEADER	16
+
+static png_voidp sng_png_malloc(png_structp png_ptr, png_alloc_size_t s)
+{
+    png_alloc_size_t	*p;
+
+    if (s > (png_alloc_size_t)-1 - PNG_MEM_HEADER
+	|| (p = malloc(PNG_MEM_HEADER + s)) == NULL)
+	return(NULL);
+    *p = s;
+    note_memory(s);
+    return((char *)p + PNG_MEM_HEADER);
+}
+
+static void sng_png_free(png_structp png_ptr, png_voidp p)
+{
+    if (p != NULL)
+    {
+	p = (char *)p - PNG_MEM_HEADER;
+	note_memory(-(long)*(png_alloc_size_t *)p);
+	free(p);
+    }
+}
+
+static png_structp lift_limits(png_structp ptr)
+/* let a png struct take images and chunks as big as PNG allows */
+{
+    if (ptr == NULL)
+	return(NULL);
+#ifdef PNG_SET_USER_LIMITS_SUPPORTED
+    /* libpng's defaults stop at a million pixels each way, and 8MB chunks */
+    png_set_user_limits(ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+    png_set_chunk_malloc_max(ptr, PNG_UINT_31_MAX);
+#endif /* PNG_SET_USER_LIMITS_SUPPORTED */
+    return(ptr);
+}
+
+png_structp sng_create_read_struct(void)
+/* a libpng read struct reporting through sng, with its memory counted */
+{
+    png_structp	ptr;
+
+#ifdef PNG_USER_MEM_SUPPORTED
+    ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL,
+				   sng_png_error, sng_png_warning,
+				   NULL, sng_png_malloc, sng_png_free);
+#else
+    ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+				 sng_png_error, sng_png_warning);
+#endif /* PNG_USER_MEM_SUPPORTED */
+    return(lift_limits(ptr));
+}
+
+png_structp sng_create_write_struct(void)
+/* a libpng write struct reporting through sng, with its memory counted */
+{
+    png_structp	ptr;
+
+#ifdef PNG_USER_MEM_SUPPORTED
+    ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL,
+				    sng_png_error, sng_png_warning,
+				    NULL, sng_png_malloc, sng_png_free);
+#else
+    ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
+				  sng_png_error, sng_png_warning);
+#endif /* PNG_USER_MEM_SUPPORTED */
+    return(lift_limits(ptr));
+}
+
+/*
+ * Memory needed for the length of one conversion comes out of a pool and
+ * is given back all at once by pool_release(), including when the
+ * conversion is abandoned by fatal().  Small requests are carved out of
+ * POOL_BLOCK-sized blocks; big ones get a block of their own so that
+ * pool_realloc() can resize them without copying through the pool.
+ */
+
+#define POOL_BLOCK	(64 * 1024)
+#define POOL_LARGE	(POOL_BLOCK / 4)
+#define POOL_ALIGN(n)	(((n) + 15) & ~(size_t)15)
+#define POOL_HEADER	POOL_ALIGN(sizeof(pool_block))
+#define POOL_DATA(b)	((char *)(b) + POOL_HEADER)
+
+SNG_TLS sng_pool *conversion_pool;
+
+void *pool_alloc(sng_pool *pool, size_t s)
+/* allocate memory that lasts until the pool is released */
+{
+    pool_block	*b;
+
+    if (s > (size_t)-1 / 2)
+	fatal("out of memory");
+    s = POOL_ALIGN(s);
+    if (s >= POOL_LARGE)
+    {
+	b = xalloc(POOL_HEADER + s);
+	b->size = b->used = s;
+	b->prev = NULL;
+	if ((b->next = pool->large))
+	    b->next->prev = b;
+	pool->large = b;
+	return(POOL_DATA(b));
+    }
+
+    if ((b = pool->blocks) == NULL || b->size - b->used < s)
+    {
+	b = xalloc(POOL_HEADER + POOL_BLOCK);
+	b->size = POOL_BLOCK;
+	b->used = 0;
+	b->prev = NULL;
+	b->next = pool->blocks;
+	pool->blocks = b;
+    }
+    b->used += s;
+    return(POOL_DATA(b) + b->used - s);
+}
+
+void *pool_realloc(sng_pool *pool, void *p, size_t old, size_t s)
+/* resize an allocation of old bytes from the pool */
+{
+    pool_block	*b;
+    void	*q;
+
+    if (p == NULL)
+	return(pool_alloc(pool, s));
+
+    old = POOL_ALIGN(old);
+    if (old >= POOL_LARGE)
+    {
+	/* a block of its own; move it and patch up the list */
+	if (POOL_ALIGN(s) <= old)
+	    return(p);
+	b = xrealloc((char *)p - POOL_HEADER, POOL_HEADER + POOL_ALIGN(s));
+	note_memory(POOL_ALIGN(s) - old);
+	b->size = b->used = POOL_ALIGN(s);
+	if (b->prev)
+	    b->prev->next = b;
+	else
+	    pool->large = b;
+	if (b->next)
+	    b->next->prev = b;
+	return(POOL_DATA(b));
+    }
+
+    /* the latest small allocation may be able to grow in place */
+    b = pool->blocks;
+    if ((char *)p + old == POOL_DATA(b) + b->used
+		&& POOL_ALIGN(s) < POOL_LARGE
+		&& b->used - old + POOL_ALIGN(s) <= b->size)
+    {
+	b->used = b->used - old + POOL_ALIGN(s);
+	return(p);
+    }
+
+    q = pool_alloc(pool, s);
+    memcpy(q, p, old < s ? old : s);
+    return(q);
+}
+
+char *pool_strdup(sng_pool *pool, const char *s)
+/* copy a string into the pool */
+{
+    char	*r = pool_alloc(pool, strlen(s) + 1);
+
+    strcpy(r, s);
+
+    return(r);
+}
+
+/*
+ * A buffer bigger than the memory budget, such as the pixels of a huge
+ * image, is made in a temporary file under $TMPDIR instead and mapped,
+ * so that the kernel can write its pages out rather than swap.  The file
+ * is unlinked as soon as it is made and goes away with the mapping when
+ * the pool is released.
+ */
+void *pool_spill(sng_pool *pool, size_t s)
+/* allocate from a pool, in a mapped file if s is over the memory budget */
+{
+#ifdef HAVE_MMAP
+    char	path[BUFSIZ];
+    const char	*dir = getenv("TMPDIR");
+    pool_map	*m;
+    void	*p;
+    int		fd;
+
+    if (memory_budget == 0 || s <= memory_budget)
+	return(pool_alloc(pool, s));
+
+    if (dir == NULL || *dir == '\0' || strlen(dir) + 11 > sizeof(path))
+	dir = "/tmp";
+    m = pool_alloc(pool, sizeof(pool_map));
+    sprintf(path, "%s/sngXXXXXX", dir);
+    if ((fd = mkstemp(path)) < 0)
+	fatal("can't make a temporary file in %s (%s)", dir, strerror(errno));
+    unlink(path);
+    p = MAP_FAILED;
+    if ((off_t)s > 0 && ftruncate(fd, (off_t)s) == 0)
+	p = mmap(NULL, s, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+	fatal("can't map %lu bytes of temporary file (%s)",
+	      (unsigned long)s, strerror(errno));
+
+    m->addr = p;
+    m->size = s;
+    m->next = pool->maps;
+    pool->maps = m;
+    return(p);
+#else
+    return(pool_alloc(pool, s));
+#endif /* HAVE_MMAP */
+}
+
+void pool_release(sng_pool *pool)
+/* free everything allocated from a pool */
+{
+    pool_block	*b, *next;
+
+#ifdef HAVE_MMAP
+    pool_map	*m;
+
+    for (m = pool->maps; m; m = m->next)
+	munmap(m->addr, m->size);
+#endif /* HAVE_MMAP */
+    pool->maps = NULL;
+    for (b = pool->blocks; b; b = next)
+    {
+	next = b->next;
+	note_memory(-(long)(POOL_HEADER + b->size));
+	free(b);
+    }
+    for (b = pool->large; b; b = next)
+    {
+	next = b->next;
+	note_memory(-(long)(POOL_HEADER + b->size));
+	free(b);
+    }
+    pool->blocks = pool->large = NULL;
+}
+
+/*************************************************************************
+ *
+ * Instrumentation
+ *
+ * With -T, the time of each conversion is charged to whichever phase is
+ * running: phase_switch() starts a new one and hands back the old one
+ * so that it can be resumed.  CPU time is for the whole process, so
+ * work done by worker threads counts towards the phase that started it.
+ * Memory is what sng has from xalloc() and xrealloc(), less what it has
+ * given back, plus what libpng and its zlib streams have; the streams of
+ * the --threads deflate workers aren't seen.
+ *
+ ************************************************************************/
+
+SNG_TLS sng_stats conversion_stats;
+
+static const char *phase_names[NPHASES] = {
+    "other", "parse", "decode", "png", "dump", "io",
+};
+
+static void read_clocks(double *wall, double *cpu)
+/* seconds elapsed, and processor seconds used */
+{
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    *wall = ts.tv_sec + ts.tv_nsec / 1e9;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    *cpu = ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    struct timeval	tv;
+
+    gettimeofday(&tv, NULL);
+    *wall = tv.tv_sec + tv.tv_usec / 1e6;
+    *cpu = (double)clock() / CLOCKS_PER_SEC;
+#endif /* HAVE_CLOCK_GETTIME */
+}
+
+void stats_begin(int phase)
+/* start measuring a conversion */
+{
+    memset(&conversion_stats, '\0', sizeof(sng_stats));
+    conversion_stats.phase = phase;
+    read_clocks(&conversion_stats.wall_mark, &conversion_stats.cpu_mark);
+}
+
+int phase_switch(int phase)
+/* charge the time so far to the current phase and start another */
+{
+    sng_stats	*sp = &conversion_stats;
+    double	wall, cpu;
+    int		prev = sp->phase;
+
+    if (!timing)
+	return(prev);
+    read_clocks(&wall, &cpu);
+    sp->wall[prev] += wall - sp->wall_mark;
+    sp->cpu[prev] += cpu - sp->cpu_mark;
+    sp->wall_mark = wall;
+    sp->cpu_mark = cpu;
+    sp->phase = phase;
+    return(prev);
+}
+
+void note_memory(long delta)
+/* keep track of the memory in use, and the most there has been */
+{
+    conversion_stats.memory += delta;
+    if (conversion_stats.memory > conversion_stats.peak_memory)
+	conversion_stats.peak_memory = conversion_stats.memory;
+}
+
+static void json_string(FILE *fp, const char *s)
+/* write a string as a JSON string literal */
+{
+    fputc('"', fp);
+    for (; *s; s++)
+	if (*s == '"' || *s == '\\')
+	    fprintf(fp, "\\%c", *s);
+	else if ((unsigned char)*s < ' ')
+	    fprintf(fp, "\\u%04x", *s);
+	else
+	    fputc(*s, fp);
+    fputc('"', fp);
+}
+
+void stats_report(FILE *fp, const char *file, const char *what, int status)
+/* report on a finished conversion */
+{
+    sng_stats	*sp = &conversion_stats;
+    double	wall = 0, cpu = 0, rate;
+    int		i;
+
+    phase_switch(sp->phase);
+    for (i = 0; i < NPHASES; i++)
+    {
+	wall += sp->wall[i];
+	cpu += sp->cpu[i];
+    }
+
+    /* the rate is for the bigger side, which is usually the SNG */
+    rate = sp->bytes_out > sp->bytes_in ? sp->bytes_out : sp->bytes_in;
+    rate = wall > 0 ? rate / wall / 1e6 : 0.0;
+    if (timing == TIMING_JSON)
+    {
+	fprintf(fp, "{\"file\": ");
+	json_string(fp, file);
+	fprintf(fp, ", \"conversion\": \"%s\", \"status\": %d", what, status);
+	fprintf(fp, ", \"wall\": %.6f, \"cpu\": %.6f, \"phases\": {", wall, cpu);
+	for (i = 0; i < NPHASES; i++)
+	    fprintf(fp, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f}",
+		    i ? ", " : "", phase_names[i], sp->wall[i], sp->cpu[i]);
+	fprintf(fp, "}, \"bytes_in\": %.0f, \"bytes_out\": ", sp->bytes_in);
+	if (sp->bytes_out < 0)
+	    fprintf(fp, "null");
+	else
+	    fprintf(fp, "%.0f", sp->bytes_out);
+	fprintf(fp, ", \"mb_per_s\": %.3f, \"peak_memory\": %ld}\n",
+		rate, sp->peak_memory);
+    }
+    else
+    {
+	fprintf(fp, "sng: %s %s: %.3fs wall, %.3fs cpu\n", what, file, wall, cpu);
+	for (i = 0; i < NPHASES; i++)
+	    if (sp->wall[i] > 0 && (i != PHASE_OTHER || sp->wall[i] >= 0.0005))
+		fprintf(fp, "    %-8s %9.3fs wall %9.3fs cpu\n",
+			phase_names[i], sp->wall[i], sp->cpu[i]);
+	fprintf(fp, "    %.0f bytes in", sp->bytes_in);
+	if (sp->bytes_out >= 0)
+	    fprintf(fp, ", %.0f bytes out", sp->bytes_out);
+	else
+	    fprintf(fp, ", unknown bytes out");
+	fprintf(fp, ", %.2f MB/s, %ld bytes peak memory\n",
+		rate, sp->peak_memory);
+    }
+}
+
+/*************************************************************************
+ *
+ * Color database
+ *
+ * Color names normally come from tables compiled out of the X color
+ * database when sng was built (see mkrgbtab.c).  A database loaded with
+ * sng_set_rgbtxt() is parsed into hash chains instead.
+ *
+ ************************************************************************/
+
+#undef HASHDEBUG
+
+/* the color tables last until the next sng_set_rgbtxt() */
+static sng_pool color_pool;
+static int rgbtxt_loaded;
+
+#define COLOR_HASH(r, g, b)	(((r<<16)|(g<<8)|(b))%COLOR_HASH_MODULUS)
+
+static color_item *rgb_hashbuckets[COLOR_HASH_MODULUS];
+static color_item *cname_hashbuckets[COLOR_HASH_MODULUS];
+
+static int hash_by_rgb(color_item *cp)
+/* hash by color's RGB value */
+{
+    return(COLOR_HASH(cp->r, cp->g, cp->b));
+}
+
+static int hash_by_cname(color_item *cp)
+/* hash by color's name */
+{
+    unsigned int h = 0;
+    char *p;
+
+    for (p = cp->name; *p; p++)
+	h = COLOR_HASH_MODULUS * h + *p;
+    return(h % COLOR_HASH_MODULUS);
+}
+
+static int initialize_hash(const char *path,
+			   int hashfunc(color_item *),
+			   color_item *hashbuckets[])
+/* initialize color lookup by given hash function; FALSE if no database */
+{
+    FILE	*fp;
+    int red, green, blue, st;
+    char line[BUFSIZ], namebuf[BUFSIZ];
+    color_item sc;
+
+    if ((fp = fopen(path, "r")) == NULL)
+	return(FALSE);
+
+    for (;;)
+    {
+	if (fgets(line, sizeof(line) - 1, fp) == NULL)
+	    break;
+	st = sscanf(line, "%d %d %d %[^\n]\n", 
+		     &red, &green, &blue, namebuf);
+	if (feof(fp))
+	    break;
+	else if (st == 4)
+	{
+	    color_item *op, *newcolor, **hashbucket;
+
+#ifdef HASHDEBUG
+	    printf("* Caching %s = (%u, %u, %u) => %d\n",
+		   namebuf, red, green, blue, hashfunc(&sc));
+#endif /* HASHDEBUG */
+	    sc.r = (unsigned char)red;
+	    sc.g = (unsigned char)green;
+	    sc.b = (unsigned char)blue;
+	    sc.name = namebuf;
+	    hashbucket = &hashbuckets[hashfunc(&sc)];
+
+	    newcolor  = pool_alloc(&color_pool, sizeof(color_item));
+	    memcpy(newcolor, &sc, sizeof(color_item));
+	    newcolor->name = pool_strdup(&color_pool, namebuf);
+
+	    op = *hashbucket;
+	    *hashbucket = newcolor;
+	    newcolor->next = op;
+	}
+    }
+    fclose(fp);
+    return(TRUE);
+}
+
+int sng_set_rgbtxt(const char *path)
+/* use a color database file instead of the compiled-in tables */
+{
+    rgbtxt_loaded = FALSE;
+    memset(rgb_hashbuckets, '\0', sizeof(rgb_hashbuckets));
+    memset(cname_hashbuckets, '\0', sizeof(cname_hashbuckets));
+    pool_release(&color_pool);
+
+    if (path == NULL)
+	return(0);
+    if (!initialize_hash(path, hash_by_rgb, rgb_hashbuckets)
+		|| !initialize_hash(path, hash_by_cname, cname_hashbuckets))
+    {
+	memset(rgb_hashbuckets, '\0', sizeof(rgb_hashbuckets));
+	pool_release(&color_pool);
+	return(-1);
+    }
+    rgbtxt_loaded = TRUE;
+    return(0);
+}
+
+/* must agree with color_name_hash() in mkrgbtab.c */
+static unsigned int color_name_hash(unsigned int seed, const char *name)
+{
+    unsigned int h = 2166136261U ^ seed;
+
+    while (*name)
+    {
+	h ^= (unsigned char)*name++;
+	h *= 16777619U;
+    }
+    return(h);
+}
+
+const color_item *find_by_cname(const char *name)
+/* find a color by name */
+{
+    const color_item	*hp;
+
+    if (rgbtxt_loaded)
+    {
+	color_item	sc;
+
+	sc.name = (char *)name;
+	for (hp = cname_hashbuckets[hash_by_cname(&sc)]; hp; hp = hp->next)
+	    if (strcmp(hp->name, name) == 0)
+		return(hp);
+	return((color_item *)NULL);
+    }
+
+    hp = color_name_table + color_name_hash(
+	color_name_displace[color_name_hash(0, name) % color_name_buckets],
+	name) % color_name_slots;
+    if (hp->name && strcmp(hp->name, name) == 0)
+	return(hp);
+    return((color_item *)NULL);
+}
+
+const char *find_by_rgb(int r, int g, int b)
+/* find the name of a color, if it has one */
+{
+    const color_item	*hp;
+
+    if (rgbtxt_loaded)
+    {
+	color_item	sc;
+
+	sc.r = r; sc.g = g; sc.b = b;
+	for (hp = rgb_hashbuckets[hash_by_rgb(&sc)]; hp; hp = hp->next)
+	    if (hp->r == r && hp->g == g && hp->b == b)
+		return(hp->name);
+    }
+    else
+    {
+	int	lo = 0, hi = color_value_count - 1;
+	long	value = ((long)r << 16) | (g << 8) | b;
+
+	while (lo <= hi)
+	{
+	    int		mid = (lo + hi) / 2;
+	    long	v;
+
+	    hp = color_value_table + mid;
+	    v = ((long)hp->r << 16) | (hp->g << 8) | hp->b;
+	    if (v == value)
+		return(hp->name);
+	    else if (v < value)
+		lo = mid + 1;
+	    else
+		hi = mid - 1;
+	}
+    }
+
+    return((char *)NULL);
+}
+
+/*************************************************************************
+ *
+ * Embedding interface
+ *
+ * Each call runs one conversion on the calling thread, with the options
+ * held in a context.  Diagnostics that the sng program would print on
+ * stderr are kept in the context instead, and errors come back as the
+ * same status codes sng exits with; nothing in the library calls exit().
+ *
+ ************************************************************************/
+
+struct sng_context_t
+{
+    int		stream;		/* as for --stream */
+    int		level;		/* deflate level, or -1 to leave it alone */
+    int		threads;	/* as for --threads */
+    size_t	max_memory;	/* as for --max-memory, or 0 */
+    sng_excerpt	excerpt;	/* as for --rows and --crop */
+    char	*name;		/* file name for diagnostics */
+    char	*errors;	/* diagnostics from the last conversion */
+    size_t	errlen;
+};
+
+/*
+ * Diagnostics and SNG output are collected with open_memstream() where
+ * it exists, and in temporary files where it doesn't.  PNG data in memory
+ * is read and written directly through the libpng I/O callbacks.
+ */
+typedef struct
+{
+    FILE	*fp;
+    char	*data;		/* contents, once memory_close() is done */
+    size_t	len;
+    int		tmp;		/* fp is a temporary file to read back */
+}
+memory_stream;
+
+static int memory_open(memory_stream *ms)
+/* open a stream that collects output in memory */
+{
+    memset(ms, '\0', sizeof(memory_stream));
+#ifdef HAVE_OPEN_MEMSTREAM
+    if ((ms->fp = open_memstream(&ms->data, &ms->len)) != NULL)
+	return(TRUE);
+#endif /* HAVE_OPEN_MEMSTREAM */
+    ms->tmp = TRUE;
+    return((ms->fp = tmpfile()) != NULL);
+}
+
+static int memory_close(memory_stream *ms)
+/* finish an output stream, leaving a NUL-terminated copy of its contents */
+{
+    int	ok = !ferror(ms->fp);
+
+    if (ms->tmp)
+    {
+	long	len;
+
+	fflush(ms->fp);
+	len = ftell(ms->fp);
+	ok = ok && len >= 0 && (ms->data = malloc(len + 1)) != NULL;
+	if (ok)
+	{
+	    rewind(ms->fp);
+	    ms->len = fread(ms->data, 1, len, ms->fp);
+	    ms->data[ms->len] = '\0';
+	}
+	fclose(ms->fp);
+    }
+    else if (fclose(ms->fp) != 0)
+	ok = FALSE;
+    ms->fp = NULL;
+
+    if (!ok)
+    {
+	free(ms->data);
+	ms->data = NULL;
+	ms->len = 0;
+    }
+    return(ok);
+}
+
+sng_context *sng_context_new(void)
+/* make a context with default options */
+{
+    sng_context	*ctx = calloc(1, sizeof(sng_context));
+
+    if (ctx && (ctx->name = strdup("memory")) == NULL)
+    {
+	free(ctx);
+	ctx = NULL;
+    }
+    if (ctx)
+    {
+	ctx->level = -1;
+	ctx->threads = 1;
+    }
+    return(ctx);
+}
+
+void sng_context_free(sng_context *ctx)
+/* release a context */
+{
+    if (ctx)
+    {
+	free(ctx->name);
+	free(ctx->errors);
+	free(ctx);
+    }
+}
+
+int sng_set_name(sng_context *ctx, const char *name)
+/* set the file name used in diagnostics */
+{
+    char	*copy = strdup(name);
+
+    if (copy == NULL)
+	return(-1);
+    free(ctx->name);
+    ctx->name = copy;
+    return(0);
+}
+
+void sng_set_stream(sng_context *ctx, int on)
+/* convert rows as they are read, as with --stream */
+{
+    ctx->stream = on;
+}
+
+int sng_set_level(sng_context *ctx, int level)
+/* override the deflate level of compiled PNGs, or stop with -1 */
+{
+    if (level < -1 || level > 9)
+	return(-1);
+    ctx->level = level;
+    return(0);
+}
+
+void sng_set_threads(sng_context *ctx, int n)
+/* deflate big images on up to n threads, as with --threads */
+{
+    ctx->threads = n < 1 ? 1 : n;
+}
+
+void sng_set_max_memory(sng_context *ctx, size_t bytes)
+/* spill image buffers bigger than this to files, as with --max-memory */
+{
+    ctx->max_memory = bytes;
+}
+
+void sng_set_excerpt(sng_context *ctx, unsigned long x, unsigned long y,
+		     unsigned long width, unsigned long height)
+/* decompile only a window of the image, as with --crop */
+{
+    ctx->excerpt.x = x > PNG_UINT_31_MAX ? PNG_UINT_31_MAX : x;
+    ctx->excerpt.y = y > PNG_UINT_31_MAX ? PNG_UINT_31_MAX : y;
+    ctx->excerpt.width = width > PNG_UINT_31_MAX ? PNG_UINT_31_MAX : width;
+    ctx->excerpt.height = height > PNG_UINT_31_MAX ? PNG_UINT_31_MAX : height;
+    if (ctx->excerpt.height == 0)
+	ctx->excerpt.width = 0;
+}
+
+const char *sng_errors(const sng_context *ctx)
+/* diagnostics from the last conversion, or "" */
+{
+    return(ctx->errors ? ctx->errors : "");
+}
+
+/* deflate settings when nothing is overridden */
+static const sng_compression no_override = {-1, -1, -1, -1, -1, -1};
+
+/* what a conversion reads and writes */
+typedef struct
+{
+    FILE	*fin, *fout;	/* streams, where they are used */
+    sng_input	input;		/* input held in memory */
+    sng_output	output;		/* PNG output collected in memory */
+}
+conversion;
+
+static int run(sng_context *ctx,
+	       int convert(conversion *, char *), conversion *cv)
+/* run a conversion with a context's options, collecting diagnostics */
+{
+    memory_stream	diagnostics;
+    jmp_buf		jmp;
+    int			status;
+
+    free(ctx->errors);
+    ctx->errors = NULL;
+    ctx->errlen = 0;
+    if (!memory_open(&diagnostics))
+	return(2);
+
+    errfp = diagnostics.fp;
+    stream = ctx->stream;
+    verbose = idat = no_pixels = timing = 0;
+    data_format = DATA_AUTO;
+    compression_override = no_override;
+    compression_override.level = ctx->level;
+    threads = ctx->threads;
+    memory_budget = ctx->max_memory;
+    excerpt = ctx->excerpt;
+
+    if (setjmp(jmp))
+    {
+	/* fatal() before libpng was set up, such as running out of memory */
+	if (yyin)
+	    input_close(yyin);
+	if (conversion_pool)
+	    pool_release(conversion_pool);
+	status = 2;
+    }
+    else
+    {
+	fatal_jmp = &jmp;
+	status = convert(cv, ctx->name);
+    }
+    fatal_jmp = NULL;
+    errfp = NULL;
+    yyin = NULL;
+
+    if (memory_close(&diagnostics))
+    {
+	ctx->errors = diagnostics.data;
+	ctx->errlen = diagnostics.len;
+    }
+    return(status);
+}
+
+static int compile_stream(conversion *cv, char *name)
+{
+    return(sngc(cv->fin, name, cv->fout));
+}
+
+static int decompile_stream(conversion *cv, char *name)
+{
+    return(sngd(cv->fin, name, cv->fout));
+}
+
+static int compile_mem(conversion *cv, char *name)
+{
+    output_open_mem(&cv->output);
+    return(sngc_io(&cv->input, name, &cv->output));
+}
+
+static int decompile_mem(conversion *cv, char *name)
+{
+    return(sngd_io(&cv->input, name, cv->fout));
+}
+
+int sng_compile(sng_context *ctx, FILE *sng, FILE *png)
+/* compile SNG read from one stream to PNG on another */
+{
+    conversion	cv;
+
+    cv.fin = sng;
+    cv.fout = png;
+    return(run(ctx, compile_stream, &cv));
+}
+
+int sng_decompile(sng_context *ctx, FILE *png, FILE *sng)
+/* decompile PNG read from one stream to SNG on another */
+{
+    conversion	cv;
+
+    cv.fin = png;
+    cv.fout = sng;
+    return(run(ctx, decompile_stream, &cv));
+}
+
+int sng_compile_mem(sng_context *ctx, const void *sng, size_t len,
+		    unsigned char **png, size_t *pnglen)
+/* compile SNG in memory to a newly allocated PNG buffer */
+{
+    conversion	cv;
+    int		status;
+
+    memset(&cv, '\0', sizeof(conversion));
+    input_open_mem(&cv.input, sng, len);
+    status = run(ctx, compile_mem, &cv);
+
+    /* the buffer is handed over even if the compile failed partway */
+    *png = cv.output.buf;
+    *pnglen = cv.output.len;
+    return(status);
+}
+
+int sng_decompile_mem(sng_context *ctx, const void *png, size_t len,
+		      char **sng, size_t *snglen)
+/* decompile PNG in memory to a newly allocated SNG buffer */
+{
+    conversion		cv;
+    memory_stream	output;
+    int			status;
+
+    *sng = NULL;
+    *snglen = 0;
+    if (!memory_open(&output))
+	return(2);
+
+    memset(&cv, '\0', sizeof(conversion));
+    input_open_mem(&cv.input, png, len);
+    cv.fout = output.fp;
+    status = run(ctx, decompile_mem, &cv);
+
+    if (!memory_close(&output))
+	return(2);
+    *sng = output.data;
+    *snglen = output.len;
+    return(status);
+}
+
+/* libsng.c ends here */
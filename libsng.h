@@ -0,0 +1,71 @@
+/* libsng.h -- interface to the SNG compiler and decompiler library */
+
+#ifndef LIBSNG_H
+#define LIBSNG_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A context holds the options for conversions and the diagnostics from
+ * the last one.  A context must not be used by two threads at once, but
+ * separate contexts can run conversions in parallel.
+ *
+ * The conversion calls return what sng would exit with: 0 for success,
+ * 1 for I/O errors and bad PNG data (a decompile may still have produced
+ * output), and 2 for errors in SNG source or running out of memory; the
+ * messages are available from sng_errors() until the next conversion.
+ * The _mem calls hand back their output in a buffer from malloc(), to
+ * be released by the caller with free(); it is NULL only if memory for
+ * it could not be had.
+ *
+ * sng_set_level() sets the deflate level (0-9) of compiled PNGs over any
+ * compression specification in the SNG, or with -1 goes back to using
+ * that; it returns -1 for a level out of range.  sng_set_threads() lets
+ * each compile of a large image deflate it on up to n threads, and with
+ * n above 1 compressed text and iCCP payloads are deflated on the side
+ * and a streamed decompile of a large image runs as a pipeline of three.
+ * sng_set_max_memory() has pixel buffers of more than the given number of
+ * bytes kept in mapped temporary files rather than memory; 0, the
+ * default, puts no limit on them.  sng_set_excerpt() has decompiles dump
+ * only the given window of the image, clipped to its edges, with IHDR
+ * made over to the window's size; a width or height of 0 dumps it all.
+ */
+typedef struct sng_context_t sng_context;
+
+extern sng_context *sng_context_new(void);
+extern void sng_context_free(sng_context *ctx);
+
+extern int sng_set_name(sng_context *ctx, const char *name);
+extern void sng_set_stream(sng_context *ctx, int on);
+extern int sng_set_level(sng_context *ctx, int level);
+extern void sng_set_threads(sng_context *ctx, int n);
+extern void sng_set_max_memory(sng_context *ctx, size_t bytes);
+extern void sng_set_excerpt(sng_context *ctx, unsigned long x, unsigned long y,
+			    unsigned long width, unsigned long height);
+extern const char *sng_errors(const sng_context *ctx);
+
+extern int sng_compile(sng_context *ctx, FILE *sng, FILE *png);
+extern int sng_decompile(sng_context *ctx, FILE *png, FILE *sng);
+extern int sng_compile_mem(sng_context *ctx, const void *sng, size_t len,
+			   unsigned char **png, size_t *pnglen);
+extern int sng_decompile_mem(sng_context *ctx, const void *png, size_t len,
+			     char **sng, size_t *snglen);
+
+/*
+ * Read color names from a database file rather than the tables built
+ * into the library, or go back to those if path is NULL.  Returns -1 if
+ * the file can't be read.  This affects every context, so call it before
+ * starting any conversions.
+ */
+extern int sng_set_rgbtxt(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBSNG_H */
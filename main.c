@@ -5,163 +5,1017 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <sys/types.h>
 #include "png.h"
+#include "zlib.h"
 #include "sng.h"
+#include "libsng.h"
 #include "config.h"
-
-int verbose;
-int idat;
-
-png_struct *png_ptr;
-png_info *info_ptr;
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif /* HAVE_SYS_WAIT_H */
+#include <signal.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_SYS_UN_H)
+#include <sys/socket.h>
+#include <sys/un.h>
+#define SNG_SOCKETS
+#endif /* HAVE_SYS_SOCKET_H && HAVE_SYS_UN_H */
 
 /*************************************************************************
  *
- * Error and allocation functions
+ * Utility functions
  *
  ************************************************************************/
 
-int linenum;
-char *file;
-FILE *yyin;
+static int max(int x, int y)
+{
+    return x > y ? x : y;
+}
 
-void fatal(const char *fmt, ... )
-/* throw an error distinguishable from PNG library errors */
+static int output_name(const char *name, char *outfile)
+/* name a file's output; TRUE for SNG to PNG, FALSE for back, -1 for neither */
 {
-    char buf[BUFSIZ];
-    va_list ap;
-
-    /* error message format can be stepped through by Emacs */
-    if (!file)
-	buf[0] = '\0';
-    else if (linenum == EOF)
-	sprintf(buf, "%s:EOF: ", file);
+    int sng2png, dot = strlen(name) - 4;
+
+    if (dot < 0 || dot >= BUFSIZ - 4 || name[dot] != '.')
+	return(-1);
+    else if (strcmp(name + dot, ".sng") == 0)
+	sng2png = TRUE;
+    else if (strcmp(name + dot, ".png") == 0)
+	sng2png = FALSE;
     else
-	sprintf(buf, "%s:%d: ", file, linenum);
+	return(-1);
+
+    strncpy(outfile, name, dot);
+    outfile[dot] = '\0';
+    strcat(outfile, sng2png ? ".png" : ".sng");
+    return(sng2png);
+}
+
+/*
+ * With --cache, an input whose contents and options are the same as in
+ * an earlier run gets that run's output back without being converted.
+ * Only conversions that succeed without a word of diagnostics are kept,
+ * so that a file that draws a warning goes on drawing it, and none that
+ * read or write image data files, which the key doesn't cover.
+ */
+static char *cache_dir;
+
+/* --max-memory, for the threads that convert through library contexts */
+static size_t max_memory;
+
+static void replay(FILE *from, FILE *to)
+/* copy a captured output file to one of our streams */
+{
+    char	buf[BUFSIZ];
+    size_t	n;
+
+    rewind(from);
+    while ((n = fread(buf, 1, sizeof(buf), from)) > 0)
+	fwrite(buf, 1, n, to);
+    fclose(from);
+}
+
+static int convert_file(char *name)
+/* convert one named file, returning its error status */
+{
+    int sng2png, status;
+    char outfile[BUFSIZ];
+    FILE	*fpin, *fpout;
+    cache_entry	entry;
+    int		cacheable = FALSE, caching = FALSE;
+
+    if ((sng2png = output_name(name, outfile)) < 0)
+    {
+	fprintf(stderr, "sng: %s is neither SNG nor PNG\n", name);
+	return(1);
+    }
+
+    /* a timed conversion has to be done to be timed */
+    if (cache_dir && !timing && cache_lookup(name, sng2png, &entry))
+    {
+	if (cache_fetch(&entry, outfile))
+	{
+	    if (verbose)
+		printf("sng: %s is unchanged, %s taken from the cache\n",
+		       name, outfile);
+	    return(0);
+	}
+	cacheable = TRUE;
+    }
 
-    va_start(ap, fmt);
-    vsprintf(buf + strlen(buf), fmt, ap);
-    va_end(ap);
+    if (verbose)
+	printf("sng: converting %s to %s\n", name, outfile);
+
+    if ((fpin = fopen(name, "r")) == NULL)
+    {
+	fprintf(stderr,
+		"sng: couldn't open %s for input (%d)\n",
+		name, errno);
+	return(1);
+    }
+    if ((fpout = fopen(outfile, "w")) == NULL)
+    {
+	fprintf(stderr,
+		"sng: couldn't open %s for output (%d)\n",
+		outfile, errno);
+	fclose(fpin);
+	return(1);
+    }
 
-    strcat(buf, "\n");
-    fputs(buf, stderr);
+    /* diagnostics are held back to see whether the output can be kept */
+    if (cacheable)
+	caching = (errfp = tmpfile()) != NULL;
 
-    if (png_ptr)
-	longjmp(png_jmpbuf(png_ptr), 2);
+    if (sng2png)
+	status = sngc(fpin, name, fpout);
     else
+	status = sngd(fpin, name, fpout);
+    fclose(fpin);
+    if (fclose(fpout) != 0)
+    {
+	fprintf(SNG_STDERR, "sng: error writing %s (%d)\n", outfile, errno);
+	status = max(status, 1);
+    }
+
+    if (caching)
+    {
+	FILE	*diagnostics = errfp;
+
+	errfp = NULL;
+	if (status == 0 && ftell(diagnostics) == 0 && sidecar_files == 0)
+	    cache_store(&entry, outfile);
+	replay(diagnostics, stderr);
+    }
+    return(status);
+}
+
+/*
+ * With -j, each file is converted in a child process of its own, up to
+ * the given number at a time.  A child's standard output and error go to
+ * temporary files that are copied to ours, in argument order, once it has
+ * finished, so diagnostics about different files never interleave.
+ */
+
+typedef struct
+{
+    pid_t	pid;
+    FILE	*out, *err;	/* the child's captured stdout and stderr */
+    int		status;
+    int		done;
+}
+job;
+
+static int jobs = 1;
+
+static int convert_parallel(int nfiles, char *files[])
+/* convert files in parallel child processes; return the worst status */
+{
+#ifdef HAVE_WORKING_FORK
+    job		*jp, *table;
+    int		next = 0, shown = 0, running = 0, error_status = 0;
+    int		window = 4 * jobs;	/* bounds how many outputs wait */
+
+    if (nfiles < 1)
+	return(0);
+    if ((table = calloc(nfiles, sizeof(job))) == NULL)
+    {
+	fputs("sng: out of memory\n", stderr);
 	exit(2);
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    while (shown < nfiles)
+    {
+	while (running < jobs && next < nfiles && next < shown + window)
+	{
+	    jp = table + next;
+	    if ((jp->out = tmpfile()) == NULL || (jp->err = tmpfile()) == NULL)
+	    {
+		if (jp->out)
+		    fclose(jp->out);
+		if (!running)
+		{
+		    fprintf(stderr, "sng: couldn't create temporary file (%d)\n", errno);
+		    exit(2);
+		}
+		break;
+	    }
+	    if ((jp->pid = fork()) == 0)
+	    {
+		dup2(fileno(jp->out), 1);
+		dup2(fileno(jp->err), 2);
+		exit(convert_file(files[next]));
+	    }
+	    else if (jp->pid < 0)
+	    {
+		fclose(jp->out);
+		fclose(jp->err);
+		/* try again once some of the running children have exited */
+		if (!running)
+		{
+		    fprintf(stderr, "sng: couldn't fork (%d)\n", errno);
+		    exit(2);
+		}
+		break;
+	    }
+	    running++;
+	    next++;
+	}
+
+	/* collect a child */
+	{
+	    int		wstatus;
+	    pid_t	pid = wait(&wstatus);
+
+	    if (pid < 0)
+	    {
+		fprintf(stderr, "sng: wait failed (%d)\n", errno);
+		exit(2);
+	    }
+	    for (jp = table + shown; jp < table + next; jp++)
+		if (jp->pid == pid && !jp->done)
+		{
+		    jp->done = TRUE;
+		    jp->status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 2;
+		    running--;
+		    break;
+		}
+	}
+
+	/* report finished files in order */
+	for (; shown < next && table[shown].done; shown++)
+	{
+	    jp = table + shown;
+	    replay(jp->out, stdout);
+	    fflush(stdout);
+	    replay(jp->err, stderr);
+	    error_status = max(error_status, jp->status);
+	}
+    }
+
+    free(table);
+    return(error_status);
+#else
+    int i, error_status = 0;
+
+    for (i = 0; i < nfiles; i++)
+	error_status = max(error_status, convert_file(files[i]));
+    return(error_status);
+#endif /* HAVE_WORKING_FORK */
+}
+
+/*************************************************************************
+ *
+ * In-memory round-trip verification
+ *
+ ************************************************************************/
+
+/*
+ * --verify does what sng_regress does, without the processes or the
+ * temporary files.  A PNG is decompiled, compiled, decompiled and compiled
+ * again, and the two compiled forms must be identical; an SNG goes round
+ * the same cycle starting one step earlier, and its two decompiled forms
+ * are compared.  Files are checked on several threads, each conversion
+ * with a library context of its own, and the verdicts are reported in
+ * argument order once they are all in.
+ */
+
+#define STAGES	5	/* the original and the four conversions of it */
+
+typedef struct
+{
+    char	*file;
+    const char	*failure;	/* what went wrong, or NULL */
+    char	where[80];	/* for a mismatch, where the forms part */
+    char	*errors;	/* the library's messages about it */
+    int		status;
 }
+check;
+
+static int verify;
+
+static const char *png_steps[] = {
+    "decompilation of the test PNG failed",
+    "recompilation of the decompiled form failed",
+    "generation of the canonicalized form failed",
+    "recompilation of the canonicalized form failed",
+};
+static const char *sng_steps[] = {
+    "compilation of the test SNG failed",
+    "generation of the canonicalized form failed",
+    "recompilation of the canonicalized form failed",
+    "decompilation of the canonicalized form failed",
+};
 
-void *xalloc(unsigned long s)
+static unsigned char *read_stream(FILE *fp, size_t *len)
+/* read the rest of a stream into a buffer from malloc(), or return NULL */
 {
-    void *p=malloc((size_t)s);
+    unsigned char	*buf = NULL, *bigger;
+    size_t		size = 0, n;
 
-    if (p==NULL) {
-	fatal("out of memory");
+    *len = 0;
+    do {
+	if (*len == size)
+	{
+	    size = size ? size * 2 : BUFSIZ;
+	    if ((bigger = realloc(buf, size)) == NULL)
+	    {
+		free(buf);
+		return(NULL);
+	    }
+	    buf = bigger;
+	}
+	n = fread(buf + *len, 1, size - *len, fp);
+	*len += n;
+    } while (n > 0);
+    if (ferror(fp))
+    {
+	free(buf);
+	buf = NULL;
     }
+    return(buf);
+}
 
-    return p;
+static unsigned char *read_file(char *name, size_t *len)
+/* read a whole file into a buffer from malloc(), or return NULL */
+{
+    FILE		*fp;
+    unsigned char	*buf;
+
+    if ((fp = fopen(name, "rb")) == NULL)
+	return(NULL);
+    buf = read_stream(fp, len);
+    fclose(fp);
+    return(buf);
+}
+
+static void text_difference(const char *a, size_t alen,
+			    const char *b, size_t blen, char *where)
+/* describe the first line at which two SNG texts differ */
+{
+    const char	*ap = a, *bp = b;
+    char	chunk[32] = "";
+    int		line = 1, row = -1;
+
+    for (;;)
+    {
+	const char *aend = memchr(ap, '\n', alen - (ap - a));
+	const char *bend = memchr(bp, '\n', blen - (bp - b));
+
+	if (aend == NULL || bend == NULL
+	    || aend - ap != bend - bp || memcmp(ap, bp, aend - ap))
+	    break;
+
+	/* keep track of which chunk, and which image row, we're in */
+	if (row >= 0)
+	    row++;
+	if (*ap == '}')
+	{
+	    chunk[0] = '\0';
+	    row = -1;
+	}
+	else if (isalpha((unsigned char)*ap) && chunk[0] == '\0')
+	    sscanf(ap, "%31s", chunk);
+	else if (strcmp(chunk, "IMAGE") == 0
+		 && strncmp(ap, "    pixels ", 11) == 0)
+	    row = 0;
+
+	ap = aend + 1;
+	bp = bend + 1;
+	line++;
+    }
+
+    if (row >= 0)
+	sprintf(where, "IMAGE row %d", row);
+    else if (chunk[0])
+	sprintf(where, "the %s chunk, line %d", chunk, line);
+    else
+	sprintf(where, "line %d", line);
 }
 
-void *xrealloc(void *p, unsigned long s)
+static int chunk_difference(const unsigned char *a, size_t alen,
+			    const unsigned char *b, size_t blen, char *where)
+/* describe the first chunk at which two PNGs differ; TRUE if it's IDAT */
 {
-    p=realloc(p,(size_t)s);
+    size_t	ai = 8, bi = 8, size;
+    int		n = 1;
 
-    if (p==NULL) {
-	fatal("out of memory");
+    for (;; n++)
+    {
+	if (ai + 12 > alen || bi + 12 > blen)
+	    break;
+	size = (a[ai] << 24) | (a[ai+1] << 16) | (a[ai+2] << 8) | a[ai+3];
+	if (ai + 12 + size > alen
+	    || bi + 12 + size > blen || memcmp(a + ai, b + bi, 12 + size))
+	    break;
+	ai += 12 + size;
+	bi += 12 + size;
     }
 
-    return p;
+    if (ai + 8 > alen || bi + 8 > blen)
+    {
+	sprintf(where, "length, after chunk %d", n - 1);
+	return(FALSE);
+    }
+    else if (memcmp(a + ai + 4, b + bi + 4, 4))
+    {
+	sprintf(where, "chunk %d, %.4s against %.4s", n, a + ai + 4, b + bi + 4);
+	return(FALSE);
+    }
+    sprintf(where, "chunk %d (%.4s)", n, a + ai + 4);
+    return(memcmp(a + ai + 4, "IDAT", 4) == 0);
 }
 
-char *xstrdup(char *s)
+static void verify_file(void *arg, int n)
+/* take one file round the conversion cycle and record the verdict */
 {
-    char	*r = xalloc(strlen(s) + 1);
+    check		*ck = (check *)arg + n;
+    const char		**steps;
+    sng_context		*ctx;
+    unsigned char	*form[STAGES];
+    size_t		len[STAGES];
+    int			png, i;
+
+    memset(form, '\0', sizeof(form));
+    if ((form[0] = read_file(ck->file, &len[0])) == NULL)
+    {
+	ck->failure = "couldn't be read";
+	ck->status = 1;
+	return;
+    }
+    png = len[0] >= 8 && png_sig_cmp(form[0], 0, 8) == 0;
+    steps = png ? png_steps : sng_steps;
+    if ((ctx = sng_context_new()) == NULL)
+    {
+	ck->failure = "out of memory";
+	ck->status = 2;
+	free(form[0]);
+	return;
+    }
+    sng_set_name(ctx, ck->file);
+    sng_set_max_memory(ctx, max_memory);
+
+    /* stage i is SNG when it's an odd number of steps from a PNG */
+    for (i = 1; i < STAGES; i++)
+    {
+	if ((i % 2) == png)
+	    ck->status = sng_decompile_mem(ctx, form[i-1], len[i-1],
+					   (char **)&form[i], &len[i]);
+	else
+	    ck->status = sng_compile_mem(ctx, form[i-1], len[i-1],
+					 &form[i], &len[i]);
+	if (ck->status)
+	{
+	    ck->failure = steps[i - 1];
+	    break;
+	}
+    }
+
+    if (!ck->failure && (len[2] != len[4] || memcmp(form[2], form[4], len[2])))
+    {
+	ck->failure = "decompiled and canonicalized versions differ";
+	ck->status = 1;
+	if (!png)
+	    text_difference((char *)form[2], len[2],
+			    (char *)form[4], len[4], ck->where);
+	else if (chunk_difference(form[2], len[2], form[4], len[4], ck->where))
+	{
+	    char	*last;
+	    size_t	lastlen;
 
-    strcpy(r, s);
+	    /* image data that differs is better pinned down to a row */
+	    if (sng_decompile_mem(ctx, form[4], len[4], &last, &lastlen) == 0)
+		text_difference((char *)form[3], len[3],
+				last, lastlen, ck->where);
+	    free(last);
+	}
+    }
 
-    return(r);
+    if (ck->status && *sng_errors(ctx))
+	ck->errors = strdup(sng_errors(ctx));
+    sng_context_free(ctx);
+    for (i = 0; i < STAGES; i++)
+	free(form[i]);
+}
+
+static int verify_files(int nfiles, char *files[])
+/* verify files, up to jobs of them at a time; return the worst status */
+{
+    check	*table;
+    int		i, nchecks = 0, nthreads = jobs, error_status = 0;
+    int		chatty = verbose;	/* conversions on this thread reset it */
+
+    if ((table = calloc(nfiles + 1, sizeof(check))) == NULL)
+    {
+	fputs("sng: out of memory\n", stderr);
+	exit(2);
+    }
+    for (i = 0; i < nfiles; i++)
+    {
+	int dot = strlen(files[i]) - 4;
+
+	if (dot < 0
+	    || (strcmp(files[i] + dot, ".png") && strcmp(files[i] + dot, ".sng")))
+	    printf("Non-PNG, non-SNG file `%s' ignored\n", files[i]);
+	else
+	    table[nchecks++].file = files[i];
+    }
+
+#ifdef _SC_NPROCESSORS_ONLN
+    /* without -j, use every processor */
+    if (nthreads == 1 && (nthreads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+	nthreads = 1;
+#endif /* _SC_NPROCESSORS_ONLN */
+    run_parallel(nchecks, verify_file, table, nthreads);
+
+    for (i = 0; i < nchecks; i++)
+    {
+	check	*ck = table + i;
+
+	if (ck->failure)
+	{
+	    printf("%s: %s", ck->file, ck->failure);
+	    if (ck->where[0])
+		printf(", at %s", ck->where);
+	    printf(".\n");
+	    if (ck->errors)
+		fputs(ck->errors, stdout);
+	}
+	else if (chatty)
+	    printf("%s: regression test passed.\n", ck->file);
+	free(ck->errors);
+	error_status = max(error_status, ck->status);
+    }
+
+    free(table);
+    return(error_status);
 }
 
 /*************************************************************************
  *
- * Hash initialization
+ * Conversion server
+ *
+ * With --serve, sng stays up and converts on behalf of other processes,
+ * which saves each of them starting up, and, with --rgbtxt, loading the
+ * color database.  Requests come over a Unix-domain socket, and each
+ * worker thread takes connections on its own, converting with a context
+ * and pool of its own that last as long as the server does.
+ *
+ * A request is a line
+ *
+ *	compile|decompile LENGTH STREAM LEVEL NAME
+ *
+ * followed by LENGTH bytes of input.  STREAM is 0 or 1, as for --stream;
+ * LEVEL is a deflate level or -1; NAME is used in diagnostics.  A LENGTH
+ * of `-' instead makes NAME the path of a file for the server to convert,
+ * writing the output beside it just as sng would.  The reply is a line
+ *
+ *	STATUS LENGTH ERRLENGTH
+ *
+ * followed by LENGTH bytes of output and ERRLENGTH of diagnostics.
+ * STATUS is what sng would have exited with.  A connection can carry any
+ * number of requests; sng --client sends one after another.
  *
  ************************************************************************/
 
-#undef HASHDEBUG
+static char *serve_path;	/* socket to serve conversions on */
+static char *client_path;	/* socket to have conversions done on */
 
-void initialize_hash(int hashfunc(color_item *), 
-		     color_item *hashbuckets[],
-		     int *initialized)
-/* initialize color lookup by given hash function */
+#ifdef SNG_SOCKETS
+static int socket_address(struct sockaddr_un *sa, const char *path)
+/* fill in the address of a socket, or return FALSE if the name won't fit */
 {
-    if (!*initialized)
+    memset(sa, '\0', sizeof(struct sockaddr_un));
+    sa->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa->sun_path))
     {
-	FILE	*fp;
-	int red, green, blue;
-	char line[BUFSIZ], namebuf[BUFSIZ];
+	fprintf(stderr, "sng: socket name %s is too long\n", path);
+	return(FALSE);
+    }
+    strcpy(sa->sun_path, path);
+    return(TRUE);
+}
+
+static void stop_serving(int sig)
+/* take the socket away when the server is killed */
+{
+    unlink(serve_path);
+    _exit(0);
+}
 
-	(*initialized)++;
+static int send_reply(FILE *out, int status, const void *data, size_t len,
+		      const char *errors)
+/* answer a request; FALSE if the client has gone away */
+{
+    size_t	errlen = strlen(errors);
 
-	if ((fp = fopen(RGBTXT, "r")) == NULL)
-	    fatal("RGB database %s is missing.", RGBTXT);
+    fprintf(out, "%d %lu %lu\n", status,
+	    (unsigned long)len, (unsigned long)errlen);
+    fwrite(data, 1, len, out);
+    fwrite(errors, 1, errlen, out);
+    return(fflush(out) == 0);
+}
+
+static int convert_path(sng_context *ctx, int sng2png, char *name)
+/* convert a file in place for a request, the way convert_file() does */
+{
+    char	outfile[BUFSIZ];
+    FILE	*fpin, *fpout;
+    int		status;
+
+    if (name[0] != '/' || output_name(name, outfile) != sng2png)
+	return(-1);
+    if ((fpin = fopen(name, "rb")) == NULL)
+	return(-1);
+    if ((fpout = fopen(outfile, "wb")) == NULL)
+    {
+	fclose(fpin);
+	return(-1);
+    }
+    sng_set_name(ctx, name);
+    if (sng2png)
+	status = sng_compile(ctx, fpin, fpout);
+    else
+	status = sng_decompile(ctx, fpin, fpout);
+    fclose(fpin);
+    if (fclose(fpout) != 0)
+	status = max(status, 1);
+    return(status);
+}
+
+static void serve_connection(sng_context *ctx, int fd, int chatty)
+/* answer requests on a connection until the client is done */
+{
+    FILE	*in = fdopen(fd, "rb"), *out = NULL;
+    char	line[BUFSIZ + 64], verb[16], length[32];
+    int		dup_fd = dup(fd);
+
+    if (in == NULL || dup_fd < 0 || (out = fdopen(dup_fd, "wb")) == NULL)
+    {
+	if (in)
+	    fclose(in);
 	else
+	    close(fd);
+	if (dup_fd >= 0 && out == NULL)
+	    close(dup_fd);
+	return;
+    }
+
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+	unsigned char	*data = NULL, *result = NULL;
+	size_t		len = 0, rlen = 0;
+	char		*name, *end;
+	int		sng2png, instream, level, skip = 0, status;
+
+	if ((end = strchr(line, '\n')) != NULL)
+	    *end = '\0';
+	if (end == NULL
+	    || sscanf(line, "%15s %31s %d %d %n", verb, length,
+		      &instream, &level, &skip) < 4 || skip == 0
+	    || ((sng2png = strcmp(verb, "compile") == 0) == FALSE
+		&& strcmp(verb, "decompile") != 0)
+	    || sng_set_level(ctx, level) != 0)
 	{
-	    int st;
-	    color_item sc;
+	    send_reply(out, 2, "", 0, "sng: bad request\n");
+	    break;
+	}
+	name = line + skip;
+	sng_set_stream(ctx, instream);
 
-	    for (;;)
+	if (strcmp(length, "-") == 0)
+	{
+	    if ((status = convert_path(ctx, sng2png, name)) < 0)
 	    {
-		if (fgets(line, sizeof(line) - 1, fp) == NULL)
-		    break;
-		st = sscanf(line, "%d %d %d %[^\n]\n", 
-			     &red, &green, &blue, namebuf);
-		if (feof(fp))
-		    break;
-		else if (st == 4)
-		{
-		    color_item *op, *newcolor, **hashbucket;
-
-#ifdef HASHDEBUG
-		    printf("* Caching %s = (%u, %u, %u) => %d\n",
-			   namebuf, red, green, blue, hashfunc(&sc));
-#endif /* HASHDEBUG */
-		    sc.r = (unsigned char)red;
-		    sc.g = (unsigned char)green;
-		    sc.b = (unsigned char)blue;
-		    sc.name = namebuf;
-		    hashbucket = &hashbuckets[hashfunc(&sc)];
-
-		    newcolor  = xalloc(sizeof(color_item));
-		    memcpy(newcolor, &sc, sizeof(color_item));
-		    newcolor->name = xstrdup(namebuf);
-
-		    op = *hashbucket;
-		    *hashbucket = newcolor;
-		    newcolor->next = op;
-		}
+		send_reply(out, 1, "", 0, "sng: can't convert that file\n");
+		continue;
 	    }
-	    fclose(fp);
 	}
+	else
+	{
+	    len = strtoul(length, &end, 10);
+	    if (*end != '\0')
+	    {
+		send_reply(out, 2, "", 0, "sng: bad request\n");
+		break;
+	    }
+	    if ((data = malloc(len ? len : 1)) == NULL)
+	    {
+		send_reply(out, 2, "", 0, "sng: out of memory\n");
+		break;
+	    }
+	    if (fread(data, 1, len, in) != len)
+	    {
+		free(data);
+		break;
+	    }
+	    sng_set_name(ctx, name);
+	    if (sng2png)
+		status = sng_compile_mem(ctx, data, len, &result, &rlen);
+	    else
+		status = sng_decompile_mem(ctx, data, len,
+					   (char **)&result, &rlen);
+	    free(data);
+	}
+
+	if (chatty)
+	    fprintf(stderr, "sng: %s %s: status %d\n", verb, name, status);
+	if (!send_reply(out, status, result ? result : (unsigned char *)"",
+			rlen, sng_errors(ctx)))
+	{
+	    free(result);
+	    break;
+	}
+	free(result);
     }
+
+    fclose(in);
+    fclose(out);
 }
 
-/*************************************************************************
- *
- * Utility functions
- *
- ************************************************************************/
+typedef struct
+{
+    int		fd;		/* the listening socket */
+    int		chatty;		/* log each request */
+}
+server;
 
-static int max(int x, int y)
+static void *serve_worker(void *arg)
+/* take connections and answer them, for as long as the server runs */
 {
-    return x > y ? x : y;
+    server	*sv = arg;
+    sng_context	*ctx = sng_context_new();
+
+    if (ctx == NULL)
+	return(NULL);
+    sng_set_threads(ctx, threads);
+    sng_set_max_memory(ctx, max_memory);
+    for (;;)
+    {
+	int	fd = accept(sv->fd, NULL, NULL);
+
+	if (fd >= 0)
+	    serve_connection(ctx, fd, sv->chatty);
+	else if (errno != EINTR && errno != ECONNABORTED)
+	{
+	    /* out of descriptors, probably; let some connections finish */
+	    perror("sng: accept");
+	    sleep(1);
+	}
+    }
+}
+
+static int serve(int nworkers)
+/* serve conversions on serve_path until killed */
+{
+    struct sockaddr_un	sa;
+    server		sv;
+    int			probe;
+
+    if (!socket_address(&sa, serve_path))
+	return(1);
+
+    /* a socket nobody is listening on is left over; take it over */
+    if ((probe = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0)
+    {
+	if (connect(probe, (struct sockaddr *)&sa, sizeof(sa)) == 0)
+	{
+	    fprintf(stderr, "sng: %s is already being served\n", serve_path);
+	    close(probe);
+	    return(1);
+	}
+	close(probe);
+    }
+    unlink(serve_path);
+
+    if ((sv.fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+	|| bind(sv.fd, (struct sockaddr *)&sa, sizeof(sa)) != 0
+	|| listen(sv.fd, SOMAXCONN) != 0)
+    {
+	fprintf(stderr, "sng: can't serve on %s (%s)\n",
+		serve_path, strerror(errno));
+	return(1);
+    }
+    sv.chatty = verbose;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop_serving);
+    signal(SIGTERM, stop_serving);
+    signal(SIGHUP, stop_serving);
+
+#ifdef _SC_NPROCESSORS_ONLN
+    /* without -j, a worker for every processor */
+    if (nworkers == 1 && (nworkers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+	nworkers = 1;
+#endif /* _SC_NPROCESSORS_ONLN */
+#ifdef HAVE_PTHREAD_H
+    while (--nworkers > 0)
+    {
+	pthread_t	tid;
+
+	if (pthread_create(&tid, NULL, serve_worker, &sv) != 0)
+	    break;		/* make do with the workers we have */
+	pthread_detach(tid);
+    }
+#endif /* HAVE_PTHREAD_H */
+    serve_worker(&sv);
+    return(2);			/* only if we couldn't make a context */
+}
+
+static int client_request(FILE *in, FILE *out, int sng2png, char *name,
+			  const unsigned char *data, size_t len, FILE *fpout)
+/* have one conversion done by the server; return its status */
+{
+    char		line[128];
+    int			status;
+    unsigned long	rlen, errlen;
+    char		buf[BUFSIZ];
+
+    fprintf(out, "%s %lu %d -1 %s\n", sng2png ? "compile" : "decompile",
+	    (unsigned long)len, stream ? 1 : 0, name);
+    fwrite(data, 1, len, out);
+    if (fflush(out) != 0
+	|| fgets(line, sizeof(line), in) == NULL
+	|| sscanf(line, "%d %lu %lu", &status, &rlen, &errlen) != 3)
+    {
+	fprintf(stderr, "sng: lost the server converting %s\n", name);
+	return(2);
+    }
+
+    while (rlen > 0)
+    {
+	size_t	n = fread(buf, 1, rlen < sizeof(buf) ? rlen : sizeof(buf), in);
+
+	if (n == 0)
+	    return(2);
+	fwrite(buf, 1, n, fpout);
+	rlen -= n;
+    }
+    while (errlen > 0)
+    {
+	size_t	n = fread(buf, 1, errlen < sizeof(buf) ? errlen : sizeof(buf), in);
+
+	if (n == 0)
+	    return(2);
+	fwrite(buf, 1, n, stderr);
+	errlen -= n;
+    }
+    return(status);
+}
+
+static int client(int nfiles, char *files[], const char *rgbtxt)
+/* convert files, or standard input, through the server on client_path */
+{
+    struct sockaddr_un	sa;
+    FILE		*in, *out;
+    unsigned char	*data;
+    size_t		len;
+    int			i, fd, error_status = 0;
+
+    /* the server can only do what the library interface can */
+    if (idat || no_pixels || timing || verify
+	|| data_format != DATA_AUTO || compression_override.level >= 0
+	|| compression_override.strategy >= 0
+	|| compression_override.filters >= 0
+	|| compression_override.memlevel >= 0
+	|| compression_override.idat_size >= 0 || threads > 1
+	|| excerpt.width != 0 || max_memory != 0 || cache_dir || rgbtxt)
+    {
+	fprintf(stderr, "sng: only -v and --stream go with --client\n");
+	return(1);
+    }
+
+    if (!socket_address(&sa, client_path)
+	|| (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	return(1);
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+    {
+	fprintf(stderr, "sng: can't reach a server on %s (%s)\n",
+		client_path, strerror(errno));
+	close(fd);
+	return(1);
+    }
+    if ((in = fdopen(fd, "rb")) == NULL || (out = fdopen(dup(fd), "wb")) == NULL)
+    {
+	fputs("sng: out of memory\n", stderr);
+	return(2);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (nfiles == 0)
+    {
+	if ((data = read_stream(stdin, &len)) == NULL)
+	{
+	    fputs("sng: couldn't read standard input\n", stderr);
+	    return(1);
+	}
+	error_status = client_request(in, out, len > 0 && isprint(data[0]),
+				      "stdin", data, len, stdout);
+	free(data);
+    }
+
+    for (i = 0; i < nfiles; i++)
+    {
+	char	outfile[BUFSIZ];
+	int	sng2png, status;
+	FILE	*fpout;
+
+	if ((sng2png = output_name(files[i], outfile)) < 0)
+	{
+	    fprintf(stderr, "sng: %s is neither SNG nor PNG\n", files[i]);
+	    error_status = max(error_status, 1);
+	    continue;
+	}
+	if (verbose)
+	    printf("sng: converting %s to %s\n", files[i], outfile);
+	if ((data = read_file(files[i], &len)) == NULL)
+	{
+	    fprintf(stderr, "sng: couldn't open %s for input (%d)\n",
+		    files[i], errno);
+	    error_status = max(error_status, 1);
+	    continue;
+	}
+	if ((fpout = fopen(outfile, "w")) == NULL)
+	{
+	    fprintf(stderr, "sng: couldn't open %s for output (%d)\n",
+		    outfile, errno);
+	    free(data);
+	    error_status = max(error_status, 1);
+	    continue;
+	}
+	status = client_request(in, out, sng2png, files[i], data, len, fpout);
+	free(data);
+	if (fclose(fpout) != 0)
+	{
+	    fprintf(stderr, "sng: error writing %s (%d)\n", outfile, errno);
+	    status = max(status, 1);
+	}
+	error_status = max(error_status, status);
+	if (status == 2 && feof(in))
+	    break;		/* the server has gone */
+    }
+
+    fclose(in);
+    fclose(out);
+    return(error_status);
+}
+#else
+static int serve(int nworkers)
+{
+    fputs("sng: --serve needs Unix-domain sockets\n", stderr);
+    return(1);
+}
+
+static int client(int nfiles, char *files[], const char *rgbtxt)
+{
+    fputs("sng: --client needs Unix-domain sockets\n", stderr);
+    return(1);
+}
+#endif /* SNG_SOCKETS */
+
+static int start_cache(const char *rgbtxt)
+/* open the --cache directory, keyed on all that can change an output */
+{
+    char		options[512];
+    unsigned char	*db;
+    size_t		len;
+    unsigned long long	dbhash = 0;
+
+    if (rgbtxt && (db = read_file((char *)rgbtxt, &len)) != NULL)
+    {
+	dbhash = xxh64(db, len, 0);
+	free(db);
+    }
+    sprintf(options, "sng %s libpng %s zlib %s stream %d idat %d"
+	    " no-pixels %d data-format %d level %d strategy %d filters %d"
+	    " window %d memlevel %d idat-size %ld threads %d rgbtxt %016llx"
+	    " excerpt %lu,%lu,%lu,%lu",
+	    VERSION, png_get_libpng_ver(NULL), zlibVersion(), stream, idat,
+	    no_pixels, data_format, compression_override.level,
+	    compression_override.strategy, compression_override.filters,
+	    compression_override.window, compression_override.memlevel,
+	    compression_override.idat_size, threads, dbhash,
+	    (unsigned long)excerpt.x, (unsigned long)excerpt.y,
+	    (unsigned long)excerpt.width, (unsigned long)excerpt.height);
+    if (!cache_open(cache_dir, options))
+    {
+	fprintf(stderr, "sng: can't keep a cache in %s (%s)\n",
+		cache_dir, strerror(errno));
+	return(FALSE);
+    }
+    return(TRUE);
 }
 
 int main(int argc, char *argv[])
 {
     int i = 1;
     int error_status = 0;
+    char *rgbtxt = NULL;
 
 #ifdef __EMX__
     _wildcard(&argc, &argv);   /* Unix-like globbing for OS/2 and DOS */
@@ -169,6 +1023,150 @@ int main(int argc, char *argv[])
 
     while(argc > 1 && argv[1][0] == '-')
     {
+	if (i == 1 && argv[1][1] == '-')	/* long option */
+	{
+	    if (strcmp(argv[1], "--stream") == 0)
+		++stream;
+	    else if (strcmp(argv[1], "--verify") == 0)
+		++verify;
+	    else if (strncmp(argv[1], "--serve=", 8) == 0)
+		serve_path = argv[1] + 8;
+	    else if (strncmp(argv[1], "--client=", 9) == 0)
+		client_path = argv[1] + 9;
+	    else if (strcmp(argv[1], "--no-pixels") == 0)
+		++no_pixels;
+	    else if (strncmp(argv[1], "--data-format=", 14) == 0)
+	    {
+		static const char *formats[] = {"string", "base64", "hex",
+						"rfc4648", "file", "netpbm",
+						"rle"};
+		char	*name = argv[1] + 14;
+
+		for (data_format = DATA_RLE; data_format >= DATA_STRING; data_format--)
+		    if (strcmp(name, formats[data_format]) == 0)
+			break;
+		if (data_format == DATA_AUTO && strcmp(name, "auto") != 0)
+		{
+		    fprintf(stderr,
+			    "sng: --data-format must be hex, base64, string,"
+			    " rfc4648, file, netpbm, rle or auto\n");
+		    exit(1);
+		}
+	    }
+	    else if (strcmp(argv[1], "--timing=text") == 0)
+		timing = TIMING_TEXT;
+	    else if (strcmp(argv[1], "--timing=json") == 0)
+		timing = TIMING_JSON;
+	    else if (strcmp(argv[1], "--fast") == 0)
+	    {
+		/* deflate quickly, and skip choosing row filters */
+		compression_override.level = Z_BEST_SPEED;
+		compression_override.filters = PNG_FILTER_NONE;
+	    }
+	    else if (strcmp(argv[1], "--best") == 0)
+	    {
+		compression_override.level = Z_BEST_COMPRESSION;
+		compression_override.memlevel = 9;
+	    }
+	    else if (strncmp(argv[1], "--threads=", 10) == 0)
+	    {
+		if ((threads = atoi(argv[1] + 10)) < 1)
+		{
+		    fprintf(stderr, "sng: --threads needs a positive count\n");
+		    exit(1);
+		}
+	    }
+	    else if (strncmp(argv[1], "--idat-size=", 12) == 0)
+	    {
+		if ((compression_override.idat_size = atol(argv[1] + 12)) < 6)
+		{
+		    fprintf(stderr, "sng: --idat-size must be at least 6\n");
+		    exit(1);
+		}
+	    }
+	    else if (strncmp(argv[1], "--max-memory=", 13) == 0)
+	    {
+		char			*end;
+		unsigned long long	n = strtoull(argv[1] + 13, &end, 10);
+		int			shift = 0;
+
+		if (*end == 'k' || *end == 'K')
+		    shift = 10;
+		else if (*end == 'M')
+		    shift = 20;
+		else if (*end == 'G')
+		    shift = 30;
+		if (shift)
+		    end++;
+		if (end == argv[1] + 13 || *end || n == 0
+			|| n > (unsigned long long)((size_t)-1 >> shift))
+		{
+		    fprintf(stderr,
+			    "sng: --max-memory needs a size in bytes,"
+			    " or with k, M or G\n");
+		    exit(1);
+		}
+		memory_budget = max_memory = n << shift;
+	    }
+	    else if (strncmp(argv[1], "--rows=", 7) == 0)
+	    {
+		char		*p = argv[1] + 7, *end;
+		unsigned long	first = 0, last = PNG_UINT_31_MAX;
+
+		if (*p != ':')
+		    first = strtoul(p, &p, 10);
+		end = p + 1;
+		if (*p == ':' && *end)
+		    last = strtoul(end, &end, 10);
+		if (*p != ':' || *end || first >= last || last > PNG_UINT_31_MAX)
+		{
+		    fprintf(stderr, "sng: --rows needs first:last rows\n");
+		    exit(1);
+		}
+		excerpt.x = 0;
+		excerpt.y = first;
+		excerpt.width = PNG_UINT_31_MAX;
+		excerpt.height = last - first;
+	    }
+	    else if (strncmp(argv[1], "--crop=", 7) == 0)
+	    {
+		unsigned long	x, y, w, h;
+		char		c;
+
+		if (sscanf(argv[1] + 7, "%lu,%lu,%lu,%lu%c", &x, &y, &w, &h, &c) != 4
+			|| w == 0 || h == 0 || x > PNG_UINT_31_MAX || y > PNG_UINT_31_MAX
+			|| w > PNG_UINT_31_MAX || h > PNG_UINT_31_MAX)
+		{
+		    fprintf(stderr, "sng: --crop needs x,y,width,height\n");
+		    exit(1);
+		}
+		excerpt.x = x;
+		excerpt.y = y;
+		excerpt.width = w;
+		excerpt.height = h;
+	    }
+	    else if (strncmp(argv[1], "--rgbtxt=", 9) == 0)
+	    {
+		rgbtxt = argv[1] + 9;
+		if (sng_set_rgbtxt(rgbtxt) != 0)
+		{
+		    fprintf(stderr, "sng: RGB database %s is missing.\n",
+			    argv[1] + 9);
+		    exit(1);
+		}
+	    }
+	    else if (strncmp(argv[1], "--cache=", 8) == 0)
+		cache_dir = argv[1] + 8;
+	    else
+	    {
+		fprintf(stderr, "sng: unknown option %s\n", argv[1]);
+		exit(1);
+	    }
+	    argc--;
+	    argv++;
+	    continue;
+	}
+
 	switch(argv[1][i]) {
 	case '\0':
 	    argc--;
@@ -179,10 +1177,34 @@ int main(int argc, char *argv[])
 	    ++verbose;
 	    i++;
 	    break;
-	case 'i':    /* dump raw IDAT chunks - unimplemented, undocumented */
+	case 'j':    /* parallel jobs, as -jN or -j N */
+	    if (argv[1][i+1])
+		jobs = atoi(argv[1] + i + 1);
+	    else if (argc > 2)
+	    {
+		jobs = atoi(argv[2]);
+		argc--;
+		argv++;
+	    }
+	    else
+		jobs = 0;
+	    if (jobs < 1)
+	    {
+		fprintf(stderr, "sng: -j needs a positive job count\n");
+		exit(1);
+	    }
+	    argc--;
+	    argv++;
+	    i = 1;
+	    break;
+	case 'i':    /* dump raw IDAT chunks */
 	    ++idat;
 	    i++;
 	    break;
+	case 'T':    /* time each conversion */
+	    timing = TIMING_TEXT;
+	    i++;
+	    break;
 	case 'V':
 	    fprintf(stdout, "sng version " VERSION " by Eric S. Raymond.\n");
 	    exit(0);
@@ -193,10 +1215,24 @@ int main(int argc, char *argv[])
 	}
     }
 
+    if (verify)
+	exit(verify_files(argc - 1, argv + 1));
+    if (serve_path)
+	exit(serve(jobs));
+    if (client_path)
+	exit(client(argc - 1, argv + 1, rgbtxt));
+
     if (argc == 1)
     {
 	if (isatty(0))
-	    fprintf(stderr, "sng: usage sng [-v] [file...]\n");
+	    fprintf(stderr, "sng: usage sng [-viT] [-j jobs] [--stream]"
+		    " [--no-pixels] [--verify] [--timing=text|json]"
+		    " [--data-format=hex|base64|string|rfc4648|file|netpbm|rle|auto]"
+		    " [--fast|--best] [--threads=n] [--idat-size=n]"
+		    " [--max-memory=size] [--rows=first:last|--crop=x,y,w,h]"
+		    " [--rgbtxt=file] [--cache=dir]"
+		    " [--serve=socket|--client=socket]"
+		    " [file...]\n");
 	else
 	{
 	    int	c = getchar();
@@ -205,70 +1241,26 @@ int main(int argc, char *argv[])
 
 	    if (isprint(c))
 		exit(sngc(stdin, "stdin", stdout));
-	    else
-		exit(sngd(stdin, "stdin", stdout));
+	    /* there is no file to put the image data beside */
+	    if (data_format == DATA_FILE)
+	    {
+		fprintf(stderr, "sng: --data-format=file needs a named PNG\n");
+		exit(1);
+	    }
+	    exit(sngd(stdin, "stdin", stdout));
 	}
     } 
     else
     {
-	for (i = 1; i < argc; i++)
-	{
-	    int sng2png, dot = strlen(argv[i]) - 4;
-	    char outfile[BUFSIZ];
-	    FILE	*fpin, *fpout;
-
-	    if (argv[i][dot] != '.')
-	    {
-		fprintf(stderr, "sng: %s is neither SNG nor PNG\n", argv[i]);
-		error_status = max(error_status, 1);
-		continue;
-	    }
-	    else if (strcmp(argv[i] + dot, ".sng") == 0)
-	    {
-		sng2png = TRUE;
-		strncpy(outfile, argv[i], dot);
-		outfile[dot] = '\0';
-		strcat(outfile, ".png");
-	    }
-	    else if (strcmp(argv[i] + dot, ".png") == 0)
-	    {
-		sng2png = FALSE;
-		strncpy(outfile, argv[i], dot);
-		outfile[dot] = '\0';
-		strcat(outfile, ".sng");
-	    }
-	    else
-	    {
-		fprintf(stderr, "sng: %s is neither SNG nor PNG\n", argv[i]);
-		error_status = max(error_status, 1);
-		continue;
-	    }
-
-	    if (verbose)
-		printf("sng: converting %s to %s\n", argv[i], outfile);
-
-	    if ((fpin = fopen(argv[i], "r")) == NULL)
-	    {
-		fprintf(stderr,
-			"sng: couldn't open %s for input (%d)\n",
-			argv[i], errno);
-		error_status = max(error_status, 1);
-		continue;
-	    }
-	    if ((fpout = fopen(outfile, "w")) == NULL)
-	    {
-		fprintf(stderr,
-			"sng: couldn't open %s for output (%d)\n",
-			outfile, errno);
-		error_status = max(error_status, 1);
-		continue;
-	    }
-
-	    if (sng2png)
-		error_status = max(error_status, sngc(fpin, argv[i], fpout));
-	    else
-		error_status = max(error_status, sngd(fpin, argv[i], fpout));
-	}
+	if (cache_dir && !start_cache(rgbtxt))
+	    exit(1);
+	if (jobs > 1)
+	    error_status = convert_parallel(argc - 1, argv + 1);
+	else
+	    for (i = 1; i < argc; i++)
+		error_status = max(error_status, convert_file(argv[i]));
+	if (cache_dir)
+	    cache_close();
     }
 
     return error_status;
@@ -0,0 +1,232 @@
+/*****************************************************************************
+
+NAME
+   mkkwtab.c -- generate the SNG compiler's lexical tables.
+
+SYNOPSIS
+   mkkwtab >kwtab.h
+
+DESCRIPTION
+   Writes the header sngc.c includes for tokenizing: a table classifying
+every byte the way the C-locale isspace() and ispunct() do, an enumeration
+of the chunk names and keywords of the SNG language, and a perfect hash
+taking the text of a token to its keyword number.  To add a keyword to
+the language, add it to the list below.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/* must agree with keyword_hash() in sngc.c */
+static unsigned int keyword_hash(unsigned int seed, const char *name)
+{
+    unsigned int h = 2166136261U ^ seed;
+
+    while (*name)
+    {
+	h ^= (unsigned char)*name++;
+	h *= 16777619U;
+    }
+    return(h);
+}
+
+/*
+ * The chunk names come first, in the order of properties[] in sngc.c,
+ * so that a chunk's keyword number is also its index there.
+ */
+static const struct
+{
+    const char	*id;		/* the name after KW_ in the enumeration */
+    const char	*text;		/* what the token looks like */
+}
+keywords[] =
+{
+    {"IHDR", "IHDR"}, {"PLTE", "PLTE"}, {"IDAT", "IDAT"},
+    {"cHRM", "cHRM"}, {"gAMA", "gAMA"}, {"iCCP", "iCCP"},
+    {"sBIT", "sBIT"}, {"sRGB", "sRGB"}, {"bKGD", "bKGD"},
+    {"hIST", "hIST"}, {"tRNS", "tRNS"}, {"pHYs", "pHYs"},
+    {"sPLT", "sPLT"}, {"tIME", "tIME"}, {"iTXt", "iTXt"},
+    {"tEXt", "tEXt"}, {"zTXt", "zTXt"}, {"oFFs", "oFFs"},
+    {"pCAL", "pCAL"}, {"sCAL", "sCAL"}, {"gIFg", "gIFg"},
+    {"gIFt", "gIFt"}, {"gIFx", "gIFx"}, {"fRAc", "fRAc"},
+    {"IMAGE", "IMAGE"}, {"compression", "compression"},
+    {"private", "private"},
+
+    /* punctuation */
+    {"LBRACE", "{"}, {"RBRACE", "}"}, {"LPAREN", "("}, {"RPAREN", ")"},
+
+    /* keywords within chunk specifications */
+    {"P1", "P1"}, {"P3", "P3"}, {"P5", "P5"}, {"P6", "P6"},
+    {"all", "all"}, {"alpha", "alpha"},
+    {"avg", "avg"}, {"base64", "base64"}, {"bgr", "bgr"},
+    {"bitdepth", "bitdepth"}, {"blue", "blue"}, {"code", "code"},
+    {"color", "color"}, {"compressed", "compressed"}, {"data", "data"},
+    {"day", "day"}, {"default", "default"}, {"delay", "delay"},
+    {"depth", "depth"}, {"disposal", "disposal"}, {"euler", "euler"},
+    {"exponential", "exponential"}, {"file", "file"},
+    {"filtered", "filtered"}, {"filters", "filters"}, {"fixed", "fixed"},
+    {"gray", "gray"}, {"grayscale", "grayscale"}, {"green", "green"},
+    {"height", "height"}, {"hex", "hex"}, {"hour", "hour"},
+    {"huffman", "huffman"}, {"hyperbolic", "hyperbolic"},
+    {"idatsize", "idatsize"}, {"identifier", "identifier"},
+    {"identity", "identity"}, {"index", "index"}, {"input", "input"},
+    {"interlace", "interlace"}, {"invert_alpha", "invert_alpha"},
+    {"invert_mono", "invert_mono"}, {"keyword", "keyword"},
+    {"language", "language"}, {"level", "level"}, {"linear", "linear"},
+    {"mapping", "mapping"}, {"memlevel", "memlevel"}, {"meter", "meter"},
+    {"micrometers", "micrometers"}, {"minute", "minute"},
+    {"month", "month"}, {"name", "name"}, {"none", "none"},
+    {"options", "options"}, {"packing", "packing"},
+    {"packswap", "packswap"}, {"paeth", "paeth"}, {"palette", "palette"},
+    {"parameters", "parameters"}, {"per", "per"}, {"pixels", "pixels"},
+    {"profile", "profile"}, {"radian", "radian"}, {"red", "red"},
+    {"rfc4648", "rfc4648"}, {"rle", "rle"}, {"second", "second"},
+    {"shift", "shift"}, {"strategy", "strategy"},
+    {"strip_filler", "strip_filler"}, {"sub", "sub"},
+    {"swap_alpha", "swap_alpha"}, {"swap_endian", "swap_endian"},
+    {"text", "text"}, {"translated", "translated"}, {"unit", "unit"},
+    {"up", "up"}, {"using", "using"}, {"white", "white"},
+    {"width", "width"}, {"window", "window"}, {"with", "with"},
+    {"x0", "x0"}, {"x1", "x1"}, {"xoffset", "xoffset"},
+    {"xpixels", "xpixels"}, {"year", "year"}, {"yoffset", "yoffset"},
+    {"ypixels", "ypixels"},
+};
+#define NKEYWORDS	(int)(sizeof(keywords) / sizeof(keywords[0]))
+
+static int *bucket_size;
+
+static int by_bucket_size(const void *a, const void *b)
+/* sort bucket numbers by decreasing size */
+{
+    return(bucket_size[*(const int *)b] - bucket_size[*(const int *)a]);
+}
+
+int main(int argc, char *argv[])
+{
+    int		*bucket_of, *order, *displace, *slots;
+    int		i, j, k, c, nbuckets, nslots, maxlen = 0;
+
+    if (argc != 1)
+    {
+	fputs("usage: mkkwtab >kwtab.h\n", stderr);
+	exit(1);
+    }
+
+    /* same scheme as mkrgbtab: hash-and-displace, largest buckets first */
+    nbuckets = NKEYWORDS / 4 + 1;
+    nslots = NKEYWORDS + NKEYWORDS / 4 + 1;
+    bucket_of = calloc(NKEYWORDS, sizeof(int));
+    bucket_size = calloc(nbuckets, sizeof(int));
+    order = calloc(nbuckets, sizeof(int));
+    displace = calloc(nbuckets, sizeof(int));
+    slots = malloc(nslots * sizeof(int));
+    if (!bucket_of || !bucket_size || !order || !displace || !slots)
+    {
+	fputs("mkkwtab: out of memory\n", stderr);
+	exit(1);
+    }
+    for (i = 0; i < nslots; i++)
+	slots[i] = -1;
+    for (i = 0; i < NKEYWORDS; i++)
+    {
+	for (j = 0; j < i; j++)
+	    if (strcmp(keywords[i].text, keywords[j].text) == 0)
+	    {
+		fprintf(stderr, "mkkwtab: %s is listed twice\n",
+			keywords[i].text);
+		exit(1);
+	    }
+	if ((int)strlen(keywords[i].text) > maxlen)
+	    maxlen = strlen(keywords[i].text);
+	bucket_of[i] = keyword_hash(0, keywords[i].text) % nbuckets;
+	bucket_size[bucket_of[i]]++;
+    }
+    for (i = 0; i < nbuckets; i++)
+	order[i] = i;
+    qsort(order, nbuckets, sizeof(int), by_bucket_size);
+    for (k = 0; k < nbuckets; k++)
+    {
+	int	b = order[k], seed, ok;
+
+	for (seed = 1; ; seed++)
+	{
+	    ok = 1;
+	    for (i = 0; ok && i < NKEYWORDS; i++)
+		if (bucket_of[i] == b)
+		{
+		    int	s = keyword_hash(seed, keywords[i].text) % nslots;
+
+		    if (slots[s] >= 0)
+			ok = 0;
+		    else
+			slots[s] = i;
+		}
+	    if (!ok)
+	    {
+		/* take back the keywords already placed with this seed */
+		for (j = 0; j < nslots; j++)
+		    if (slots[j] >= 0 && bucket_of[slots[j]] == b)
+			slots[j] = -1;
+		continue;
+	    }
+	    displace[b] = seed;
+	    break;
+	}
+    }
+
+    printf("/* kwtab.h -- generated by mkkwtab; do not edit */\n\n");
+
+    printf("/* byte classes, as in the C locale */\n");
+    printf("#define CHAR_SPACE\t1\t/* isspace() */\n");
+    printf("#define CHAR_SKIP\t2\t/* between tokens: space or , ; : */\n");
+    printf("#define CHAR_PUNCT\t4\t/* a token by itself: ispunct() */\n");
+    printf("#define CHAR_STOP\t8\t/* ends a word: space, or punct but . */\n\n");
+    printf("static const unsigned char char_class[256] =\n{\n");
+    for (c = 0; c < 256; c++)
+    {
+	int	cls = 0;
+
+	if (isspace(c))
+	    cls |= 1 | 2 | 8;
+	if (c == ',' || c == ';' || c == ':')
+	    cls |= 2;
+	if (ispunct(c))
+	    cls |= 4;
+	if (ispunct(c) && c != '.')
+	    cls |= 8;
+	printf("%s%2d,%s", c % 16 ? " " : "    ", cls,
+	       c % 16 == 15 ? "\n" : "");
+    }
+    printf("};\n\n");
+
+    printf("enum keyword\n{\n    KW_NONE = -1,\n");
+    for (i = 0; i < NKEYWORDS; i++)
+	printf("    KW_%s,\n", keywords[i].id);
+    printf("    KEYWORDS\n};\n\n");
+
+    printf("#define KEYWORD_MAX_LENGTH\t%d\n\n", maxlen);
+    printf("static const char *const keyword_name[KEYWORDS] =\n{\n");
+    for (i = 0; i < NKEYWORDS; i++)
+	printf("    \"%s\",\n", keywords[i].text);
+    printf("};\n\n");
+
+    printf("#define KEYWORD_BUCKETS\t%d\n\n", nbuckets);
+    printf("static const unsigned int keyword_displace[KEYWORD_BUCKETS] =\n{\n");
+    for (i = 0; i < nbuckets; i++)
+	printf("%s%u,%s", i % 10 ? " " : "    ", displace[i],
+	       i % 10 == 9 || i == nbuckets - 1 ? "\n" : "");
+    printf("};\n\n");
+
+    printf("#define KEYWORD_SLOTS\t%d\n\n", nslots);
+    printf("static const short keyword_slot[KEYWORD_SLOTS] =\n{\n");
+    for (i = 0; i < nslots; i++)
+	printf("%s%3d,%s", i % 10 ? " " : "    ", slots[i],
+	       i % 10 == 9 || i == nslots - 1 ? "\n" : "");
+    printf("};\n");
+
+    return(0);
+}
+
+/* mkkwtab.c ends here */
@@ -0,0 +1,252 @@
+/*****************************************************************************
+
+NAME
+   mkrgbtab.c -- compile an X color database into lookup tables for sng.
+
+SYNOPSIS
+   mkrgbtab rgb.txt >rgbtab.c
+
+DESCRIPTION
+   Reads the color database the way initialize_hash() does and writes C
+source for two read-only tables: a perfect hash of color names and an
+array of colors sorted by RGB value.  As when the file is parsed at run
+time, the last line for a given name or RGB value is the one that counts.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/* must agree with color_name_hash() in main.c */
+static unsigned int color_name_hash(unsigned int seed, const char *name)
+{
+    unsigned int h = 2166136261U ^ seed;
+
+    while (*name)
+    {
+	h ^= (unsigned char)*name++;
+	h *= 16777619U;
+    }
+    return(h);
+}
+
+typedef struct
+{
+    int		r, g, b;
+    char	*name;
+    int		line;		/* position in the database */
+}
+color;
+
+static color	*colors;
+static int	ncolors;
+
+static int by_name(const void *a, const void *b)
+/* sort by name, later lines first */
+{
+    const color	*ca = a, *cb = b;
+    int		cmp = strcmp(ca->name, cb->name);
+
+    return(cmp ? cmp : cb->line - ca->line);
+}
+
+static int by_value(const void *a, const void *b)
+/* sort by RGB value, later lines first */
+{
+    const color	*ca = a, *cb = b;
+    int		va = (ca->r << 16) | (ca->g << 8) | ca->b;
+    int		vb = (cb->r << 16) | (cb->g << 8) | cb->b;
+
+    return(va != vb ? va - vb : cb->line - ca->line);
+}
+
+static int *bucket_size;
+
+static int by_bucket_size(const void *a, const void *b)
+/* sort bucket numbers by decreasing size */
+{
+    return(bucket_size[*(const int *)b] - bucket_size[*(const int *)a]);
+}
+
+static void read_database(const char *path)
+/* read the database exactly as initialize_hash() would */
+{
+    FILE	*fp;
+    int		red, green, blue, size = 0;
+    char	line[BUFSIZ], namebuf[BUFSIZ];
+
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+	fprintf(stderr, "mkrgbtab: RGB database %s is missing.\n", path);
+	exit(1);
+    }
+
+    for (;;)
+    {
+	if (fgets(line, sizeof(line) - 1, fp) == NULL)
+	    break;
+	if (sscanf(line, "%d %d %d %[^\n]\n", &red, &green, &blue, namebuf) != 4
+			|| feof(fp))
+	{
+	    if (feof(fp))
+		break;
+	    continue;
+	}
+
+	if (ncolors >= size)
+	{
+	    size = size ? 2 * size : 1024;
+	    if ((colors = realloc(colors, size * sizeof(color))) == NULL)
+	    {
+		fputs("mkrgbtab: out of memory\n", stderr);
+		exit(1);
+	    }
+	}
+	colors[ncolors].r = (unsigned char)red;
+	colors[ncolors].g = (unsigned char)green;
+	colors[ncolors].b = (unsigned char)blue;
+	colors[ncolors].name = strdup(namebuf);
+	colors[ncolors].line = ncolors;
+	ncolors++;
+    }
+    fclose(fp);
+}
+
+static void print_item(const color *cp)
+/* emit a color_item initializer */
+{
+    const char	*sp;
+
+    printf("    {%3d, %3d, %3d, \"", cp->r, cp->g, cp->b);
+    for (sp = cp->name; *sp; sp++)
+	if (*sp == '"' || *sp == '\\')
+	    printf("\\%c", *sp);
+	else if (isprint((unsigned char)*sp))
+	    putchar(*sp);
+	else
+	    printf("\\%03o", (unsigned char)*sp);
+    printf("\", NULL},\n");
+}
+
+int main(int argc, char *argv[])
+{
+    color	**slots, *values;
+    int		*bucket_of, *order, *displace;
+    int		i, j, k, nnames, nbuckets, nslots;
+
+    if (argc != 2)
+    {
+	fputs("usage: mkrgbtab rgb.txt >rgbtab.c\n", stderr);
+	exit(1);
+    }
+    read_database(argv[1]);
+
+    /* keep every line for the RGB table; the runtime hash holds them all */
+    if ((values = malloc(ncolors * sizeof(color))) == NULL)
+    {
+	fputs("mkrgbtab: out of memory\n", stderr);
+	exit(1);
+    }
+    memcpy(values, colors, ncolors * sizeof(color));
+
+    /* one entry per name, from the last line that uses it */
+    qsort(colors, ncolors, sizeof(color), by_name);
+    for (i = j = 0; i < ncolors; i++)
+	if (j == 0 || strcmp(colors[i].name, colors[j - 1].name))
+	    colors[j++] = colors[i];
+    nnames = j;
+
+    /*
+     * Build a perfect hash by hash-and-displace: names fall into buckets
+     * by their unseeded hash, and each bucket, largest first, gets the
+     * smallest seed that puts all its names in empty slots.
+     */
+    nbuckets = nnames / 4 + 1;
+    nslots = nnames + nnames / 4 + 1;
+    bucket_of = calloc(nnames, sizeof(int));
+    bucket_size = calloc(nbuckets, sizeof(int));
+    order = calloc(nbuckets, sizeof(int));
+    displace = calloc(nbuckets, sizeof(int));
+    slots = calloc(nslots, sizeof(color *));
+    if (!bucket_of || !bucket_size || !order || !displace || !slots)
+    {
+	fputs("mkrgbtab: out of memory\n", stderr);
+	exit(1);
+    }
+    for (i = 0; i < nnames; i++)
+    {
+	bucket_of[i] = color_name_hash(0, colors[i].name) % nbuckets;
+	bucket_size[bucket_of[i]]++;
+    }
+    for (i = 0; i < nbuckets; i++)
+	order[i] = i;
+    qsort(order, nbuckets, sizeof(int), by_bucket_size);
+    for (k = 0; k < nbuckets; k++)
+    {
+	int	b = order[k], seed, ok;
+
+	for (seed = 1; ; seed++)
+	{
+	    ok = 1;
+	    for (i = 0; ok && i < nnames; i++)
+		if (bucket_of[i] == b)
+		{
+		    int	s = color_name_hash(seed, colors[i].name) % nslots;
+
+		    if (slots[s])
+			ok = 0;
+		    else
+			slots[s] = &colors[i];
+		}
+	    if (!ok)
+	    {
+		/* take back the names already placed with this seed */
+		for (j = 0; j < nslots; j++)
+		    if (slots[j] && bucket_of[slots[j] - colors] == b)
+			slots[j] = NULL;
+		continue;
+	    }
+	    displace[b] = seed;
+	    break;
+	}
+    }
+
+    printf("/* rgbtab.c -- generated from %s by mkrgbtab; do not edit */\n",
+	   argv[1]);
+    printf("#include <stdio.h>\n#include \"png.h\"\n#include \"sng.h\"\n\n");
+
+    printf("const int color_name_buckets = %d;\n\n", nbuckets);
+    printf("const unsigned int color_name_displace[] =\n{\n");
+    for (i = 0; i < nbuckets; i++)
+	printf("%s%u,%s", i % 10 ? " " : "    ", displace[i],
+	       i % 10 == 9 || i == nbuckets - 1 ? "\n" : "");
+    printf("};\n\n");
+
+    printf("const int color_name_slots = %d;\n\n", nslots);
+    printf("const color_item color_name_table[] =\n{\n");
+    for (i = 0; i < nslots; i++)
+	if (slots[i])
+	    print_item(slots[i]);
+	else
+	    printf("    {  0,   0,   0, NULL, NULL},\n");
+    printf("};\n\n");
+
+    /* one entry per RGB value, again from the last line that uses it */
+    qsort(values, ncolors, sizeof(color), by_value);
+    for (i = j = 0; i < ncolors; i++)
+	if (j == 0 || values[i].r != values[j-1].r
+		   || values[i].g != values[j-1].g
+		   || values[i].b != values[j-1].b)
+	    values[j++] = values[i];
+
+    printf("const int color_value_count = %d;\n\n", j);
+    printf("const color_item color_value_table[] =\n{\n");
+    for (i = 0; i < j; i++)
+	print_item(&values[i]);
+    printf("};\n");
+
+    return(0);
+}
+
+/* mkrgbtab.c ends here */
@@ -1,5 +1,20 @@
 /* sng.h -- interface to the SNG compiler */
 
+#include <stdint.h>
+
+/*
+ * Conversion state is kept per thread, so that threads embedding the
+ * library can run conversions at the same time.
+ */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L \
+	&& !defined(__STDC_NO_THREADS__)
+#define SNG_TLS	_Thread_local
+#elif defined(__GNUC__)
+#define SNG_TLS	__thread
+#else
+#define SNG_TLS
+#endif
+
 typedef struct color_item_t
 {
     unsigned char r, g, b;
@@ -11,27 +26,263 @@ color_item;
 /* this modulus should be prime and close to the line count of rgb.txt */
 #define COLOR_HASH_MODULUS	751
 
+/*
+ * SNG input is scanned straight out of memory: either a mapping of the
+ * whole file or a block buffer refilled from the stream.
+ */
+typedef struct sng_input_t
+{
+    const unsigned char	*cp;	/* next unread byte */
+    const unsigned char	*end;	/* end of the bytes available */
+    FILE		*fp;	/* stream being read */
+    unsigned char	*buf;	/* block buffer, if the stream isn't mapped */
+    void		*map;	/* base of the mapping, if it is */
+    size_t		maplen;	/* length of the mapping */
+}
+sng_input;
+
+extern void input_open(sng_input *in, FILE *fp);
+extern void input_open_mem(sng_input *in, const void *data, size_t len);
+extern int input_fill(sng_input *in);
+extern int input_skip_line(sng_input *in);
+extern const unsigned char *input_slurp(sng_input *in, size_t *len);
+extern void input_close(sng_input *in);
+extern const unsigned char *input_map_file(const char *name, size_t *len);
+extern void input_unmap_files(void);
+extern void input_read_png(png_structp png_ptr, png_bytep data, png_size_t len);
+
+/* next byte of input or EOF; input_ungetc() may back up over one byte */
+#define input_getc(in)	((in)->cp < (in)->end || input_fill(in) \
+			 ? *(in)->cp++ : EOF)
+#define input_ungetc(in)	((in)->cp--)
+
+/*
+ * PNG output goes through libpng's write callback into a large buffer,
+ * which is either written to a stream a block at a time or grown to hold
+ * the whole file in memory.
+ */
+typedef struct sng_output_t
+{
+    FILE		*fp;	/* stream being written, or NULL for memory */
+    unsigned char	*buf;
+    size_t		len;	/* bytes in the buffer */
+    size_t		size;	/* allocated size of the buffer */
+}
+sng_output;
+
+extern void output_open(sng_output *out, FILE *fp);
+extern void output_open_mem(sng_output *out);
+extern void output_write_png(png_structp png_ptr, png_bytep data, png_size_t len);
+extern void output_flush_png(png_structp png_ptr);
+extern void output_close(sng_output *out);
+
+/* a chunk's data, as passed through without interpretation */
+typedef struct raw_chunk_t
+{
+    png_const_bytep	data;
+    png_uint_32		size;
+}
+raw_chunk;
+
+/* bulk data-segment decoders and encoders; see sngcodec.c */
+extern const unsigned char hex_value[256];
+extern const unsigned char base64_value[256];
+extern size_t hex_decode_run(const unsigned char *src, size_t len, png_byte *dst);
+extern size_t base64_decode_run(const unsigned char *src, size_t len, png_byte *dst);
+extern const unsigned char rfc4648_value[256];
+extern size_t rfc4648_decode_run(const unsigned char *src, size_t len, png_byte *dst);
+extern size_t pbm_decode_run(const unsigned char *src, size_t len, png_byte *dst,
+			     size_t room, size_t *ndst);
+extern size_t ppm_decode_run(const unsigned char *src, size_t len, png_byte *dst,
+			     size_t room, unsigned int maxval, size_t *ndst);
+
+extern const char string_escape[256][5];
+extern size_t hex_encode(const png_byte *src, size_t len, int group, unsigned char *dst);
+extern size_t base64_encode(const png_byte *src, size_t len, unsigned char *dst);
+extern size_t rfc4648_encode(const png_byte *src, size_t len, unsigned char *dst);
+extern void unpack_samples(const png_byte *src, size_t n, int depth, png_byte *dst);
+extern void base64_encode_packed(const png_byte *src, size_t n, int depth,
+				 unsigned char *dst);
+extern int pack_samples(const png_byte *src, size_t n, int depth, png_byte *dst);
+
 extern int sngc(FILE *fin, char *file, FILE *fout);
 extern int sngd(FILE *fin, char *file, FILE *fout);
+extern int sngc_io(sng_input *in, char *file, sng_output *out);
+extern int sngd_io(sng_input *in, char *file, FILE *fout);
 
 extern void fatal(const char *fmt, ... );
+extern void sng_png_error(png_structp png_ptr, png_const_charp msg);
+extern void sng_png_warning(png_structp png_ptr, png_const_charp msg);
+extern png_structp sng_create_read_struct(void);
+extern png_structp sng_create_write_struct(void);
 extern void *xalloc(unsigned long s);
 extern void *xrealloc(void *p, unsigned long s);
-extern char *xstrdup(char *s);
 
-extern void initialize_hash(int hashfunc(color_item *),
-			    color_item *hashbuckets[],
-			    int *initflag);
+typedef struct pool_block_t
+{
+    struct pool_block_t	*next;
+    struct pool_block_t	*prev;
+    size_t		size;	/* usable bytes in the block */
+    size_t		used;	/* bytes handed out so far */
+}
+pool_block;
+
+typedef struct pool_map_t
+{
+    struct pool_map_t	*next;
+    void		*addr;	/* a mapping of an unlinked temporary file */
+    size_t		size;
+}
+pool_map;
+
+typedef struct
+{
+    pool_block	*blocks;	/* blocks small allocations are carved from */
+    pool_block	*large;		/* allocations with a block to themselves */
+    pool_map	*maps;		/* buffers spilled out of memory */
+}
+sng_pool;
+
+extern SNG_TLS sng_pool *conversion_pool;
+extern void *pool_alloc(sng_pool *pool, size_t s);
+extern void *pool_realloc(sng_pool *pool, void *p, size_t old, size_t s);
+extern char *pool_strdup(sng_pool *pool, const char *s);
+extern void *pool_spill(sng_pool *pool, size_t s);
+
+/* bytes a buffer may have before it is spilled to a file, or 0 for any */
+extern SNG_TLS size_t memory_budget;
+extern void pool_release(sng_pool *pool);
+
+/* color tables compiled from the X color database; see mkrgbtab.c */
+extern const int color_name_buckets;
+extern const unsigned int color_name_displace[];
+extern const int color_name_slots;
+extern const color_item color_name_table[];
+extern const int color_value_count;
+extern const color_item color_value_table[];
+
+extern const color_item *find_by_cname(const char *name);
+extern const char *find_by_rgb(int r, int g, int b);
+
+extern SNG_TLS int verbose;
+extern SNG_TLS int idat;
+extern SNG_TLS int no_pixels;
+extern SNG_TLS int stream;
+
+/* formats for dumped data, most readable first */
+#define DATA_AUTO	-1	/* whichever of the others suits the data */
+#define DATA_STRING	0
+#define DATA_BASE64	1
+#define DATA_HEX	2
+#define DATA_RFC4648	3	/* standard base64; only on request */
+#define DATA_FILE	4	/* image data in a separate file; ditto */
+#define DATA_NETPBM	5	/* binary P5 or P6 image data inline; ditto */
+#define DATA_RLE	6	/* counted runs of whole image pixels */
+
+/* the format for image data, from --data-format */
+extern SNG_TLS int data_format;
+
+/* data files beside the SNG that the last conversion read or wrote */
+extern SNG_TLS int sidecar_files;
+
+/* the window of the image a decompile dumps, from --rows and --crop */
+typedef struct
+{
+    png_uint_32	x, y;
+    png_uint_32	width, height;	/* width 0 for the whole image */
+}
+sng_excerpt;
+
+extern SNG_TLS sng_excerpt excerpt;
+
+/* parts of a conversion that -T times separately */
+#define PHASE_OTHER	0	/* setup, and whatever isn't below */
+#define PHASE_PARSE	1	/* tokenizing and parsing SNG */
+#define PHASE_DECODE	2	/* decoding data segments */
+#define PHASE_PNG	3	/* libpng and zlib, either way */
+#define PHASE_DUMP	4	/* formatting SNG */
+#define PHASE_IO	5	/* reading input and writing PNG */
+#define NPHASES		6
+
+/* how -T reports */
+#define TIMING_TEXT	1
+#define TIMING_JSON	2
+
+typedef struct sng_stats_t
+{
+    int		phase;			/* the phase now running */
+    double	wall_mark, cpu_mark;	/* the clocks when it started */
+    double	wall[NPHASES], cpu[NPHASES];
+    double	bytes_in, bytes_out;	/* bytes_out is -1 if unknown */
+    long	memory, peak_memory;	/* bytes held by sng and libpng */
+}
+sng_stats;
+
+extern SNG_TLS int timing;
+extern SNG_TLS sng_stats conversion_stats;
+extern void stats_begin(int phase);
+extern int phase_switch(int phase);
+extern void stats_report(FILE *fp, const char *file, const char *what,
+			 int status);
+extern void note_memory(long delta);
+
+/* run a statement with its time charged to a phase */
+#define TIMED(phase, stmt)	do { int prev_phase = phase_switch(phase); \
+				     stmt; phase_switch(prev_phase); } while (0)
+
+/* deflate settings; a field left at -1 gets the libpng default */
+typedef struct sng_compression_t
+{
+    int	level;		/* zlib compression level, 0-9 */
+    int	strategy;	/* zlib strategy, Z_DEFAULT_STRATEGY etc. */
+    int	filters;	/* mask of PNG_FILTER_* row filters to try */
+    int	window;		/* base-two log of the window size, 8-15 */
+    int	memlevel;	/* zlib memory level, 1-9 */
+    long idat_size;	/* largest IDAT chunk to write */
+}
+sng_compression;
+
+/* settings from the command line, which override compression chunks */
+extern SNG_TLS sng_compression compression_override;
+
+/* threads to deflate image data with; see sngzip.c */
+extern SNG_TLS int threads;
+extern void run_parallel(int ntasks, void task(void *, int), void *arg, int nthreads);
+extern int write_image_parallel(const sng_compression *sc, int nthreads);
+extern void write_trailing_chunks(void);
+
+/* the sng program's result cache; see sngcache.c */
+typedef struct
+{
+    uint64_t	name;		/* hash of the input's absolute path */
+    uint64_t	key;		/* hash of its contents and the options */
+}
+cache_entry;
+
+extern uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+extern int cache_open(const char *dir, const char *options);
+extern int cache_lookup(const char *name, int sng2png, cache_entry *entry);
+extern int cache_fetch(const cache_entry *entry, const char *outfile);
+extern void cache_store(const cache_entry *entry, const char *outfile);
+extern void cache_close(void);
+
+/* compressed ancillary payloads, deflated on the side */
+typedef struct sng_deflate_job_t deflate_job;
+extern deflate_job *payload_deflate(png_const_bytep prefix, size_t prefixlen,
+				    png_const_bytep in, size_t inlen);
+extern png_bytep payload_wait(deflate_job *job, size_t *len);
+extern void payload_end(void);
 
-extern int verbose;
-extern int idat;
+extern SNG_TLS int linenum;
+extern SNG_TLS char *file;
+extern SNG_TLS sng_input *yyin;
 
-extern int linenum;
-extern char *file;
-extern FILE *yyin;
+extern SNG_TLS png_struct *png_ptr;
+extern SNG_TLS png_info *info_ptr;
 
-extern png_struct *png_ptr;
-extern png_info *info_ptr;
+/* diagnostics go here; the library points errfp elsewhere */
+extern SNG_TLS FILE *errfp;
+#define SNG_STDERR	(errfp ? errfp : stderr)
 
 #define SUCCEED	0
 #define FAIL	-1
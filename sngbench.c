@@ -0,0 +1,514 @@
+/*****************************************************************************
+
+NAME
+   sngbench.c -- throughput benchmarks for the SNG compiler and decompiler.
+
+SYNOPSIS
+   sngbench [-q]
+
+DESCRIPTION
+   Builds synthetic corpora in memory and times the tokenizer, the data
+   segment decoders, the dump path, the color database parse and whole
+   conversions each way.  Results go to standard output one test per
+   line, tab-separated: the test name, the bytes handled in one pass,
+   the best time for a pass in seconds, and the rate in MB/s.  Each test
+   is repeated for at least MIN_PASSES passes and MIN_SECONDS seconds.
+   With -q, each test gets one pass, which is only good for checking that
+   the benchmarks still run.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "config.h"	/* for RGBTXT */
+#include "png.h"
+#include "sng.h"
+#include "sngbench.h"
+#include "libsng.h"
+
+#define MIN_PASSES	3
+#define MIN_SECONDS	0.5
+
+/* dimensions of the synthetic images */
+#define IMAGE_WIDTH	1024
+#define IMAGE_HEIGHT	768
+#define PNM_WIDTH	512
+#define PNM_HEIGHT	384
+
+#define DATA_BYTES	(2 * 1024 * 1024)	/* decoded size of data tests */
+#define NCHUNKS		2000			/* of each kind in "chunks" */
+
+static int quick;
+static sng_context *ctx;
+
+/*************************************************************************
+ *
+ * Corpus construction
+ *
+ ************************************************************************/
+
+typedef struct
+{
+    char	*data;
+    size_t	len, size;
+}
+text;
+
+static void add(text *t, const char *fmt, ...)
+/* append formatted output to a text */
+{
+    va_list	ap;
+    int		n;
+
+    for (;;)
+    {
+	va_start(ap, fmt);
+	n = vsnprintf(t->data + t->len, t->size - t->len, fmt, ap);
+	va_end(ap);
+	if (n >= 0 && (size_t)n < t->size - t->len)
+	    break;
+	t->size = t->size ? 2 * t->size : 65536;
+	if ((t->data = realloc(t->data, t->size)) == NULL)
+	{
+	    fputs("sngbench: out of memory\n", stderr);
+	    exit(2);
+	}
+    }
+    t->len += n;
+}
+
+static unsigned long seed = 1;
+
+static unsigned int noise(void)
+/* the same pseudo-random bytes every run */
+{
+    seed = seed * 1103515245 + 12345;
+    return((seed >> 16) & 0xff);
+}
+
+static const char base64_digits[] =
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz+/";
+static const char rfc4648_digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void add_hex_rows(text *t, int width, int height, int group)
+/* random bytes in hex, with a space after each group of bytes */
+{
+    int	x, y;
+
+    for (y = 0; y < height; y++)
+    {
+	for (x = 0; x < width; x++)
+	    add(t, (x + 1) % group ? "%02x" : "%02x ", noise());
+	add(t, "\n");
+    }
+}
+
+static void make_image(text *t, const char *format)
+/* an SNG holding a single large image in the given pixel format */
+{
+    int	x, y;
+
+    add(t, "#SNG: synthetic %s image\n", format);
+    if (strcmp(format, "hex") == 0)
+    {
+	add(t, "IHDR {width: %d; height: %d; bitdepth: 8; using color;}\n",
+	    IMAGE_WIDTH, IMAGE_HEIGHT);
+	add(t, "IMAGE {\n    pixels hex\n");
+	add_hex_rows(t, 3 * IMAGE_WIDTH, IMAGE_HEIGHT, 3);
+    }
+    else if (strcmp(format, "base64") == 0)
+    {
+	add(t, "IHDR {width: %d; height: %d; bitdepth: 8;}\n",
+	    IMAGE_WIDTH, IMAGE_HEIGHT);
+	add(t, "IMAGE {\n    pixels base64\n");
+	for (y = 0; y < IMAGE_HEIGHT; y++)
+	{
+	    for (x = 0; x < IMAGE_WIDTH; x++)
+		add(t, "%c", base64_digits[noise() % 64]);
+	    add(t, "\n");
+	}
+    }
+    else
+    {
+	add(t, "IHDR {width: %d; height: %d; bitdepth: 8; using color;}\n",
+	    PNM_WIDTH, PNM_HEIGHT);
+	add(t, "IMAGE {\n    pixels P3 %d %d 255\n", PNM_WIDTH, PNM_HEIGHT);
+	for (y = 0; y < PNM_HEIGHT; y++)
+	{
+	    for (x = 0; x < 3 * PNM_WIDTH; x++)
+		add(t, "%d ", noise());
+	    add(t, "\n");
+	}
+    }
+    add(t, "}\n");
+}
+
+static void make_chunks(text *t)
+/* a small image buried in text and private chunks */
+{
+    int	i;
+
+    add(t, "#SNG: synthetic chunks\n");
+    add(t, "IHDR {width: 16; height: 16; bitdepth: 8;}\n");
+    for (i = 0; i < NCHUNKS; i++)
+    {
+	add(t, "tEXt {\n  keyword: \"Comment\";\n");
+	add(t, "  text: \"Synthetic comment number %d, padded out a bit\";\n}\n", i);
+	add(t, "private prIv {\n   hex ");
+	add_hex_rows(t, 24, 1, 4);
+	add(t, "}\n");
+    }
+    add(t, "IMAGE {\n    pixels hex\n");
+    add_hex_rows(t, 16, 16, 16);
+    add(t, "}\n");
+}
+
+static void make_palette(text *t)
+/* a palette image with a full palette of named colors */
+{
+    int	i;
+
+    add(t, "#SNG: synthetic palette image\n");
+    add(t, "IHDR {width: 256; height: 256; bitdepth: 8; using palette color;}\n");
+    add(t, "PLTE {\n");
+    for (i = 0; i < 256; i++)
+	add(t, "   \"%s\"\n",
+	    color_value_table[i * color_value_count / 256].name);
+    add(t, "}\nIMAGE {\n    pixels hex\n");
+    add_hex_rows(t, 256, 256, 256);
+    add(t, "}\n");
+}
+
+static void make_segment(text *t, const char *format)
+/* one braced data segment of about DATA_BYTES decoded bytes */
+{
+    int	x, y;
+
+    if (strcmp(format, "hex") == 0)
+    {
+	add(t, "{ hex\n");
+	add_hex_rows(t, 64, DATA_BYTES / 64, 4);
+    }
+    else if (strcmp(format, "base64") == 0)
+    {
+	add(t, "{ base64\n");
+	for (y = 0; y < DATA_BYTES / 64; y++)
+	{
+	    for (x = 0; x < 64; x++)
+		add(t, "%c", base64_digits[noise() % 64]);
+	    add(t, "\n");
+	}
+    }
+    else if (strcmp(format, "rfc4648") == 0)
+    {
+	add(t, "{ rfc4648\n");
+	for (y = 0; y < DATA_BYTES / 48; y++)
+	{
+	    for (x = 0; x < 64; x++)
+		add(t, "%c", rfc4648_digits[noise() % 64]);
+	    add(t, "\n");
+	}
+    }
+    else if (strcmp(format, "string") == 0)
+    {
+	add(t, "{\n");
+	for (y = 0; y < DATA_BYTES / 64; y++)
+	{
+	    add(t, "\"");
+	    for (x = 0; x < 64; x++)
+		add(t, "%c", 'a' + noise() % 26);
+	    add(t, "\"\n");
+	}
+    }
+    else if (strcmp(format, "P1") == 0)
+    {
+	add(t, "{ P1 %d %d\n", IMAGE_WIDTH, DATA_BYTES / IMAGE_WIDTH);
+	for (y = 0; y < DATA_BYTES / IMAGE_WIDTH; y++)
+	{
+	    for (x = 0; x < IMAGE_WIDTH; x++)
+		add(t, "%c", '0' + (noise() & 1));
+	    add(t, "\n");
+	}
+    }
+    else if (strcmp(format, "P6") == 0)
+    {
+	add(t, "{ P6 %d %d 255\n", PNM_WIDTH, PNM_HEIGHT);
+	for (x = 0; x < 3 * PNM_WIDTH * PNM_HEIGHT; x++)
+	    add(t, "%c", noise());
+    }
+    else
+    {
+	add(t, "{ P3 %d %d 255\n", PNM_WIDTH, PNM_HEIGHT);
+	for (y = 0; y < PNM_HEIGHT; y++)
+	{
+	    for (x = 0; x < 3 * PNM_WIDTH; x++)
+		add(t, "%d ", noise());
+	    add(t, "\n");
+	}
+    }
+    add(t, "}\n");
+}
+
+static unsigned char **make_rows(const char *format, int width, int height)
+/* rows of bytes the dump path will write in the given format */
+{
+    unsigned char	**rows = xalloc(height * sizeof(unsigned char *));
+    int			x, y;
+
+    for (y = 0; y < height; y++)
+    {
+	rows[y] = xalloc(width);
+	for (x = 0; x < width; x++)
+	    if (strcmp(format, "string") == 0)
+		rows[y][x] = ' ' + noise() % 95;
+	    else if (strcmp(format, "base64") == 0)
+		rows[y][x] = noise() % 64;
+	    else
+		rows[y][x] = noise();
+    }
+    return(rows);
+}
+
+/*************************************************************************
+ *
+ * Timing
+ *
+ ************************************************************************/
+
+static double now(void)
+/* seconds on a clock that never goes backwards */
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void measure(const char *name, size_t bytes,
+		    void (*pass)(void *), void *arg)
+/* time passes of a test and report the best one */
+{
+    double	start = now(), best = 0, t;
+    int		passes = 0;
+
+    do {
+	t = now();
+	pass(arg);
+	t = now() - t;
+	if (passes++ == 0 || t < best)
+	    best = t;
+    } while (!quick && (passes < MIN_PASSES || now() - start < MIN_SECONDS));
+
+    printf("%s\t%lu\t%.6f\t%.2f\n", name, (unsigned long)bytes, best,
+	   best > 0 ? bytes / best / 1e6 : 0.0);
+    fflush(stdout);
+}
+
+static void check(int ok, const char *name)
+/* a benchmark that stops working is an error, not a result */
+{
+    if (!ok)
+    {
+	fprintf(stderr, "sngbench: %s failed\n%s", name, sng_errors(ctx));
+	exit(1);
+    }
+}
+
+/*************************************************************************
+ *
+ * The tests
+ *
+ ************************************************************************/
+
+typedef struct
+{
+    const char		*name;
+    text		*sng;
+    unsigned char	*png;
+    size_t		pnglen;
+    unsigned char	**rows;	/* for the dump tests */
+    int			width, height;
+    int			stream;	/* read the SNG through stdio, not in place */
+}
+test;
+
+static void lex_pass(void *arg)
+{
+    test	*tp = arg;
+    sng_input	in;
+
+    input_open_mem(&in, tp->sng->data, tp->sng->len);
+    check(sngc_bench_lex(&in) > 0, tp->name);
+    input_close(&in);
+}
+
+static void data_pass(void *arg)
+{
+    test	*tp = arg;
+    sng_input	in;
+    FILE	*fp = NULL;
+
+    if (tp->stream)
+    {
+	fp = fmemopen(tp->sng->data, tp->sng->len, "r");
+	check(fp != NULL, tp->name);
+	input_open(&in, fp);
+    }
+    else
+	input_open_mem(&in, tp->sng->data, tp->sng->len);
+    check(sngc_bench_data(&in, tp->width, tp->height) > 0, tp->name);
+    input_close(&in);
+    if (fp)
+	fclose(fp);
+}
+
+static FILE *devnull;
+
+static void dump_pass(void *arg)
+{
+    test	*tp = arg;
+
+    sngd_bench_dump(devnull, tp->width, tp->height, tp->rows);
+    fflush(devnull);
+}
+
+static void rgbtxt_pass(void *arg)
+{
+    check(sng_set_rgbtxt((const char *)arg) == 0, "rgbtxt");
+}
+
+static void compile_pass(void *arg)
+{
+    test		*tp = arg;
+    unsigned char	*png;
+    size_t		len;
+
+    check(sng_compile_mem(ctx, tp->sng->data, tp->sng->len, &png, &len) == 0,
+	  tp->name);
+    free(png);
+}
+
+static void decompile_pass(void *arg)
+{
+    test	*tp = arg;
+    char	*sng;
+    size_t	len;
+
+    check(sng_decompile_mem(ctx, tp->png, tp->pnglen, &sng, &len) == 0,
+	  tp->name);
+    free(sng);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *images[] = {"hex", "base64", "P3"};
+    static const char *segments[] = {"string", "base64", "hex", "P1", "P3",
+				     "rfc4648", "P6"};
+    static const char *dumps[] = {"string", "base64", "hex"};
+    text		corpus[5], data[7];
+    test		t;
+    char		name[64];
+    struct stat		sb;
+    int			i;
+
+    if (argc > 1 && strcmp(argv[1], "-q") == 0)
+	quick = TRUE;
+    if ((ctx = sng_context_new()) == NULL
+		|| (devnull = fopen("/dev/null", "w")) == NULL)
+    {
+	fputs("sngbench: can't set up\n", stderr);
+	exit(2);
+    }
+    sng_set_name(ctx, "bench");
+
+    memset(corpus, '\0', sizeof(corpus));
+    for (i = 0; i < 3; i++)
+	make_image(&corpus[i], images[i]);
+    make_chunks(&corpus[3]);
+    make_palette(&corpus[4]);
+
+    printf("# test\tbytes\tseconds\tMB/s\n");
+
+    /* get_token() over whole files */
+    memset(&t, '\0', sizeof(t));
+    t.name = "lex";
+    for (i = 0; i < 5; i++)
+    {
+	t.sng = &corpus[i];
+	sprintf(name, "lex/%s", i < 3 ? images[i] : i == 3 ? "chunks" : "palette");
+	measure(name, t.sng->len, lex_pass, &t);
+    }
+
+    /*
+     * collect_data() for each data format.  Binary P6 samples read in
+     * place would just be pointed at, so that one goes through stdio to
+     * time copying them out of the input instead.
+     */
+    memset(data, '\0', sizeof(data));
+    for (i = 0; i < 7; i++)
+    {
+	make_segment(&data[i], segments[i]);
+	t.sng = &data[i];
+	t.name = name;
+	t.stream = strcmp(segments[i], "P6") == 0;
+	t.width = strcmp(segments[i], "P1") == 0 ? IMAGE_WIDTH : PNM_WIDTH;
+	t.height = strcmp(segments[i], "P1") == 0
+	    ? DATA_BYTES / IMAGE_WIDTH : PNM_HEIGHT;
+	sprintf(name, "collect/%s", segments[i]);
+	measure(name, t.sng->len, data_pass, &t);
+	free(data[i].data);
+    }
+    t.stream = FALSE;
+
+    /* multi_dump() for each output format */
+    for (i = 0; i < 3; i++)
+    {
+	int	y;
+
+	t.width = 2048;
+	t.height = DATA_BYTES / 2048;
+	t.rows = make_rows(dumps[i], t.width, t.height);
+	sprintf(name, "dump/%s", dumps[i]);
+	measure(name, DATA_BYTES, dump_pass, &t);
+	for (y = 0; y < t.height; y++)
+	    free(t.rows[y]);
+	free(t.rows);
+    }
+
+    /* initialize_hash(), by way of loading the database */
+    if (stat(RGBTXT, &sb) == 0)
+    {
+	measure("rgbtxt", sb.st_size, rgbtxt_pass, RGBTXT);
+	sng_set_rgbtxt(NULL);
+    }
+
+    /* whole conversions each way */
+    for (i = 0; i < 5; i++)
+    {
+	const char	*what = i < 3 ? images[i] : i == 3 ? "chunks" : "palette";
+
+	t.sng = &corpus[i];
+	t.name = name;
+	sprintf(name, "sngc/%s", what);
+	measure(name, t.sng->len, compile_pass, &t);
+
+	check(sng_compile_mem(ctx, t.sng->data, t.sng->len,
+			      &t.png, &t.pnglen) == 0, name);
+	sprintf(name, "sngd/%s", what);
+	measure(name, t.pnglen, decompile_pass, &t);
+	free(t.png);
+    }
+
+    for (i = 0; i < 5; i++)
+	free(corpus[i].data);
+    sng_context_free(ctx);
+    fclose(devnull);
+    return(0);
+}
+
+/* sngbench.c ends here */
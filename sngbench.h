@@ -0,0 +1,12 @@
+/* sngbench.h -- pieces of the converters, for sngbench to time */
+
+/*
+ * These run parts of sngc.c and sngd.c outside a conversion.  They are
+ * no part of the library interface; only sngbench.c and the files that
+ * define them include this.
+ */
+extern long sngc_bench_lex(sng_input *in);
+extern long sngc_bench_data(sng_input *in, png_uint_32 width, png_uint_32 height);
+extern void sngd_bench_dump(FILE *fpout, int width, int height, unsigned char *rows[]);
+
+/* sngbench.h ends here */
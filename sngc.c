@@ -9,11 +9,14 @@ NAME
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
 #include "png.h"
+#include "zlib.h"
 
 #include "sng.h"
+#include "sngbench.h"
+#include "kwtab.h"
 
-extern int verbose;
 
 typedef int	bool;
 #define FALSE	0
@@ -33,10 +36,10 @@ typedef struct {
 
 #define MEMORY_QUANTUM	1024
 #define MAX_PARAMS	16
-#define PNG_MAX_LONG	2147483647L	/* 2^31 */
+#define PNG_MAX_LONG	2147483647L	/* 2^31-1 */
 
-/* chunk types */
-static chunkprops properties[] = 
+/* chunk types; mkkwtab lists their names first, in the same order */
+static SNG_TLS chunkprops properties[] = 
 {
 /*
  * The PNG 1.0 chunks, listed in order of the summary table in section 4.3.
@@ -100,49 +103,29 @@ static chunkprops properties[] =
 #define IMAGE	24
     {"IMAGE",		FALSE,	0},
 
+/*
+ * Deflate settings pseudo-chunk
+ */
+#define COMPRESSION	25
+    {"compression",	FALSE,	0},
+
 /*
  * Private chunks
  */
-#define PRIVATE	25
+#define PRIVATE	26
     {"private",		TRUE,	0},
 };
 
-static png_color palette[256];
-
-/*************************************************************************
- *
- * Color-name handling
- *
- ************************************************************************/
-
-static color_item *cname_hashbuckets[COLOR_HASH_MODULUS];
-static int cname_initialized;
-static int write_transform_options;
-
-static int hash_by_cname(color_item *cp)
-/* hash by color's RGB value */
-{
-    unsigned int h = 0;
-    char *p;
-
-    for (p = cp->name; *p; p++)
-	h = COLOR_HASH_MODULUS * h + *p;
-    return(h % COLOR_HASH_MODULUS);
-}
-
-static color_item *find_by_cname(char *name)
-/* find a character name */
-{
-   color_item sc, *hp;
-
-   sc.name = name;
+static SNG_TLS png_color palette[256];
+static SNG_TLS int write_transform_options;
 
-    for (hp = cname_hashbuckets[hash_by_cname(&sc)]; hp; hp = hp->next)
-	if (strcmp(hp->name, name) == 0)
-	    return(hp);
+/* IDAT specifications, held until the rest of the file is written */
+static SNG_TLS raw_chunk *raw_idat;
+static SNG_TLS int raw_count;
 
-    return((color_item *)NULL);
-}
+/* deflate settings libpng has been given, for the parallel encoder */
+static SNG_TLS sng_compression compression_settings;
+static const sng_compression default_compression = {-1, -1, -1, -1, -1, -1};
 
 /*************************************************************************
  *
@@ -150,12 +133,14 @@ static color_item *find_by_cname(char *name)
  *
  ************************************************************************/
 
-static char token_buffer[16384];
-static int token_class;
+static SNG_TLS char token_buffer[16384];
+static SNG_TLS int token_class;
 #define STRING_TOKEN	1
 #define PUNCT_TOKEN	2
 #define WORD_TOKEN	3
-static bool pushed;
+static SNG_TLS int token_id;	/* keyword the token spells, or KW_NONE */
+#define UNLOOKED	-2		/* token_id until something asks */
+static SNG_TLS bool pushed;
 
 static void escapes(cp, tp)
 /* process standard C-style escape sequences in a string */
@@ -202,16 +187,43 @@ char		*tp;	/* target buffer for digested string */
     *tp = '\0';
 }
 
+/* must agree with keyword_hash() in mkkwtab.c */
+static unsigned int keyword_hash(unsigned int seed, const char *name)
+{
+    unsigned int h = 2166136261U ^ seed;
+
+    while (*name)
+    {
+	h ^= (unsigned char)*name++;
+	h *= 16777619U;
+    }
+    return(h);
+}
+
+static int keyword_lookup(const char *str)
+/* which keyword is this, if any? */
+{
+    int	id;
+
+    if (strlen(str) > KEYWORD_MAX_LENGTH)
+	return(KW_NONE);
+    id = keyword_slot[keyword_hash(keyword_displace[keyword_hash(0, str)
+						    % KEYWORD_BUCKETS], str)
+		      % KEYWORD_SLOTS];
+    return(id != KW_NONE && strcmp(keyword_name[id], str) == 0 ? id : KW_NONE);
+}
+
 static int get_token(void)
 /* grab a token from yyin */
 {
-    char	w, c, *tp = token_buffer;
+    int		w, c;
+    char	*tp = token_buffer;
 
     if (pushed)
     {
 	pushed = FALSE;
 	if (verbose > 1)
-	    fprintf(stderr, "saved token: %s\n", token_buffer);
+	    fprintf(SNG_STDERR, "saved token: %s\n", token_buffer);
 	return(TRUE);
     }
 
@@ -226,26 +238,17 @@ static int get_token(void)
      */
     for (;;)
     {
-	w = fgetc(yyin);
+	w = input_getc(yyin);
 	if (w == '\n')
 	    linenum++;
-	if (feof(yyin))
+	if (w == EOF)
 	    return(FALSE);
-	else if (isspace(w) || w == ',' || w == ';' || w == ':')
+	else if (char_class[w] & CHAR_SKIP)
 	    continue;
 	else if (w == '#')		/* comment */
 	{
-	    for (;;)
-	    {
-		w = fgetc(yyin);
-		if (feof(yyin))
-		    return(FALSE);
-		if (w == '\n')
-		{
-		    ungetc(w, yyin);
-		    break;
-		}
-	    }
+	    if (!input_skip_line(yyin))
+		return(FALSE);
 	}
 	else				/* non-space character */
 	{
@@ -262,8 +265,8 @@ static int get_token(void)
 	tp = token_buffer;
 	for (;;)
 	{
-	    c = fgetc(yyin);
-	    if (feof(yyin))
+	    c = input_getc(yyin);
+	    if (c == EOF)
 		return(FALSE);
 	    else if (c == '\\' && !literal)
 	    {
@@ -290,47 +293,61 @@ static int get_token(void)
 	escapes(token_buffer, token_buffer);
 	token_class = STRING_TOKEN;
     }
-    else if (ispunct(w))
+    else if (char_class[w] & CHAR_PUNCT)
     {
 	*tp = '\0';
 	token_class = PUNCT_TOKEN;
     }
     else
     {
+	/* take the word a buffer's worth at a time, up to what ends it */
 	for (;;)
 	{
-	    c = fgetc(yyin);
-	    if (feof(yyin))
-		return(FALSE);
-	    else if (isspace(c))
-	    {
-		if (c == '\n')
-		    linenum++;
-		break;
-	    }
-	    else if (ispunct(c) && c != '.')
-	    {
-		ungetc(c, yyin);
-		break;
-	    }
-	    else if (tp >= token_buffer + sizeof(token_buffer))
+	    const unsigned char	*cp = yyin->cp;
+
+	    while (cp < yyin->end && !(char_class[*cp] & CHAR_STOP))
+		cp++;
+	    if (tp + (cp - yyin->cp) >= token_buffer + sizeof(token_buffer))
 		fatal("token too long");
-	    else
-		*tp++ = c;
+	    memcpy(tp, yyin->cp, cp - yyin->cp);
+	    tp += cp - yyin->cp;
+	    yyin->cp = cp;
+	    if (cp < yyin->end)
+		break;
+	    if (!input_fill(yyin))
+		return(FALSE);
+	}
+
+	/* whitespace after a word goes with it; punctuation doesn't */
+	if (char_class[c = *yyin->cp] & CHAR_SPACE)
+	{
+	    yyin->cp++;
+	    if (c == '\n')
+		linenum++;
 	}
 	*tp = '\0';
 	token_class = WORD_TOKEN;
     }
+    token_id = UNLOOKED;
 
     if (verbose > 1)
-	fprintf(stderr, "token: %s\n", token_buffer);
+	fprintf(SNG_STDERR, "token: %s\n", token_buffer);
     return(TRUE);
 }
 
-static int token_equals(const char *str)
-/* does the currently fetched token equal a specified string? */
+static int token_keyword(void)
+/* which keyword is the currently fetched token? */
 {
-    return !strcmp(str, token_buffer);
+    /* bulk data is never compared against anything, so look only if asked */
+    if (token_id == UNLOOKED)
+	token_id = keyword_lookup(token_buffer);
+    return(token_id);
+}
+
+static int token_is(int id)
+/* is the currently fetched token a given keyword? */
+{
+    return(token_keyword() == id);
 }
 
 static int get_inner_token(void)
@@ -338,24 +355,25 @@ static int get_inner_token(void)
 {
     if (!get_token())
 	fatal("unexpected EOF");
-    return(!token_equals("}"));	/* do we see end delimiter? */
+    return(!token_is(KW_RBRACE));	/* do we see end delimiter? */
 }
 
 static void push_token(void)
 /* push back a token; must always be followed immediately by get_token */
 {
     if (verbose > 1)
-	fprintf(stderr, "pushing token: %s\n", token_buffer);
+	fprintf(SNG_STDERR, "pushing token: %s\n", token_buffer);
     pushed = TRUE;
 }
 
-static void require_or_die(const char *str)
-/* croak if the next token doesn't match what we expect */
+static void require_or_die(int id)
+/* croak if the next token isn't the keyword we expect */
 {
     if (!get_token())
 	fatal("unexpected EOF");
-    else if (!token_equals(str))
-	fatal("unexpected token `%s' while waiting for %s", token_buffer, str);
+    else if (!token_is(id))
+	fatal("unexpected token `%s' while waiting for %s",
+	      token_buffer, keyword_name[id]);
 }
 
 static png_uint_32 long_numeric(bool token_ok)
@@ -367,7 +385,7 @@ static png_uint_32 long_numeric(bool token_ok)
     if (!token_ok)
 	fatal("EOF while expecting long-integer constant");
     result = strtoul(token_buffer, &vp, 0);
-    if (*vp || result >= PNG_MAX_LONG)
+    if (*vp || result > PNG_MAX_LONG)
 	fatal("invalid or out of range long constant `%s'", token_buffer);
     return(result);
 }
@@ -381,7 +399,7 @@ static png_int_32 slong_numeric(bool token_ok)
     if (!token_ok)
 	fatal("EOF while expecting signed long-integer constant");
     result = strtol(token_buffer, &vp, 0);
-    if (*vp || result >= PNG_MAX_LONG || result <= -PNG_MAX_LONG)
+    if (*vp || result > PNG_MAX_LONG || result < -PNG_MAX_LONG)
 	fatal("invalid or out of range long constant `%s'", token_buffer);
     return(result);
 }
@@ -468,8 +486,375 @@ static int keyword_validate(bool token_ok, char *stash)
     }
 }
 
-static void collect_data(int *pnbytes, png_byte **pbytes)
-/* collect data in either bitmap format */
+/*
+ * Decoded data goes to a sink.  When the sink's buffer fills, its full()
+ * hook is called to make room, either by growing the buffer or by passing
+ * the contents on somewhere else.
+ *
+ * The pixels of an image with less than 8 bits per sample are packed
+ * several to a byte.  The formats that give one number per sample -- the
+ * base64 digits, netpbm values and rle runs -- go a row at a time into the sink's
+ * samples buffer, which is packed into its bytes as each row fills; the
+ * others give the packed bytes themselves.
+ */
+typedef struct data_sink_t
+{
+    png_byte	*bytes;		/* buffer for decoded bytes */
+    size_t	nbytes;		/* bytes currently in the buffer */
+    size_t	size;		/* allocated size of the buffer */
+    void	(*full)(struct data_sink_t *);	/* make room in the buffer */
+    int		depth;		/* bits per packed sample, or 0 */
+    png_byte	*samples;	/* one row of samples, a byte each */
+    int		width, col;	/* samples in a row, and so far this row */
+    int		pixel;		/* bytes per unpacked pixel in rle, or 0 */
+} data_sink;
+
+static void sink_put(data_sink *sink, const char *data, size_t len)
+/* copy a run of bytes into a sink */
+{
+    while (len > 0)
+    {
+	size_t	room;
+
+	if (sink->nbytes >= sink->size)
+	    sink->full(sink);
+	room = sink->size - sink->nbytes;
+	if (room > len)
+	    room = len;
+	memcpy(sink->bytes + sink->nbytes, data, room);
+	sink->nbytes += room;
+	data += room;
+	len -= room;
+    }
+}
+
+static void sink_packing(data_sink *sink, int bit_depth)
+/* have a sink pack the samples of rows of the given bit depth */
+{
+    sink->depth = 0;
+    if (bit_depth < 8)
+    {
+	sink->depth = bit_depth;
+	sink->width = png_get_image_width(png_ptr, info_ptr);
+	sink->samples = pool_alloc(conversion_pool, sink->width);
+	sink->col = 0;
+    }
+}
+
+static void sink_row(data_sink *sink)
+/* pack a completed row of samples into a sink */
+{
+    if (!pack_samples(sink->samples, sink->width, sink->depth, sink->samples))
+	fatal("sample value too large for bit depth %d", sink->depth);
+    sink_put(sink, (const char *)sink->samples,
+	     (sink->width * sink->depth + 7) / 8);
+    sink->col = 0;
+}
+
+static void sink_sample(data_sink *sink, png_byte value)
+/* put one sample into a packing sink */
+{
+    sink->samples[sink->col++] = value;
+    if (sink->col == sink->width)
+	sink_row(sink);
+}
+
+static void sink_samples(data_sink *sink, const png_byte *data, size_t len)
+/* put a run of samples into a packing sink */
+{
+    while (len > 0)
+    {
+	size_t	n = sink->width - sink->col;
+
+	if (n > len)
+	    n = len;
+	memcpy(sink->samples + sink->col, data, n);
+	sink->col += n;
+	data += n;
+	len -= n;
+	if (sink->col == sink->width)
+	    sink_row(sink);
+    }
+}
+
+static void grow_buffer(data_sink *sink)
+/* make room in a sink by doubling its buffer */
+{
+    if (sink->size > (size_t)-1 / 4)
+	fatal("data segment is too large to hold in memory");
+    sink->bytes = pool_realloc(conversion_pool, sink->bytes,
+			       sink->size, 2 * sink->size);
+    sink->size *= 2;
+}
+
+static void too_many_samples(data_sink *sink)
+/* refuse to make room in a sink that holds exactly a whole image */
+{
+    fatal("sample count exceeds width*height (%lu*%lu) in IHDR",
+	  (unsigned long)png_get_image_width(png_ptr, info_ptr),
+	  (unsigned long)png_get_image_height(png_ptr, info_ptr));
+}
+
+static size_t netpbm_header(sng_input *in, int magic, const char *where,
+			    int depth)
+/*
+ * Check the rest of a PGM or PPM header against IHDR, where samples are
+ * to be packed depth bits each if that's not 0; return the raster size.
+ */
+{
+    png_uint_32	field[3];
+    int		i, c;
+
+    for (i = 0; i < 3; i++)
+    {
+	for (;;)
+	{
+	    c = input_getc(in);
+	    if (c == '#')
+	    {
+		if (!input_skip_line(in))
+		    c = EOF;
+		else
+		    continue;
+	    }
+	    else if (c != EOF && (char_class[c] & CHAR_SPACE))
+	    {
+		if (c == '\n' && in == yyin)
+		    linenum++;
+		continue;
+	    }
+	    break;
+	}
+	if (c == EOF || !isdigit(c))
+	    fatal("bad netpbm header in %s", where);
+	for (field[i] = 0; c != EOF && isdigit(c); c = input_getc(in))
+	    if ((field[i] = 10 * field[i] + (c - '0')) > 0x7fffffff / 10)
+		fatal("bad netpbm header in %s", where);
+	if (c != EOF)
+	    input_ungetc(in);
+    }
+
+    /* exactly one whitespace character comes before the raster */
+    if ((c = input_getc(in)) == EOF || !(char_class[c] & CHAR_SPACE))
+	fatal("bad netpbm header in %s", where);
+    if (c == '\n' && in == yyin)
+	linenum++;
+
+    if (field[0] != png_get_image_width(png_ptr, info_ptr)
+	    || field[1] != png_get_image_height(png_ptr, info_ptr))
+	fatal("netpbm image dimensions in %s don't match IHDR", where);
+    if (field[2] == 0 || field[2] > 65535)
+	fatal("bad netpbm maximum value in %s", where);
+    if (depth && field[2] >= 1U << depth)
+	fatal("netpbm maximum value in %s is too large for bit depth %d",
+	      where, depth);
+
+    /* the raster of a huge image may not fit in the address space */
+    if (field[0] && (uint64_t)field[1] * (magic == '6' ? 3 : 1)
+		* (field[2] > 255 ? 2 : 1) > (size_t)-1 / field[0])
+	fatal("netpbm image in %s is too large", where);
+
+    return((size_t)field[0] * field[1] * (magic == '6' ? 3 : 1)
+	   * (field[2] > 255 ? 2 : 1));
+}
+
+static void read_data_file(data_sink *sink)
+/* take a data segment's bytes from the file named by the next token */
+{
+    char		path[BUFSIZ];
+    const char		*dir = strrchr(file, '/');
+    const unsigned char	*data;
+    size_t		len;
+
+    if (!get_inner_token() || token_class != STRING_TOKEN)
+	fatal("missing file name in data segment");
+
+    /* relative names are taken from the SNG file's directory */
+    if (token_buffer[0] == '/' || dir == NULL)
+	dir = file;
+    if ((dir - file) + strlen(token_buffer) + 2 > sizeof(path))
+	fatal("data file name %s is too long", token_buffer);
+    sprintf(path, "%.*s%s%s", (int)(dir - file), file,
+	    dir > file ? "/" : "", token_buffer);
+
+    if ((data = input_map_file(path, &len)) == NULL)
+	fatal("can't read data file %s (%s)", path, strerror(errno));
+    sidecar_files++;
+
+    /* skip a PGM or PPM header, after checking it against IHDR */
+    if (len > 2 && data[0] == 'P' && (data[1] == '5' || data[1] == '6')
+		&& isspace(data[2]))
+    {
+	sng_input	pnm;
+	size_t		size;
+
+	input_open_mem(&pnm, data + 2, len - 2);
+	size = netpbm_header(&pnm, data[1], path, sink->depth);
+	if ((size_t)(pnm.end - pnm.cp) < size)
+	    fatal("%s is shorter than its netpbm header says", path);
+	if (sink->depth)
+	{
+	    sink_samples(sink, pnm.cp, size);
+	    return;
+	}
+	data = pnm.cp;
+	len = size;
+    }
+
+    /* a buffer of our own can simply be pointed at the file's contents */
+    if ((sink->full == grow_buffer || sink->full == too_many_samples)
+		&& sink->nbytes == 0)
+    {
+	sink->bytes = (png_byte *)data;
+	sink->nbytes = sink->size = len;
+    }
+    else
+	sink_put(sink, (const char *)data, len);
+}
+
+static void rfc4648_tail(data_sink *sink, unsigned long group, int n)
+/* put the bytes of a group of n < 4 RFC 4648 characters into a sink */
+{
+    char	bytes[2];
+
+    if (n == 1)
+	fatal("incomplete base64 group in data block");
+    bytes[0] = group >> (n == 2 ? 4 : 10);
+    bytes[1] = group >> 2;
+    sink_put(sink, bytes, n - 1);
+}
+
+#define RLE_PATTERN	4096	/* bytes of repeated pixel put at a time */
+
+static void rle_run(data_sink *sink, const png_byte *pixel, uint64_t count)
+/* put count copies of a pixel into a sink */
+{
+    png_byte	pattern[RLE_PATTERN];
+    size_t	i, n, per;
+
+    if (sink->depth)
+	while (count > 0)
+	{
+	    n = sink->width - sink->col;
+	    if (n > count)
+		n = count;
+	    memset(sink->samples + sink->col, pixel[0], n);
+	    sink->col += n;
+	    count -= n;
+	    if (sink->col == sink->width)
+		sink_row(sink);
+	}
+    else
+    {
+	per = RLE_PATTERN / sink->pixel;
+	for (i = 0; i < per && i < count; i++)
+	    memcpy(pattern + i * sink->pixel, pixel, sink->pixel);
+	while (count > 0)
+	{
+	    n = count < per ? count : per;
+	    sink_put(sink, (const char *)pattern, n * sink->pixel);
+	    count -= n;
+	}
+    }
+}
+
+static void rle_word(int c, char *word, size_t size)
+/* read a word of hex digits starting with c; leave what follows unread */
+{
+    size_t	n = 0;
+
+    while (c != EOF && isxdigit(c))
+    {
+	if (n < size - 1)
+	    word[n] = c;
+	n++;
+	c = input_getc(yyin);
+    }
+    if (c != EOF)
+	input_ungetc(yyin);
+    word[n < size ? n : size - 1] = '\0';
+}
+
+static void decode_rle(data_sink *sink)
+/* decode rle image data, runs of count*pixel or single pixels, into a sink */
+{
+    uint64_t	limit = (uint64_t)png_get_image_width(png_ptr, info_ptr)
+			* png_get_image_height(png_ptr, info_ptr);
+    size_t	i, digits = sink->depth ? 1 : 2 * sink->pixel;
+    png_byte	pixel[8];
+    char	word[24];
+    int		c;
+
+    if (!sink->depth && !sink->pixel)
+	fatal("rle data can only be image pixels");
+
+    for (;;)
+    {
+	uint64_t	count = 1;
+
+	c = input_getc(yyin);
+	if (c == EOF)
+	    fatal("unexpected EOF in data segment");
+	else if (c == 0 || c == ';')
+	    break;
+	else if (c == '}')
+	{
+	    input_ungetc(yyin);
+	    break;
+	}
+	else if (c == '#')
+	{
+	    if (input_skip_line(yyin))
+	    {
+		input_getc(yyin);
+		linenum++;
+	    }
+	    continue;
+	}
+	else if (char_class[c] & CHAR_SPACE)
+	{
+	    if (c == '\n')
+		linenum++;
+	    continue;
+	}
+	else if (!isxdigit(c))
+	    fatal("bad character %02x in rle data", c);
+
+	/* a word of digits is a count if a `*' comes straight after it */
+	rle_word(c, word, sizeof(word));
+	if ((c = input_getc(yyin)) == '*')
+	{
+	    for (i = 0; word[i]; i++)
+		if (!isdigit((unsigned char)word[i]) || i > 18)
+		    fatal("bad rle run length %s", word);
+	    if ((count = strtoull(word, NULL, 10)) == 0 || count > limit)
+		fatal("rle run length %s is out of range", word);
+	    c = input_getc(yyin);
+	    if (c == EOF || !isxdigit(c))
+		fatal("missing pixel after rle run length %s", word);
+	    rle_word(c, word, sizeof(word));
+	}
+	else if (c != EOF)
+	    input_ungetc(yyin);
+	if (strlen(word) != digits)
+	    fatal("rle pixel %s should have %d hex digits", word, (int)digits);
+
+	for (i = 0; i < digits / 2; i++)
+	    pixel[i] = hex_value[(unsigned char)word[2 * i]] << 4
+		       | hex_value[(unsigned char)word[2 * i + 1]];
+	if (sink->depth)
+	{
+	    pixel[0] = hex_value[(unsigned char)word[0]];
+	    if (pixel[0] >= 1 << sink->depth)
+		fatal("rle pixel %s is too large for bit depth %d",
+		      word, sink->depth);
+	}
+	rle_run(sink, pixel, count);
+    }
+}
+
+static void decode_data(data_sink *sink)
+/* decode a data segment in any of the supported formats into a sink */
 {
     /*
      * A data segment consists of a byte stream. 
@@ -498,43 +883,66 @@ static void collect_data(int *pnbytes, png_byte **pbytes)
      *   pbm format P1 (see pbm(5)).
      *
      * P3:
-     *   ppm format P3 (see ppm(5)).
+     *   ppm format P3 (see ppm(5)); with a maxval above 255 each sample
+     *   makes two bytes, most significant first.
+     *
+     * P5, P6:
+     *   the binary pgm and ppm formats (see pgm(5) and ppm(5)): header
+     *   fields and a single whitespace character, then the raster bytes
+     *   themselves, copied straight into the image.
+     *
+     * The base64, P1, P3, P5 and P6 formats give a sample per number,
+     * which a packing sink packs for images of bit depth 1, 2 and 4;
+     * the others give the bytes of the rows as they are.
+     *
+     * rfc4648:
+     *   Standard base64, four characters for every three bytes, with
+     *   `=' padding at the end if need be.
+     *
+     * file:
+     *   A string naming a file that holds the bytes; see read_data_file().
      *
-     * In either format, whitespace is ignored.
+     * In the text formats, whitespace is ignored.
      */
-    png_byte *bytes = xalloc(MEMORY_QUANTUM);
-    int quanta = 1;
-    int	nbytes = 0;
     int ocount = 0;
     int c, maxval = 0;
+    unsigned long group = 0;
 #define BASE64_FMT	0
 #define HEX_FMT		1
 #define P1_FMT		2
 #define P3_FMT		3
+#define RFC4648_FMT	4
+#define NETPBM_FMT	5
     int fmt = 0;
 
     if (!get_inner_token())
 	fatal("missing format type in data segment");
     else if (token_class == STRING_TOKEN)
     {
-	*pnbytes = 0;
-	*pbytes = NULL;
 	do {
-	    int	seglen = strlen(token_buffer);
-
-	    *pbytes = xrealloc(*pbytes, *pnbytes + seglen);
-	    memcpy(*pbytes + *pnbytes, token_buffer, seglen);
-	    *pnbytes += seglen;	    
+	    sink_put(sink, token_buffer, strlen(token_buffer));
 	} while
 	      (get_inner_token() && token_class == STRING_TOKEN);
 	push_token();
 	return;
     }
-    else if (token_equals("base64"))
+    else if (token_is(KW_base64))
 	fmt = BASE64_FMT;
-    else if (token_equals("hex"))
+    else if (token_is(KW_hex))
 	fmt = HEX_FMT;
-    else if (token_equals("P1"))
+    else if (token_is(KW_rfc4648))
+	fmt = RFC4648_FMT;
+    else if (token_is(KW_file))
+    {
+	read_data_file(sink);
+	return;
+    }
+    else if (token_is(KW_rle))
+    {
+	decode_rle(sink);
+	return;
+    }
+    else if (token_is(KW_P1))
     {
 	int width = short_numeric(get_token());
 	int height = short_numeric(get_token());
@@ -543,7 +951,7 @@ static void collect_data(int *pnbytes, png_byte **pbytes)
 	    fatal("pbm image dimensions don't mastch IHDR");
 	fmt = P1_FMT;
     }
-    else if (token_equals("P3"))
+    else if (token_is(KW_P3))
     {
 	int width = short_numeric(get_token());
 	int height = short_numeric(get_token());
@@ -552,43 +960,154 @@ static void collect_data(int *pnbytes, png_byte **pbytes)
 
 	if (width != png_get_image_width(png_ptr, info_ptr) && height != png_get_image_height(png_ptr, info_ptr))
 	    fatal("ppm image dimensions don't match IHDR");
+	if (sink->depth && maxval >= 1 << sink->depth)
+	    fatal("ppm maximum value is too large for bit depth %d",
+		  sink->depth);
 	fmt = P3_FMT;
     }
+    else if (token_is(KW_P5) || token_is(KW_P6))
+    {
+	size_t	size = netpbm_header(yyin, token_buffer[1], "data segment",
+				     sink->depth);
+
+	/* a buffer of our own can point into input that's all in memory */
+	if (!sink->depth && sink->nbytes == 0
+		&& (sink->full == grow_buffer || sink->full == too_many_samples)
+		&& yyin->buf == NULL && (size_t)(yyin->end - yyin->cp) >= size)
+	{
+	    sink->bytes = (png_byte *)yyin->cp;
+	    sink->nbytes = sink->size = size;
+	    yyin->cp += size;
+	}
+	else
+	    while (size > 0)
+	    {
+		size_t	n = yyin->end - yyin->cp;
+
+		if (n == 0)
+		{
+		    if (!input_fill(yyin))
+			fatal("unexpected EOF in data segment");
+		    continue;
+		}
+		if (n > size)
+		    n = size;
+		if (sink->depth)
+		    sink_samples(sink, yyin->cp, n);
+		else
+		    sink_put(sink, (const char *)yyin->cp, n);
+		yyin->cp += n;
+		size -= n;
+	    }
+	fmt = NETPBM_FMT;
+    }
     else
 	fatal("unknown data format");
 
-    while ((c = fgetc(yyin)))
+    for (;;)
     {
-	if (feof(yyin))
+	/*
+	 * Runs of digits go through the bulk decoders, which stop at the
+	 * first character that isn't one.  Everything else -- whitespace,
+	 * comments, terminators, the odd half of a split hex pair, errors --
+	 * falls through to the character loop below, which keeps linenum.
+	 */
+	if (fmt == BASE64_FMT || (fmt == HEX_FMT && !(ocount % 2))
+			|| (fmt == RFC4648_FMT && ocount == 0)
+			|| fmt == P1_FMT || fmt == P3_FMT)
+	{
+	    png_byte	*dst;
+	    size_t	avail, used, got, room;
+	    int		packing = sink->depth && fmt != HEX_FMT
+					       && fmt != RFC4648_FMT;
+
+	    if (yyin->cp >= yyin->end && !input_fill(yyin))
+		fatal("unexpected EOF in data segment");
+
+	    /* samples to be packed are decoded into the row being built */
+	    if (packing)
+	    {
+		dst = sink->samples + sink->col;
+		room = sink->width - sink->col;
+	    }
+	    else
+	    {
+		/* leave a full buffer to the character loop, if there's more */
+		dst = sink->bytes + sink->nbytes;
+		room = sink->size - sink->nbytes;
+	    }
+	    avail = yyin->end - yyin->cp;
+
+	    if (fmt == HEX_FMT)
+	    {
+		if (avail / 2 > room)
+		    avail = 2 * room;
+		used = hex_decode_run(yyin->cp, avail, dst);
+		got = used / 2;
+		ocount += used;
+	    }
+	    else if (fmt == RFC4648_FMT)
+	    {
+		if (avail / 4 > room / 3)
+		    avail = room / 3 * 4;
+		used = rfc4648_decode_run(yyin->cp, avail, dst);
+		got = used / 4 * 3;
+	    }
+	    else if (fmt == P1_FMT)
+		used = pbm_decode_run(yyin->cp, avail, dst, room, &got);
+	    else if (fmt == P3_FMT)
+		used = ppm_decode_run(yyin->cp, avail, dst, room, maxval, &got);
+	    else
+	    {
+		if (avail > room)
+		    avail = room;
+		used = got = base64_decode_run(yyin->cp, avail, dst);
+	    }
+
+	    if (!packing)
+		sink->nbytes += got;
+	    else if ((sink->col += got) == sink->width)
+		sink_row(sink);
+	    yyin->cp += used;
+	    if (used)
+		continue;
+	}
+
+	c = input_getc(yyin);
+	if (c == EOF)
 	    fatal("unexpected EOF in data segment");
+	else if (c == 0)
+	    break;
 	else if (c == ';')
 	    break;
 	else if (c == '}')
 	{
-	    ungetc('}', yyin);
+	    input_ungetc(yyin);
 	    break;
 	}
 	else if (c == '#')	/* handle comments */
 	{
-	    while ((c = fgetc(yyin)))
-		if (feof(yyin) || c == '\n')
-		    break;
-	    if (c == '\n')
+	    if (input_skip_line(yyin))
+	    {
+		input_getc(yyin);
 		linenum++;
+	    }
 	    continue;
 	}
-	else if (isspace(c))	/* skip whitespace */
+	else if (char_class[c] & CHAR_SPACE)	/* skip whitespace */
 	{
 	    if (c == '\n')
 		linenum++;
+	    while (yyin->cp < yyin->end && (*yyin->cp == ' ' || *yyin->cp == '\t'))
+		yyin->cp++;
 	    continue;
 	}
 	else 
         {
 	    unsigned char	value = 0;
 
-	    if (nbytes >= quanta * MEMORY_QUANTUM)
-		bytes = xrealloc(bytes, MEMORY_QUANTUM * ++quanta);
+	    if (sink->nbytes >= sink->size)
+		sink->full(sink);
 
 	    switch(fmt)
 	    {
@@ -607,7 +1126,10 @@ static void collect_data(int *pnbytes, png_byte **pbytes)
 		    value = 63;
 		else
 		    fatal("bad character %02x in data block", c);
-		bytes[nbytes++] = value;
+		if (sink->depth)
+		    sink_sample(sink, value);
+		else
+		    sink->bytes[sink->nbytes++] = value;
 		break;
 
 	    case HEX_FMT:
@@ -620,21 +1142,23 @@ static void collect_data(int *pnbytes, png_byte **pbytes)
 		else 
 		    value = (c - 'a') + 10;
 		if (ocount++ % 2)
-		    bytes[nbytes++] |= value;
+		    sink->bytes[sink->nbytes++] |= value;
 		else
-		    bytes[nbytes] = value * 16;
+		    sink->bytes[sink->nbytes] = value * 16;
 		break;
 
 	    case P1_FMT:
-		if (c == '0')
-		    bytes[nbytes++] = 0;
-		else if (c == '1')
-		    bytes[nbytes++] = 1;
-		else
+		if (c != '0' && c != '1')
 		    fatal("bad pbm character %02x in data block", c);
+		else if (sink->depth)
+		    sink_sample(sink, c - '0');
+		else
+		    sink->bytes[sink->nbytes++] = c - '0';
 		break;
 
 	    case P3_FMT:
+		/* the first digit belongs to the number token */
+		input_ungetc(yyin);
 		c = short_numeric(get_token());
 
 		if (c > maxval)
@@ -644,18 +1168,81 @@ static void collect_data(int *pnbytes, png_byte **pbytes)
 		 * Channel order in PBM is R, then G, then B, same as PNG;
 		 * so a straight copy in the order we see them will work.
 		 */
-		bytes[nbytes++] = c;
+		if (sink->depth)
+		    sink_sample(sink, c);
+		else if (maxval > 255)
+		{
+		    char	bytes[2];
+
+		    bytes[0] = c >> 8;
+		    bytes[1] = c;
+		    sink_put(sink, bytes, 2);
+		}
+		else
+		    sink->bytes[sink->nbytes++] = c;
+		break;
+
+	    case NETPBM_FMT:
+		fatal("bad character %02x after netpbm data", c);
+		break;
+
+	    case RFC4648_FMT:
+		/* ocount is the number of characters in the current group */
+		if (c == '=')
+		{
+		    if (ocount)
+			rfc4648_tail(sink, group, ocount);
+		    ocount = 0;
+		    break;
+		}
+		else if ((value = rfc4648_value[c]) > 63)
+		    fatal("bad base64 character %02x in data block", c);
+		group = (group << 6) | value;
+		if (++ocount == 4)
+		{
+		    char	bytes[3];
+
+		    bytes[0] = group >> 16;
+		    bytes[1] = group >> 8;
+		    bytes[2] = group;
+		    sink_put(sink, bytes, 3);
+		    ocount = 0;
+		    group = 0;
+		}
 		break;
 	    }
 	}
     }
+
+    /* the padding is optional */
+    if (fmt == RFC4648_FMT && ocount)
+	rfc4648_tail(sink, group, ocount);
 #undef BASE64_FMT
 #undef HEX_FMT
 #undef P1_FMT
 #undef P3_FMT
+#undef RFC4648_FMT
+#undef NETPBM_FMT
+}
 
-    *pnbytes = nbytes;
-    *pbytes = bytes;
+static void collect_data(size_t *pnbytes, png_byte **pbytes)
+/* collect a data segment for a chunk into a freshly allocated buffer */
+{
+    data_sink	sink;
+
+    sink.bytes = pool_alloc(conversion_pool, MEMORY_QUANTUM);
+    sink.nbytes = 0;
+    sink.size = MEMORY_QUANTUM;
+    sink.full = grow_buffer;
+    sink.depth = 0;
+    sink.pixel = 0;
+
+    TIMED(PHASE_DECODE, decode_data(&sink));
+    if (sink.nbytes > PNG_UINT_31_MAX)
+	fatal("data segment is too large for a chunk");
+
+    *pnbytes = sink.nbytes;
+    *pbytes = sink.bytes;
 }
 
 /*************************************************************************
@@ -664,6 +1251,218 @@ static void collect_data(int *pnbytes, png_byte **pbytes)
  *
  ************************************************************************/
 
+/* set once an IMAGE segment has been written to libpng a row at a time */
+static SNG_TLS bool	image_written;
+
+/*
+ * Text and unknown chunks are queued as they are compiled, and handed to
+ * libpng a batch at a time just before it writes them out.  Each call of
+ * png_set_text() or png_set_unknown_chunks() copies everything registered
+ * before it, so a call per chunk takes time quadratic in their number.
+ */
+static SNG_TLS png_text			*queued_text;
+static SNG_TLS int			ntext_queued, text_room;
+static SNG_TLS png_unknown_chunk	*queued_chunks;
+static SNG_TLS int			nchunks_queued, chunk_room;
+
+/*
+ * With --threads, text and iCCP chunks are built here instead, their
+ * payloads deflated on the side (see sngzip.c), and they go to libpng
+ * ahead of the other unknown chunks, where it would have written them.
+ */
+static SNG_TLS png_unknown_chunk	*queued_built;
+static SNG_TLS deflate_job		**queued_jobs;
+static SNG_TLS int			nbuilt_queued, built_room, jobs_room;
+
+static void *queue_room(void *queue, int *room, int n, size_t size)
+/* make room in a queue for one more than n entries */
+{
+    if (n == *room)
+    {
+	int	more = *room ? 2 * *room : 64;
+
+	queue = pool_realloc(conversion_pool, queue, *room * size, more * size);
+	*room = more;
+    }
+    return(queue);
+}
+
+static void queue_built(const char *name, png_byte location,
+			png_byte *head, size_t headlen,
+			png_const_bytep body, size_t bodylen)
+/* queue a chunk of head and then body, deflated if there is a body */
+{
+    png_unknown_chunk	*qp;
+
+    queued_built = queue_room(queued_built, &built_room, nbuilt_queued,
+			      sizeof(png_unknown_chunk));
+    queued_jobs = queue_room(queued_jobs, &jobs_room, nbuilt_queued,
+			     sizeof(deflate_job *));
+    qp = &queued_built[nbuilt_queued];
+    memset(qp, '\0', sizeof(png_unknown_chunk));
+    memcpy(qp->name, name, 4);
+    qp->location = location;
+    if (body)
+	queued_jobs[nbuilt_queued] = payload_deflate(head, headlen,
+						     body, bodylen);
+    else
+    {
+	queued_jobs[nbuilt_queued] = NULL;
+	qp->data = head;
+	qp->size = headlen;
+    }
+    nbuilt_queued++;
+}
+
+static void queue_text_chunk(const png_text *tp)
+/* build a text chunk the way libpng would write it, and queue it */
+{
+    size_t	keylen = strlen(tp->key) + 1, textlen = strlen(tp->text);
+    png_byte	*head, *p;
+    png_byte	location;
+    int		deflated;
+
+    /* it goes out with the next lot of chunks libpng writes */
+#ifdef PNG_INFO_IMAGE_SUPPORTED
+    location = image_written ? PNG_AFTER_IDAT : PNG_HAVE_PLTE;
+#else
+    location = properties[IDAT].count ? PNG_AFTER_IDAT : PNG_HAVE_PLTE;
+#endif /* PNG_INFO_IMAGE_SUPPORTED */
+
+    /* keyword and whatever comes before the text, then the text */
+    head = p = pool_alloc(conversion_pool, keylen + 2 + textlen
+#ifdef PNG_iTXt_SUPPORTED
+			  + (tp->lang ? strlen(tp->lang) : 0) + 1
+			  + (tp->lang_key ? strlen(tp->lang_key) : 0) + 1
+#endif /* PNG_iTXt_SUPPORTED */
+	);
+    memcpy(p, tp->key, keylen);
+    p += keylen;
+    deflated = (tp->compression == PNG_TEXT_COMPRESSION_zTXt
+		|| tp->compression == PNG_ITXT_COMPRESSION_zTXt);
+#ifdef PNG_iTXt_SUPPORTED
+    if (tp->compression >= PNG_ITXT_COMPRESSION_NONE)
+    {
+	const char	*lang = tp->lang ? tp->lang : "";
+	const char	*lang_key = tp->lang_key ? tp->lang_key : "";
+
+	*p++ = deflated;
+	*p++ = PNG_COMPRESSION_TYPE_BASE;
+	memcpy(p, lang, strlen(lang) + 1);
+	p += strlen(lang) + 1;
+	memcpy(p, lang_key, strlen(lang_key) + 1);
+	p += strlen(lang_key) + 1;
+    }
+    else
+#endif /* PNG_iTXt_SUPPORTED */
+    if (deflated)
+	*p++ = PNG_COMPRESSION_TYPE_BASE;
+
+    if (deflated)
+	queue_built(tp->compression == PNG_TEXT_COMPRESSION_zTXt ? "zTXt" : "iTXt",
+		    location, head, p - head,
+		    (png_const_bytep)pool_strdup(conversion_pool, tp->text),
+		    textlen);
+    else
+    {
+	memcpy(p, tp->text, textlen);
+	p += textlen;
+	queue_built(tp->compression == PNG_TEXT_COMPRESSION_NONE ? "tEXt" : "iTXt",
+		    location, head, p - head, NULL, 0);
+    }
+}
+
+static void queue_text(const png_text *tp)
+/* queue a text chunk, copying its strings */
+{
+    png_text	*qp;
+
+    if (threads > 1)
+    {
+	/* all of them, so they stay in order with each other */
+	queue_text_chunk(tp);
+	return;
+    }
+
+    queued_text = queue_room(queued_text, &text_room, ntext_queued,
+			     sizeof(png_text));
+    qp = &queued_text[ntext_queued++];
+    memset(qp, '\0', sizeof(png_text));
+    qp->compression = tp->compression;
+    qp->key = pool_strdup(conversion_pool, tp->key);
+    qp->text = pool_strdup(conversion_pool, tp->text);
+#ifdef PNG_iTXt_SUPPORTED
+    if (tp->compression >= PNG_ITXT_COMPRESSION_NONE)
+    {
+	qp->lang = pool_strdup(conversion_pool, tp->lang);
+	qp->lang_key = pool_strdup(conversion_pool, tp->lang_key);
+    }
+#endif /* PNG_iTXt_SUPPORTED */
+}
+
+static void queue_chunk(const png_unknown_chunk *cp)
+/* queue an unknown chunk, whose data must last the conversion, in place */
+{
+    png_unknown_chunk	*qp;
+
+    queued_chunks = queue_room(queued_chunks, &chunk_room, nchunks_queued,
+			       sizeof(png_unknown_chunk));
+    qp = &queued_chunks[nchunks_queued++];
+    *qp = *cp;
+
+    /* it goes after whichever critical chunk came last */
+    if (properties[IDAT].count)
+	qp->location = PNG_AFTER_IDAT;
+    else if (properties[PLTE].count)
+	qp->location = PNG_HAVE_PLTE;
+    else
+	qp->location = PNG_HAVE_IHDR;
+}
+
+static void register_chunks(png_unknown_chunk *chunks, int n)
+/* hand libpng a batch of unknown chunks, each in its own place */
+{
+    png_set_unknown_chunks(png_ptr, info_ptr, chunks, n);
+#if PNG_LIBPNG_VER < 10600
+    /* older libraries guess the location rather than taking ours */
+    {
+	png_unknown_chunkp	entries;
+	int			total, i;
+
+	total = png_get_unknown_chunks(png_ptr, info_ptr, &entries);
+	for (i = 0; i < n; i++)
+	    png_set_unknown_chunk_location(png_ptr, info_ptr,
+					   total - n + i, chunks[i].location);
+    }
+#endif
+}
+
+static void register_queued(void)
+/* hand libpng the chunks queued since last time, before it writes them */
+{
+    int	i;
+
+    if (ntext_queued)
+    {
+	png_set_text(png_ptr, info_ptr, queued_text, ntext_queued);
+	ntext_queued = 0;
+    }
+    if (nbuilt_queued)
+    {
+	for (i = 0; i < nbuilt_queued; i++)
+	    if (queued_jobs[i])
+		queued_built[i].data = payload_wait(queued_jobs[i],
+						    &queued_built[i].size);
+	register_chunks(queued_built, nbuilt_queued);
+	nbuilt_queued = 0;
+    }
+    if (nchunks_queued)
+    {
+	register_chunks(queued_chunks, nchunks_queued);
+	nchunks_queued = 0;
+    }
+}
+
 static void compile_IHDR(void)
 /* parse IHDR specification, set corresponding bits in info_ptr */
 {
@@ -675,25 +1474,25 @@ static void compile_IHDR(void)
 
     /* read IHDR data */
     while (get_inner_token())
-	if (token_equals("height"))
+	if (token_is(KW_height))
 	    height = long_numeric(get_token());
-	else if (token_equals("width"))
+	else if (token_is(KW_width))
 	    width = long_numeric(get_token());
-	else if (token_equals("bitdepth"))
+	else if (token_is(KW_bitdepth))
 	    d = byte_numeric(get_token());
-        else if (token_equals("using"))
+        else if (token_is(KW_using))
 	    continue;			/* `uses' is just syntactic sugar */
-        else if (token_equals("grayscale"))
+        else if (token_is(KW_grayscale))
 	    continue;			/* so is grayscale */
-        else if (token_equals("palette"))
+        else if (token_is(KW_palette))
 	    color_type |= PNG_COLOR_MASK_PALETTE;
-        else if (token_equals("color"))
+        else if (token_is(KW_color))
 	    color_type |= PNG_COLOR_MASK_COLOR;
-        else if (token_equals("alpha"))
+        else if (token_is(KW_alpha))
 	    color_type |= PNG_COLOR_MASK_ALPHA;
-        else if (token_equals("with"))
+        else if (token_is(KW_with))
 	    continue;			/* `with' is just syntactic sugar */
-        else if (token_equals("interlace"))
+        else if (token_is(KW_interlace))
 	    interlace_type = PNG_INTERLACE_ADAM7;
 	else
 	    fatal("bad token `%s' in IHDR specification", token_buffer);
@@ -722,8 +1521,6 @@ static void compile_PLTE(void)
 {
     int ncolors;
 
-    initialize_hash(hash_by_cname, cname_hashbuckets, &cname_initialized);
-
     memset(palette, '\0', sizeof(palette));
     ncolors = 0;
 
@@ -733,7 +1530,7 @@ static void compile_PLTE(void)
 	    fatal("too many palette entries in PLTE specification");
 	if (token_class == STRING_TOKEN)
 	{
-	    color_item *cp = find_by_cname(token_buffer);
+	    const color_item *cp = find_by_cname(token_buffer);
 
 	    if (!cp)
 		fatal("unknown color name `%s' in PLTE", token_buffer);
@@ -745,14 +1542,14 @@ static void compile_PLTE(void)
 		ncolors++;
 	    }
 	}
-	else if (token_equals("("))
+	else if (token_is(KW_LPAREN))
 	{
 	    palette[ncolors].red = byte_numeric(get_token());
 	    /* comma */
 	    palette[ncolors].green = byte_numeric(get_token());
 	    /* comma */
 	    palette[ncolors].blue = byte_numeric(get_token());
-	    require_or_die(")");
+	    require_or_die(KW_RPAREN);
 	    ncolors++;
 	}
 	else
@@ -766,27 +1563,25 @@ static void compile_PLTE(void)
 static void compile_IDAT(void)
 /* parse IDAT specification and emit corresponding bits */
 {
-    int			nbits;
+    size_t	nbits;
     png_byte	*bits;
-#ifdef PNG_INFO_IMAGE_SUPPORTED
-    png_unknown_chunk	chunk;
-#endif /* PNG_INFO_IMAGE_SUPPORTED */
 
     /*
      * Collect raw hex data and write it out as a chunk.
      */
     collect_data(&nbits, &bits);
-    require_or_die("}");
+    require_or_die(KW_RBRACE);
 #ifndef PNG_INFO_IMAGE_SUPPORTED
     png_write_chunk(png_ptr, "IDAT", bits, nbits);
-    free(bits);
 #else
-    memcpy(chunk.name, "IDAT", sizeof(chunk.name));
-    chunk.data = bits;
-    chunk.size = nbits;
-    png_set_unknown_chunks(png_ptr, info_ptr, &chunk, 1);
-// TODO: also use png_set_unknown_chunk_location if libpng before 1.6.0
-    png_free(png_ptr, bits);
+    /* libpng won't write IDAT as an unknown chunk, so keep it for later */
+    if (raw_count % 16 == 0)
+	raw_idat = pool_realloc(conversion_pool, raw_idat,
+				raw_count * sizeof(raw_chunk),
+				(raw_count + 16) * sizeof(raw_chunk));
+    raw_idat[raw_count].data = bits;
+    raw_idat[raw_count].size = nbits;
+    raw_count++;
 #endif /* PNG_INFO_IMAGE_SUPPORTED */
 }
 
@@ -798,40 +1593,40 @@ static void compile_cHRM(void)
 
     while (get_inner_token())
     {
-	if (token_equals("white"))
+	if (token_is(KW_white))
 	{
-	    require_or_die("(");
+	    require_or_die(KW_LPAREN);
 	    wx = double_numeric(get_inner_token());
 	    /* comma */
 	    wy = double_numeric(get_inner_token());
-	    require_or_die(")");
+	    require_or_die(KW_RPAREN);
 	    cmask |= 0x01;
 	}
-	else if (token_equals("red"))
+	else if (token_is(KW_red))
 	{
-	    require_or_die("(");
+	    require_or_die(KW_LPAREN);
 	    rx = double_numeric(get_inner_token());
 	    /* comma */
 	    ry = double_numeric(get_inner_token());
-	    require_or_die(")");
+	    require_or_die(KW_RPAREN);
 	    cmask |= 0x02;
 	}
-	else if (token_equals("green"))
+	else if (token_is(KW_green))
 	{
-	    require_or_die("(");
+	    require_or_die(KW_LPAREN);
 	    gx = double_numeric(get_inner_token());
 	    /* comma */
 	    gy = double_numeric(get_inner_token());
-	    require_or_die(")");
+	    require_or_die(KW_RPAREN);
 	    cmask |= 0x04;
 	}
-	else if (token_equals("blue"))
+	else if (token_is(KW_blue))
 	{
-	    require_or_die("(");
+	    require_or_die(KW_LPAREN);
 	    bx = double_numeric(get_inner_token());
 	    /* comma */
 	    by = double_numeric(get_inner_token());
-	    require_or_die(")");
+	    require_or_die(KW_RPAREN);
 	    cmask |= 0x08;
 	}
 	else
@@ -873,21 +1668,22 @@ static void compile_gAMA(void)
 #ifdef PNG_FIXED_POINT_SUPPORTED
     png_set_gAMA_fixed(png_ptr, info_ptr, FLOAT_TO_FIXED(gamma));
 #endif
-    if (!get_token() || !token_equals("}"))
+    if (!get_token() || !token_is(KW_RBRACE))
 	fatal("bad token `%s' in gAMA specification", token_buffer);
 }
 
 static void compile_iCCP(void)
 /* compile and emit an iCCP chunk */
 {
-    int nname = 0, data_len = 0;
+    int nname = 0;
+    size_t data_len = 0;
     char name[PNG_KEYWORD_MAX_LENGTH+1];
     png_byte *data;
 
     while (get_inner_token())
-	if (token_equals("name"))
+	if (token_is(KW_name))
 	    nname = keyword_validate(get_token(), name);
-	else if (token_equals("profile"))
+	else if (token_is(KW_profile))
 	    collect_data(&data_len, &data);
 
     if (!nname || !data_len)
@@ -895,7 +1691,19 @@ static void compile_iCCP(void)
 
     png_set_iCCP(png_ptr, info_ptr, name, PNG_COMPRESSION_TYPE_BASE,
 		 data, data_len);
-    free(data);
+
+    /* with --threads, keep libpng's checks but deflate the profile here */
+    if (threads > 1 && png_get_valid(png_ptr, info_ptr, PNG_INFO_iCCP))
+    {
+	png_byte	*head = pool_alloc(conversion_pool, nname + 2);
+
+	png_free_data(png_ptr, info_ptr, PNG_FREE_ICCP, 0);
+	memcpy(head, name, nname + 1);
+	head[nname + 1] = PNG_COMPRESSION_TYPE_BASE;
+	png_set_keep_unknown_chunks(png_ptr, PNG_HANDLE_CHUNK_ALWAYS,
+				    (png_const_bytep)"iCCP", 1);
+	queue_built("iCCP", PNG_HAVE_IHDR, head, nname + 2, data, data_len);
+    }
 }
 
 static void compile_sBIT(void)
@@ -908,7 +1716,7 @@ static void compile_sBIT(void)
     int		sample_depth = ((color_type & PNG_COLOR_MASK_PALETTE) ? 8 : bit_depth);
 
     while (get_inner_token())
-	if (token_equals("red"))
+	if (token_is(KW_red))
 	{
 	    if (!color)
 		fatal("No color channels in this image type");
@@ -916,7 +1724,7 @@ static void compile_sBIT(void)
 	    if (sigbits.red > sample_depth)
 		fatal("red sample depth out of range");
 	}
-	else if (token_equals("green"))
+	else if (token_is(KW_green))
 	{
 	    if (!color)
 		fatal("No color channels in this image type");
@@ -924,7 +1732,7 @@ static void compile_sBIT(void)
 	    if (sigbits.green > sample_depth)
 		fatal("red sample depth out of range");
 	}
-	else if (token_equals("blue"))
+	else if (token_is(KW_blue))
 	{
 	    if (!color)
 		fatal("No color channels in this image type");
@@ -932,7 +1740,7 @@ static void compile_sBIT(void)
 	    if (sigbits.blue > sample_depth)
 		fatal("red sample depth out of range");
 	}
-	else if (token_equals("gray"))
+	else if (token_is(KW_gray))
 	{
 	    if (color)
 		fatal("No gray channel in this image type");
@@ -940,7 +1748,7 @@ static void compile_sBIT(void)
 	    if (sigbits.gray > sample_depth)
 		fatal("gray sample depth out of range");
 	}
-	else if (token_equals("alpha"))
+	else if (token_is(KW_alpha))
 	{
 	    if (color_type & PNG_COLOR_MASK_ALPHA)
 		fatal("No alpha channel in this image type");
@@ -962,31 +1770,31 @@ static void compile_bKGD(void)
     png_byte		color_type = png_get_color_type(png_ptr, info_ptr);
 
     while (get_inner_token())
-	if (token_equals("red"))
+	if (token_is(KW_red))
 	{
 	    if (!(color_type & PNG_COLOR_MASK_COLOR))
 		fatal("Can't use color background with this image type");
 	    bkgbits.red = short_numeric(get_token());
 	}
-	else if (token_equals("green"))
+	else if (token_is(KW_green))
 	{
 	    if (!(color_type & PNG_COLOR_MASK_COLOR))
 		fatal("Can't use color background with this image type");
 	    bkgbits.green = short_numeric(get_token());
 	}
-	else if (token_equals("blue"))
+	else if (token_is(KW_blue))
 	{
 	    if (!(color_type & PNG_COLOR_MASK_COLOR))
 		fatal("Can't use color background with this image type");
 	    bkgbits.blue = short_numeric(get_token());
 	}
-	else if (token_equals("gray"))
+	else if (token_is(KW_gray))
 	{
 	    if (color_type & (PNG_COLOR_MASK_COLOR | PNG_COLOR_MASK_PALETTE))
 		fatal("Can't use color background with this image type");
 	    bkgbits.gray = short_numeric(get_token());
 	}
-	else if (token_equals("index"))
+	else if (token_is(KW_index))
 	{
 	    if (!(color_type & PNG_COLOR_MASK_PALETTE))
 		fatal("Can't use index background with a non-palette image");
@@ -1033,9 +1841,9 @@ static void compile_tRNS(void)
     switch (color_type)
     {
     case PNG_COLOR_TYPE_GRAY:
-	require_or_die("gray");
+	require_or_die(KW_gray);
 	tRNSbits.gray = short_numeric(get_token());
-	require_or_die("}");
+	require_or_die(KW_RBRACE);
 	break;
 
     case PNG_COLOR_TYPE_PALETTE:
@@ -1046,11 +1854,11 @@ static void compile_tRNS(void)
 
     case PNG_COLOR_TYPE_RGB:
 	while (get_inner_token())
-	    if (token_equals("red"))
+	    if (token_is(KW_red))
 		tRNSbits.red = short_numeric(get_token());
-	    else if (token_equals("green"))
+	    else if (token_is(KW_green))
 		tRNSbits.green = short_numeric(get_token());
-	    else if (token_equals("blue"))
+	    else if (token_is(KW_blue))
 		tRNSbits.blue = short_numeric(get_token());
 	    else 
 		fatal("invalid channel name `%s' in tRNS specification", 
@@ -1075,13 +1883,13 @@ static void compile_pHYs(void)
     png_uint_32	res_x = 0, res_y = 0;
 
     while (get_inner_token())
-	if (token_equals("xpixels"))
+	if (token_is(KW_xpixels))
 	    res_x = long_numeric(get_token());
-	else if (token_equals("ypixels"))
+	else if (token_is(KW_ypixels))
 	    res_y = long_numeric(get_token());
-	else if (token_equals("per"))
+	else if (token_is(KW_per))
 	    continue;
-	else if (token_equals("meter"))
+	else if (token_is(KW_meter))
 	    unit = PNG_RESOLUTION_METER;
 	else
 	    fatal("invalid token `%s' in pHYs", token_buffer);
@@ -1100,13 +1908,11 @@ static void compile_sPLT(void)
     png_sPLT_t new_palette;
     png_sPLT_entry	entries[256];
 
-    initialize_hash(hash_by_cname, cname_hashbuckets, &cname_initialized);
-
     new_palette.depth = 0;
     while (get_inner_token())
-	if (token_equals("name"))
+	if (token_is(KW_name))
 	    nkeyword = keyword_validate(get_token(), keyword);
-        else if (token_equals("depth"))
+        else if (token_is(KW_depth))
 	{
 	    new_palette.depth = byte_numeric(get_token());
 	    if (new_palette.depth != 8 && new_palette.depth != 16)
@@ -1114,7 +1920,7 @@ static void compile_sPLT(void)
 	}
 	else if (token_class == STRING_TOKEN)
 	{
-	    color_item *cp = find_by_cname(token_buffer);
+	    const color_item *cp = find_by_cname(token_buffer);
 
 	    if (!cp)
 		fatal("unknown color name `%s' in PLTE", token_buffer);
@@ -1135,7 +1941,7 @@ static void compile_sPLT(void)
 		nentries++;
 	    }
 	}
-	else if (token_equals("("))
+	else if (token_is(KW_LPAREN))
 	{
 	    if (nentries >= 256)
 		fatal("too many palette entries in sPLT specification");
@@ -1150,7 +1956,7 @@ static void compile_sPLT(void)
 	    entries[nentries].blue = short_numeric(get_token());
 	    if (new_palette.depth == 8 && entries[nentries].blue > 255)
 		fatal("blue value too large for sample depth");
-	    require_or_die(")");
+	    require_or_die(KW_RPAREN);
 
 	    /* comma */
 	    entries[nentries].alpha = short_numeric(get_token());
@@ -1181,9 +1987,9 @@ static void compile_tEXt(void)
     png_text	textblk;
 
     while (get_inner_token())
-	if (token_equals("keyword"))
+	if (token_is(KW_keyword))
 	    nkeyword = keyword_validate(get_token(), keyword);
-	else if (token_equals("text"))
+	else if (token_is(KW_text))
 	    ntext = string_validate(get_token(), text);
 	else
 	    fatal("bad token `%s' in tEXt specification", token_buffer);
@@ -1198,11 +2004,11 @@ static void compile_tEXt(void)
     textblk.text = text;
     textblk.compression = PNG_TEXT_COMPRESSION_NONE;
 
-    png_set_text(png_ptr, info_ptr, &textblk, 1);
+    queue_text(&textblk);
 }
 
 static void compile_zTXt(void)
-/* compile and emit a zTXt chunk */
+/* compile a zTXt chunk; queue it up to be emitted later */
 {
     char	keyword[PNG_KEYWORD_MAX_LENGTH+1];
     char	text[PNG_STRING_MAX_LENGTH+1];
@@ -1210,9 +2016,9 @@ static void compile_zTXt(void)
     png_text	textblk;
 
     while (get_inner_token())
-	if (token_equals("keyword"))
+	if (token_is(KW_keyword))
 	    nkeyword = keyword_validate(get_token(), keyword);
-	else if (token_equals("text"))
+	else if (token_is(KW_text))
 	    ntext = string_validate(get_token(), text);
 	else
 	    fatal("bad token `%s' in zTXt specification", token_buffer);
@@ -1227,11 +2033,11 @@ static void compile_zTXt(void)
     textblk.text = text;
     textblk.compression = PNG_TEXT_COMPRESSION_zTXt;
 
-    png_set_text(png_ptr, info_ptr, &textblk, 1);
+    queue_text(&textblk);
 }
 
 static void compile_iTXt(void)
-/* compile and emit an iTXt chunk */
+/* compile an iTXt chunk; queue it up to be emitted later */
 {
     char	language[PNG_KEYWORD_MAX_LENGTH+1];
     char	keyword[PNG_KEYWORD_MAX_LENGTH+1]; 
@@ -1243,15 +2049,15 @@ static void compile_iTXt(void)
 
     compression = PNG_ITXT_COMPRESSION_NONE;
     while (get_inner_token())
-	if (token_equals("language"))
+	if (token_is(KW_language))
 	    nlanguage = keyword_validate(get_token(), language);
-	else if (token_equals("keyword"))
+	else if (token_is(KW_keyword))
 	    nkeyword = keyword_validate(get_token(), keyword);
- 	else if (token_equals("translated"))
+ 	else if (token_is(KW_translated))
 	    ntranskey = string_validate(get_token(), transkey);
-	else if (token_equals("text"))
+	else if (token_is(KW_text))
 	    ntext = string_validate(get_token(), text);
-	else if (token_equals("compressed"))
+	else if (token_is(KW_compressed))
 	    compression = PNG_ITXT_COMPRESSION_zTXt;
 	else
 	    fatal("bad token `%s' in iTXt specification", token_buffer);
@@ -1267,7 +2073,7 @@ static void compile_iTXt(void)
     textblk.text = text;
     textblk.compression = compression;
 
-    png_set_text(png_ptr, info_ptr, &textblk, 1);
+    queue_text(&textblk);
 }
 
 static void compile_tIME(void)
@@ -1277,40 +2083,40 @@ static void compile_tIME(void)
     int time_mask = 0;
 
     while (get_inner_token())
-	if (token_equals("year"))
+	if (token_is(KW_year))
 	{
 	    stamp.year = short_numeric(get_token());
 	    time_mask |= 0x01;
 	}
-	else if (token_equals("month"))
+	else if (token_is(KW_month))
 	{
 	    stamp.month = byte_numeric(get_token());
 	    if (stamp.month < 1 || stamp.month > 12)
 		fatal("month value out of range");
 	    time_mask |= 0x02;
 	}
-	else if (token_equals("day"))
+	else if (token_is(KW_day))
 	{
 	    stamp.day = byte_numeric(get_token());
 	    if (stamp.day < 1 || stamp.day > 31)
 		fatal("day value out of range");
 	    time_mask |= 0x04;
 	}
-	else if (token_equals("hour"))
+	else if (token_is(KW_hour))
 	{
 	    stamp.hour = byte_numeric(get_token());
 	    if (stamp.hour > 23)
 		fatal("hour value out of range");
 	    time_mask |= 0x08;
 	}
-	else if (token_equals("minute"))
+	else if (token_is(KW_minute))
 	{
 	    stamp.minute = byte_numeric(get_token());
 	    if (stamp.minute > 59)
 		fatal("minute value out of range");
 	    time_mask |= 0x10;
 	}
-	else if (token_equals("second"))
+	else if (token_is(KW_second))
 	{
 	    stamp.second = byte_numeric(get_token());
 	    if (stamp.second > 59)
@@ -1333,15 +2139,15 @@ static void compile_oFFs(void)
     png_int_32	res_x = 0, res_y = 0;
 
     while (get_inner_token())
-	if (token_equals("xoffset"))
+	if (token_is(KW_xoffset))
 	    res_x = slong_numeric(get_token());
-	else if (token_equals("yoffset"))
+	else if (token_is(KW_yoffset))
 	    res_y = slong_numeric(get_token());
-	else if (token_equals("unit"))
+	else if (token_is(KW_unit))
 	    continue;
-	else if (token_equals("pixels"))
+	else if (token_is(KW_pixels))
 	    unit = PNG_OFFSET_PIXEL;
-	else if (token_equals("micrometers"))
+	else if (token_is(KW_micrometers))
 	    unit = PNG_OFFSET_MICROMETER;
 	else
 	    fatal("invalid token `%s' in oFFs specification", token_buffer);
@@ -1364,49 +2170,49 @@ static void compile_pCAL(void)
     png_int_32	x0 = 0, x1 = 0;
 
     while (get_inner_token())
-	if (token_equals("name"))
+	if (token_is(KW_name))
 	{
 	    nname = keyword_validate(get_token(), name);
 	    mask |= 0x01;
 	}
-	else if (token_equals("x0"))
+	else if (token_is(KW_x0))
 	{
 	    x0 = slong_numeric(get_token());
 	    mask |= 0x02;
 	}
-	else if (token_equals("x1"))
+	else if (token_is(KW_x1))
 	{
 	    x1 = slong_numeric(get_token());
 	    mask |= 0x04;
 	}
-	else if (token_equals("mapping"))
+	else if (token_is(KW_mapping))
 	    continue;
-	else if (token_equals("linear"))
+	else if (token_is(KW_linear))
 	{
 	    eqtype = PNG_EQUATION_LINEAR;
 	    mask |= 0x08;
 	}
-	else if (token_equals("euler"))
+	else if (token_is(KW_euler))
 	{
 	    eqtype = PNG_EQUATION_BASE_E;
 	    mask |= 0x08;
 	}
-	else if (token_equals("exponential"))
+	else if (token_is(KW_exponential))
 	{
 	    eqtype = PNG_EQUATION_ARBITRARY;
 	    mask |= 0x08;
 	}
-	else if (token_equals("hyperbolic"))
+	else if (token_is(KW_hyperbolic))
 	{
 	    eqtype = PNG_EQUATION_HYPERBOLIC;
 	    mask |= 0x08;
 	}
-	else if (token_equals("unit"))
+	else if (token_is(KW_unit))
 	{
 	    nunit = keyword_validate(get_token(), unit);
 	    mask |= 0x10;
 	}
-        else if (token_equals("parameters"))
+        else if (token_is(KW_parameters))
 	{
 	    nparams = 0;
 	    while (get_inner_token())
@@ -1415,7 +2221,7 @@ static void compile_pCAL(void)
 		else
 		{
 		    nstrbuf = string_validate(TRUE, strbuf);
-		    params[nparams++] = xstrdup(strbuf);
+		    params[nparams++] = pool_strdup(conversion_pool, strbuf);
 		}
 	    push_token();
 	}
@@ -1471,24 +2277,24 @@ static void compile_sCAL(void)
 #endif
 
     while (get_inner_token())
-	if (token_equals("unit"))
+	if (token_is(KW_unit))
 	{
 	    nunit = string_validate(get_token(), unit);
-	    if (token_equals("meter"))
+	    if (token_is(KW_meter))
 		unitbyte = PNG_SCALE_METER;
-	    else if (token_equals("radian"))
+	    else if (token_is(KW_radian))
 		unitbyte = PNG_SCALE_RADIAN;
 	    else
 		unitbyte = PNG_SCALE_UNKNOWN;
 	}
-	else if (token_equals("width"))
+	else if (token_is(KW_width))
 	{
 	    width = double_numeric(get_token());
 #if !defined(PNG_FLOATING_POINT_SUPPORTED) && defined(PNG_FIXED_POINT_SUPPORTED)
 	    strcpy(width_s, token_buffer);
 #endif
 	}
-	else if (token_equals("height"))
+	else if (token_is(KW_height))
 	{
 	    height = double_numeric(get_token());
 #if !defined(PNG_FLOATING_POINT_SUPPORTED) && defined(PNG_FIXED_POINT_SUPPORTED)
@@ -1510,26 +2316,27 @@ static void compile_sCAL(void)
 #endif
 }
 
+/* state of an IMAGE segment being written to libpng a row at a time */
+static SNG_TLS int	rows_written;
+
 static void compile_gIFg(void)
 /* parse gIFg specification and queue up the corresponding chunk */
 {
-    png_byte chunkdata[4];
+    png_byte *chunkdata = pool_alloc(conversion_pool, 4);
     png_unknown_chunk chunk;
 
     memset(&chunk, '\0', sizeof(chunk));
-    memset(chunkdata, '\0', sizeof(chunkdata));
+    memset(chunkdata, '\0', 4);
     memcpy(chunk.name, "gIFg", sizeof(chunk.name));
     chunk.data = chunkdata;
     chunk.size = 4;
-//    chunk.location = TODO; PNG_HAVE_IHDR or PNG_HAVE_PLTE or PNG_AFTER_IDAT
-    chunk.location = PNG_HAVE_IHDR; // FIXME
 
     while (get_inner_token())
-	if (token_equals("disposal"))
+	if (token_is(KW_disposal))
 	    chunkdata[0] = byte_numeric(get_token());
-	else if (token_equals("input"))
+	else if (token_is(KW_input))
 	    chunkdata[1] = byte_numeric(get_token());
-	else if (token_equals("delay"))
+	else if (token_is(KW_delay))
 	{
 	    double delay = double_numeric(get_token());
 
@@ -1538,98 +2345,78 @@ static void compile_gIFg(void)
 	else
 	    fatal("invalid token `%s' in gIFg specification", token_buffer);
 
-    png_set_unknown_chunks(png_ptr, info_ptr, &chunk, 1);
-// TODO: also use png_set_unknown_chunk_location if libpng before 1.6.0
+    queue_chunk(&chunk);
 }
 
 static void compile_gIFx(void)
 /* parse gIFx specification and queue up the corresponding chunk */
 {
-    png_byte chunkdata[PNG_STRING_MAX_LENGTH];
+    png_byte *chunkdata = pool_alloc(conversion_pool, PNG_STRING_MAX_LENGTH);
     char buf[PNG_STRING_MAX_LENGTH];
     png_unknown_chunk chunk;
 
     memset(&chunk, '\0', sizeof(chunk));
-    memset(chunkdata, '\0', sizeof(chunkdata));
+    memset(chunkdata, '\0', PNG_STRING_MAX_LENGTH);
     memcpy(chunk.name, "gIFx", sizeof(chunk.name));
     chunk.data = chunkdata;
-//    chunk.location = TODO; PNG_HAVE_IHDR or PNG_HAVE_PLTE or PNG_AFTER_IDAT
-    chunk.location = PNG_HAVE_IHDR; // FIXME
 
     while (get_inner_token())
-	if (token_equals("identifier"))
+	if (token_is(KW_identifier))
 	{
 	    if (string_validate(get_token(), buf) != 8)
 		fatal("application identifier has wrong length");
 	    else
 		memcpy(chunkdata, buf, 8);
 	}
-	else if (token_equals("code"))
+	else if (token_is(KW_code))
 	{
 	    if (string_validate(get_token(), buf) != 3)
 		fatal("authentication code has wrong length");
 	    else
 		memcpy(chunkdata + 8, buf, 3);
 	}
-	else if (token_equals("data"))
+	else if (token_is(KW_data))
 	{
-	    int datalen;
+	    size_t datalen;
 	    png_byte *data;
 
 	    collect_data(&datalen, &data);
+	    if (datalen > PNG_STRING_MAX_LENGTH - 12)
+		fatal("gIFx data is too long");
 	    memcpy(chunkdata + 11, data, datalen);
-	    free(data);
 	}
 	else
 	    fatal("invalid token `%s' in gIFx specification", token_buffer);
 
     chunk.size = 11 + strlen((char *)chunkdata + 11);
 
-    png_set_unknown_chunks(png_ptr, info_ptr, &chunk, 1);
-// TODO: also use png_set_unknown_chunk_location if libpng before 1.6.0
+    queue_chunk(&chunk);
+}
+
+static void write_row(data_sink *sink)
+/* pass a completed image row to libpng */
+{
+    if (rows_written >= png_get_image_height(png_ptr, info_ptr))
+	too_many_samples(sink);
+    TIMED(PHASE_PNG, png_write_row(png_ptr, sink->bytes));
+    rows_written++;
+    sink->nbytes = 0;
 }
 
 static void compile_IMAGE(void)
 /* parse IMAGE specification and emit corresponding bits */
 {
-    int		i, nbytes, bytes_per_sample = 0, nsamples, input_width;
-    png_byte	*bytes;
+    int		bytes_per_sample = 0, pending = 0;
+    uint64_t	nbytes, nsamples;
+    size_t	input_width;
+    png_byte	*bytes = NULL;
     png_byte	color_type = png_get_color_type(png_ptr, info_ptr);
     png_byte	bit_depth = png_get_bit_depth(png_ptr, info_ptr);
     int		doublewidth = bit_depth == 16 ? 2 : 1;
     png_bytepp	row_pointers = 0;
-    int		width = png_get_image_width(png_ptr, info_ptr);
-    int		height = png_get_image_height(png_ptr, info_ptr);
-
-    write_transform_options = 0;
-    while (get_inner_token())
-	if (token_equals("pixels"))
-	    collect_data(&nbytes, &bytes);
-	else if (token_equals("options"))
-	{
-	    if (token_equals("identity"))
-		write_transform_options = PNG_TRANSFORM_IDENTITY;
-	    else if (token_equals("packing"))
-		write_transform_options |= PNG_TRANSFORM_PACKING;
-	    else if (token_equals("packswap"))
-		write_transform_options |= PNG_TRANSFORM_PACKSWAP;
-	    else if (token_equals("invert_mono"))
-		write_transform_options |= PNG_TRANSFORM_INVERT_MONO;
-	    else if (token_equals("shift"))
-		write_transform_options |= PNG_TRANSFORM_SHIFT;
-	    else if (token_equals("bgr"))
-		write_transform_options |= PNG_TRANSFORM_BGR;
-	    else if (token_equals("swap_alpha"))
-		write_transform_options |= PNG_TRANSFORM_SWAP_ALPHA;
-	    else if (token_equals("invert_alpha"))
-		write_transform_options |= PNG_TRANSFORM_INVERT_ALPHA;
-	    else if (token_equals("swap_endian"))
-		write_transform_options |= PNG_TRANSFORM_SWAP_ENDIAN;
-	    else if (token_equals("strip_filler"))
-		write_transform_options |= PNG_TRANSFORM_STRIP_FILLER;
-	}
-	else
-	    fatal("invalid token `%s' in IMAGE specification", token_buffer);
+    png_uint_32	i, width = png_get_image_width(png_ptr, info_ptr);
+    png_uint_32	height = png_get_image_height(png_ptr, info_ptr);
+    uint64_t	image_size = (uint64_t)png_get_rowbytes(png_ptr, info_ptr) * height;
 
     /* compute input sample size in bits */
     switch (color_type)
@@ -1658,71 +2445,281 @@ static void compile_IMAGE(void)
 	fatal("unknown color type");
     }
 
+    write_transform_options = 0;
+    nbytes = 0;
+    while (get_inner_token())
+	if (token_is(KW_pixels))
+	{
+	    data_sink	sink;
+
+	    /*
+	     * Without transformations or interlacing, each row can go
+	     * to libpng as soon as it has been decoded.
+	     */
+	    if (stream && !write_transform_options
+		&& png_get_interlace_type(png_ptr, info_ptr) == PNG_INTERLACE_NONE)
+	    {
+		sink.size = png_get_rowbytes(png_ptr, info_ptr);
+		sink.bytes = pool_alloc(conversion_pool, sink.size);
+		sink.nbytes = 0;
+		sink.full = write_row;
+		sink_packing(&sink, bit_depth);
+		sink.pixel = bytes_per_sample;
+
+#ifdef PNG_INFO_IMAGE_SUPPORTED
+		register_queued();
+		TIMED(PHASE_PNG, png_write_info(png_ptr, info_ptr));
+#endif /* PNG_INFO_IMAGE_SUPPORTED */
+		rows_written = 0;
+		TIMED(PHASE_DECODE, decode_data(&sink));
+		if (sink.nbytes == sink.size)
+		    write_row(&sink);
+		nbytes = (uint64_t)rows_written * sink.size + sink.nbytes;
+		image_written = TRUE;
+	    }
+	    else
+	    {
+		if (image_size > (size_t)-1)
+		    fatal("image is too large to hold in memory");
+
+		/* past the budget, the rows go straight into a mapped file */
+		if (memory_budget && image_size > memory_budget)
+		{
+		    sink.size = image_size;
+		    sink.bytes = pool_spill(conversion_pool, sink.size);
+		    sink.full = too_many_samples;
+		}
+		else
+		{
+		    sink.size = MEMORY_QUANTUM;
+		    sink.bytes = pool_alloc(conversion_pool, sink.size);
+		    sink.full = grow_buffer;
+		}
+		sink.nbytes = 0;
+		sink_packing(&sink, bit_depth);
+		sink.pixel = bytes_per_sample;
+
+		TIMED(PHASE_DECODE, decode_data(&sink));
+		nbytes = sink.nbytes;
+		bytes = sink.bytes;
+	    }
+	    pending = sink.depth ? sink.col : 0;
+	}
+	else if (token_is(KW_options))
+	{
+	    if (token_is(KW_identity))
+		write_transform_options = PNG_TRANSFORM_IDENTITY;
+	    else if (token_is(KW_packing))
+		write_transform_options |= PNG_TRANSFORM_PACKING;
+	    else if (token_is(KW_packswap))
+		write_transform_options |= PNG_TRANSFORM_PACKSWAP;
+	    else if (token_is(KW_invert_mono))
+		write_transform_options |= PNG_TRANSFORM_INVERT_MONO;
+	    else if (token_is(KW_shift))
+		write_transform_options |= PNG_TRANSFORM_SHIFT;
+	    else if (token_is(KW_bgr))
+		write_transform_options |= PNG_TRANSFORM_BGR;
+	    else if (token_is(KW_swap_alpha))
+		write_transform_options |= PNG_TRANSFORM_SWAP_ALPHA;
+	    else if (token_is(KW_invert_alpha))
+		write_transform_options |= PNG_TRANSFORM_INVERT_ALPHA;
+	    else if (token_is(KW_swap_endian))
+		write_transform_options |= PNG_TRANSFORM_SWAP_ENDIAN;
+	    else if (token_is(KW_strip_filler))
+		write_transform_options |= PNG_TRANSFORM_STRIP_FILLER;
+	}
+	else
+	    fatal("invalid token `%s' in IMAGE specification", token_buffer);
+
     /*
-     * Compute the actual size of the image in samples.
+     * Compute the actual size of the image in samples.  Packed rows are
+     * padded out to whole bytes, and any samples of an unfinished row
+     * are still waiting in the sink.
      */
     input_width = nbytes / height;
     if (bit_depth >= 8)
 	nsamples = nbytes / bytes_per_sample;
     else
     {
-	int samples_per_byte = (8 / bit_depth);
+	size_t	rowbytes = png_get_rowbytes(png_ptr, info_ptr);
 
-	nsamples = nbytes * samples_per_byte;
-
-	/*
-	 * Images of bit depth less than 8 will have excess data in the
-	 * byte corresponding to the last pixel(s) in a row when the
-	 * width is not a multiple of 8.  Correct for this.
-	 */
-	if (width % 8)
-	{
-	    int excess_samples_per_line = (width % samples_per_byte);
-
-	    if (excess_samples_per_line)
-		nsamples -= height * (samples_per_byte - excess_samples_per_line);
-	}
+	nsamples = nbytes / rowbytes * width
+	    + nbytes % rowbytes * (8 / bit_depth) + pending;
     }
-    if (nsamples != width * height)
-	fatal("sample count (%d) doesn't match width*height (%d*%d) in IHDR",
-	      nsamples, width, height);
+    if (nsamples != (uint64_t)width * height)
+	fatal("sample count (%llu) doesn't match width*height (%lu*%lu) in IHDR",
+	      (unsigned long long)nsamples,
+	      (unsigned long)width, (unsigned long)height);
+
+    /* a streamed image has already been handed to libpng */
+    if (image_written)
+	return;
 
 #ifdef PNG_DEBUG
 #if (PNG_DEBUG >= 6)
     /* dump the data as a check */
     {
-	int	n;
+	size_t	n;
 
-	fprintf(stderr, "image data:\n");
+	fprintf(SNG_STDERR, "image data:\n");
 	for (n = 0; n < nbytes; n++)
 	{
-	    fprintf(stderr, "%02x ", bytes[n] & 0xff);
+	    fprintf(SNG_STDERR, "%02x ", bytes[n] & 0xff);
 	    if ((n+1) % input_width == 0)
-		fputc('\n', stderr);
+		fputc('\n', SNG_STDERR);
 	}
     }
 #endif
 #endif
 
-    row_pointers = (png_byte **)xalloc(sizeof(png_bytep) * height);
+    row_pointers = pool_spill(conversion_pool, sizeof(png_bytep) * height);
     for (i = 0; i < height; i++)
-	row_pointers[i] = &bytes[i * input_width];
+	row_pointers[i] = &bytes[(size_t)i * input_width];
 
 #ifndef PNG_INFO_IMAGE_SUPPORTED
     /* got the bits; now write them out */
-    png_write_image(png_ptr, row_pointers);
-    free(bytes);
-    free(row_pointers);
+    TIMED(PHASE_PNG, png_write_image(png_ptr, row_pointers));
 #else
     /* got the bits; attach them to the info structure */
     png_set_rows(png_ptr, info_ptr, row_pointers);
 #endif /* PNG_INFO_IMAGE_SUPPORTED */
 }
 
+static void set_compression(const sng_compression *sc)
+/* hand deflate settings to libpng, leaving defaults where none are given */
+{
+    sng_compression	*cs = &compression_settings;
+
+    if (sc->level >= 0)
+	png_set_compression_level(png_ptr, cs->level = sc->level);
+    if (sc->strategy >= 0)
+	png_set_compression_strategy(png_ptr, cs->strategy = sc->strategy);
+    if (sc->filters >= 0)
+	png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, cs->filters = sc->filters);
+    if (sc->window >= 0)
+	png_set_compression_window_bits(png_ptr, cs->window = sc->window);
+    if (sc->memlevel >= 0)
+	png_set_compression_mem_level(png_ptr, cs->memlevel = sc->memlevel);
+    if (sc->idat_size >= 0)
+	png_set_compression_buffer_size(png_ptr, cs->idat_size = sc->idat_size);
+}
+
+static void compile_compression(void)
+/* compile the deflate settings pseudo-chunk */
+{
+    sng_compression	sc = default_compression;
+    const sng_compression *co = &compression_override;
+
+    while (get_inner_token())
+	if (token_is(KW_level))
+	{
+	    if ((sc.level = byte_numeric(get_token())) > 9)
+		fatal("compression level must be 0 to 9");
+	}
+	else if (token_is(KW_strategy))
+	{
+	    get_inner_token();
+	    if (token_is(KW_default))
+		sc.strategy = Z_DEFAULT_STRATEGY;
+	    else if (token_is(KW_filtered))
+		sc.strategy = Z_FILTERED;
+	    else if (token_is(KW_huffman))
+		sc.strategy = Z_HUFFMAN_ONLY;
+	    else if (token_is(KW_rle))
+		sc.strategy = Z_RLE;
+	    else if (token_is(KW_fixed))
+		sc.strategy = Z_FIXED;
+	    else
+		fatal("invalid compression strategy `%s'", token_buffer);
+	}
+	else if (token_is(KW_filters))
+	{
+	    sc.filters = 0;
+	    for (;;)
+	    {
+		get_inner_token();
+		if (token_is(KW_none))
+		    sc.filters |= PNG_FILTER_NONE;
+		else if (token_is(KW_sub))
+		    sc.filters |= PNG_FILTER_SUB;
+		else if (token_is(KW_up))
+		    sc.filters |= PNG_FILTER_UP;
+		else if (token_is(KW_avg))
+		    sc.filters |= PNG_FILTER_AVG;
+		else if (token_is(KW_paeth))
+		    sc.filters |= PNG_FILTER_PAETH;
+		else if (token_is(KW_all))
+		    sc.filters |= PNG_ALL_FILTERS;
+		else
+		{
+		    /* the next setting, or the closing brace */
+		    push_token();
+		    break;
+		}
+	    }
+	    if (!sc.filters)
+		fatal("no filters listed in compression specification");
+	}
+	else if (token_is(KW_window))
+	{
+	    sc.window = byte_numeric(get_token());
+	    if (sc.window < 8 || sc.window > 15)
+		fatal("compression window must be 8 to 15");
+	}
+	else if (token_is(KW_memlevel))
+	{
+	    sc.memlevel = byte_numeric(get_token());
+	    if (sc.memlevel < 1 || sc.memlevel > 9)
+		fatal("compression memlevel must be 1 to 9");
+	}
+	else if (token_is(KW_idatsize))
+	{
+	    if ((sc.idat_size = long_numeric(get_token())) < 6)
+		fatal("IDAT size must be at least 6");
+	}
+	else
+	    fatal("invalid token `%s' in compression specification",
+		  token_buffer);
+
+    /* the command line has the last word */
+    if (co->level >= 0)
+	sc.level = co->level;
+    if (co->strategy >= 0)
+	sc.strategy = co->strategy;
+    if (co->filters >= 0)
+	sc.filters = co->filters;
+    if (co->window >= 0)
+	sc.window = co->window;
+    if (co->memlevel >= 0)
+	sc.memlevel = co->memlevel;
+    if (co->idat_size >= 0)
+	sc.idat_size = co->idat_size;
+    set_compression(&sc);
+}
+
+void write_trailing_chunks(void)
+/* finish a file whose IDATs were written without png_write_image() */
+{
+    png_unknown_chunkp	entries;
+    int			num_unknown_chunks, i;
+
+    /*
+     * png_write_end() won't finish a file whose IDATs it didn't write
+     * itself, so the unknown chunks that go after the image data and the
+     * IEND are put out by hand.  Everything else went with png_write_info().
+     */
+    num_unknown_chunks = png_get_unknown_chunks(png_ptr, info_ptr, &entries);
+    for (i = 0; i < num_unknown_chunks; i++)
+	if (entries[i].location & PNG_AFTER_IDAT)
+	    png_write_chunk(png_ptr, entries[i].name,
+			    entries[i].data, entries[i].size);
+    png_write_chunk(png_ptr, (png_const_bytep)"IEND", NULL, 0);
+}
+
 static void compile_private(char *name)
 /* compile a private chunk */
 {
-    int			nbytes;
+    size_t		nbytes;
     png_byte		*bytes;
     png_unknown_chunk	chunk;
 
@@ -1731,76 +2728,122 @@ static void compile_private(char *name)
     else
 	memcpy(chunk.name, name, sizeof(chunk.name));
 
-    require_or_die("{");
+    require_or_die(KW_LBRACE);
     collect_data(&nbytes, &bytes);
-    require_or_die("}");
+    require_or_die(KW_RBRACE);
 
     chunk.data = bytes;
     chunk.size = nbytes;
-//    chunk.location = TODO; PNG_HAVE_IHDR or PNG_HAVE_PLTE or PNG_AFTER_IDAT
-    chunk.location = PNG_HAVE_IHDR; // FIXME
-    png_set_unknown_chunks(png_ptr, info_ptr, &chunk, 1);
-// TODO: also use png_set_unknown_chunk_location if libpng before 1.6.0
-    png_free(png_ptr, bytes);
+    queue_chunk(&chunk);
 }
 
 int sngc(FILE *fin, char *name, FILE *fout)
 /* compile SNG on fin to PNG on fout */
 {
-    int	prevchunk, errtype;
-    char buf[BUFSIZ];
+    static SNG_TLS sng_input input;
+    static SNG_TLS sng_output output;
+    int status;
+
+    stats_begin(PHASE_PARSE);
+    input_open(&input, fin);
+    output_open(&output, fout);
+    status = sngc_io(&input, name, &output);
+    output_close(&output);
+    input_close(&input);
+    if (timing)
+	stats_report(SNG_STDERR, name, "compile", status);
+
+    return(status);
+}
+
+int sngc_io(sng_input *in, char *name, sng_output *out)
+/* compile SNG from an input buffer to PNG through an output buffer */
+{
+    int	prevchunk, errtype, i;
+    char buf[BUFSIZ], *bp;
+    static SNG_TLS sng_pool pool;
+    int c;
 
-    yyin = fin;
     file = name;
     linenum = 1;
+    conversion_pool = &pool;
+    sidecar_files = 0;
+
+    /* all reads of the SNG source go through the input layer */
+    yyin = in;
 
-    if (fgets(buf, sizeof(buf), fin) == NULL)
+    for (bp = buf; bp < buf + sizeof(buf) - 1; )
+	if ((c = input_getc(yyin)) == EOF)
+	    break;
+	else if ((*bp++ = c) == '\n')
+	    break;
+    *bp = '\0';
+
+    if (bp == buf)
     {
-	fputs("sng: no data in file\n", stderr);
-	exit(1);
+	fputs("sng: no data in file\n", SNG_STDERR);
+	return(1);
     }
     else if (strncmp("#SNG", buf, 3))
     {
-	fputs("sng: this is not an sng file\n", stderr);
-	exit(1);
+	fputs("sng: this is not an sng file\n", SNG_STDERR);
+	return(1);
     }
 
-    /* Create and initialize the png_struct with the desired error handler
-     * functions.  If you want to use the default stderr and longjump method,
-     * you can supply NULL for the last three parameters.  We also check that
-     * the library version is compatible with the one used at compile time,
-     * in case we are using dynamically linked libraries.  REQUIRED.
+    /* Create and initialize the png_struct with sng's error handler
+     * functions and allocators.  The library version is checked against
+     * the one used at compile time, in case we are using dynamically
+     * linked libraries.  REQUIRED.
      */
-    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-				      (void *)NULL, NULL, NULL);
+    png_ptr = sng_create_write_struct();
 
     if (png_ptr == NULL)
+    {
+	pool_release(&pool);
 	return(2);
+    }
 
     /* Allocate/initialize the image information data.  REQUIRED */
     info_ptr = png_create_info_struct(png_ptr);
     if (info_ptr == NULL)
     {
 	png_destroy_write_struct(&png_ptr,  (png_infopp)NULL);
+	pool_release(&pool);
 	return(2);
     }
 
     /* if errtype is not 1, this was generated by fatal() */ 
     if ((errtype = setjmp(png_jmpbuf(png_ptr)))) {
 	if (errtype == 1)
-	    fprintf(stderr, "%s:%d: libpng croaked\n", file, linenum);
-	free(png_ptr);
-	free(info_ptr);
+	    fprintf(SNG_STDERR, "%s:%d: libpng croaked\n", file, linenum);
+	payload_end();
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	input_unmap_files();
+	pool_release(&pool);
 	return errtype;
     }
 
-    /* set up the output control if you are using standard C streams */
-    png_init_io(png_ptr, fout);
+    /* PNG data goes out through the output buffer */
+    png_set_write_fn(png_ptr, out, output_write_png, output_flush_png);
 
     /* keep all unknown chunks, we'll dump them later */
     png_set_keep_unknown_chunks(png_ptr, 2, NULL, 0);
 
+    /* deflate settings from the command line, if any */
+    compression_settings = default_compression;
+    set_compression(&compression_override);
+
     write_transform_options = PNG_TRANSFORM_IDENTITY;
+    image_written = FALSE;
+    raw_idat = NULL;
+    raw_count = 0;
+    queued_text = NULL;
+    ntext_queued = text_room = 0;
+    queued_chunks = NULL;
+    nchunks_queued = chunk_room = 0;
+    queued_built = NULL;
+    queued_jobs = NULL;
+    nbuilt_queued = built_room = jobs_room = 0;
 
     /* initialize per-input-file chunk properties */
     for (chunkprops *pp = properties;
@@ -1814,17 +2857,14 @@ int sngc(FILE *fin, char *name, FILE *fout)
     {
 	chunkprops *pp;
 
-	for (pp = properties; 
-		 pp < properties + sizeof(properties)/sizeof(chunkprops);
-		 pp++)
-	    if (token_equals(pp->name))
-		goto ok;
-	fatal("unknown chunk type `%s'", token_buffer);
+	/* chunk names are the first keywords, in the order of properties[] */
+	if (token_keyword() < 0 || token_id > PRIVATE)
+	    fatal("unknown chunk type `%s'", token_buffer);
+	pp = properties + token_id;
 
-    ok:
 	if (!get_token())
 	    fatal("unexpected EOF");
-	if (!token_equals("{") && (pp - properties) != PRIVATE)
+	if (!token_is(KW_LBRACE) && (pp - properties) != PRIVATE)
 	    fatal("missing chunk delimiter");
 	if (!pp->multiple_ok && pp->count > 0)
 	    fatal("illegal repeated chunk");
@@ -1847,6 +2887,7 @@ int sngc(FILE *fin, char *name, FILE *fout)
 	    else if (!(png_get_color_type(png_ptr, info_ptr) & PNG_COLOR_MASK_PALETTE))
 		fatal("PLTE chunk specified for non-palette image type");
 #ifndef PNG_INFO_IMAGE_SUPPORTED
+	    register_queued();
 	    png_write_info_before_PLTE(png_ptr, info_ptr);
 #endif /* PNG_INFO_IMAGE_SUPPORTED */
 	    compile_PLTE();
@@ -1860,7 +2901,10 @@ int sngc(FILE *fin, char *name, FILE *fout)
 	    /* force out the pre-IDAT portions */
 #ifndef PNG_INFO_IMAGE_SUPPORTED
 	    if (properties[IDAT].count == 0)
+	    {
+		register_queued();
 		png_write_info(png_ptr, info_ptr);
+	    }
 #endif /* PNG_INFO_IMAGE_SUPPORTED */
 	    compile_IDAT();
 	    break;
@@ -1894,7 +2938,7 @@ int sngc(FILE *fin, char *name, FILE *fout)
 		fatal("sRGB chunk must come before PLTE and IDAT");
 	    png_set_sRGB_gAMA_and_cHRM(png_ptr, info_ptr,
 				       byte_numeric(get_token()));
-	    if (!get_token() || !token_equals("}"))
+	    if (!get_token() || !token_is(KW_RBRACE))
 		fatal("bad token `%s' in sRGB specification", token_buffer);
 	    break;
 
@@ -1984,19 +3028,28 @@ int sngc(FILE *fin, char *name, FILE *fout)
 	    /* force out the pre-IDAT portions */
 #ifndef PNG_INFO_IMAGE_SUPPORTED
 	    if (properties[IMAGE].count == 0)
+	    {
+		register_queued();
 		png_write_info(png_ptr, info_ptr);
+	    }
 #endif /* PNG_INFO_IMAGE_SUPPORTED */
 	    compile_IMAGE();
 	    properties[IDAT].count++;
 	    break;
 
+	case COMPRESSION:
+	    if (properties[IDAT].count)
+		fatal("compression specification must come before IDAT");
+	    compile_compression();
+	    break;
+
 	case PRIVATE:
 	    compile_private(token_buffer);
 	    break;
 	}
 
 	if (verbose > 1)
-	    fprintf(stderr, "%s specification processed\n", pp->name);
+	    fprintf(SNG_STDERR, "%s specification processed\n", pp->name);
 	prevchunk = (pp - properties);
 	pp->count++;
     }
@@ -2010,20 +3063,116 @@ int sngc(FILE *fin, char *name, FILE *fout)
     if (properties[iCCP].count && properties[sRGB].count)
 	fatal("cannot have both iCCP and sRGB chunks (PNG spec 4.2.2.4)");
 
-#ifndef PNG_INFO_IMAGE_SUPPORTED
+    /* the rest is libpng's work, apart from the output itself */
+    phase_switch(PHASE_PNG);
+    register_queued();
+
+#ifdef PNG_INFO_IMAGE_SUPPORTED
+    if (raw_count)
+    {
+	/* IDAT specifications go out exactly as given */
+	png_write_info(png_ptr, info_ptr);
+	for (i = 0; i < raw_count; i++)
+	    png_write_chunk(png_ptr, (png_const_bytep)"IDAT",
+			    raw_idat[i].data, raw_idat[i].size);
+	write_trailing_chunks();
+    }
+    else if (!image_written)
+    {
+	/* big untransformed images can be deflated on several threads */
+	if (threads < 2 || write_transform_options
+		|| !write_image_parallel(&compression_settings, threads))
+	    png_write_png(png_ptr, info_ptr, write_transform_options, NULL);
+    }
+    else
+#endif /* PNG_INFO_IMAGE_SUPPORTED */
     /* It is REQUIRED to call this to finish writing the rest of the file */
     png_write_end(png_ptr, info_ptr);
-#else
-    png_write_png(png_ptr, info_ptr, write_transform_options, NULL);
-#endif /* PNG_INFO_IMAGE_SUPPORTED */
+
+    /* push out the last block while write errors can still be caught */
+    output_flush_png(png_ptr);
 
     /* if you malloced the palette, free it here */
     /* free(info_ptr->palette); */
 
     /* clean up after the write, and free any memory allocated */
-    png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+    payload_end();
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    input_unmap_files();
+    pool_release(&pool);
 
     return(0);
 }
 
+/*************************************************************************
+ *
+ * Benchmark hooks
+ *
+ * These run parts of the compiler on their own, so that sngbench can
+ * time them apart from the rest.  They aren't part of the library
+ * interface.
+ *
+ ************************************************************************/
+
+long sngc_bench_lex(sng_input *in)
+/* tokenize SNG source without compiling any of it; return the token count */
+{
+    long	ntokens = 0;
+
+    file = "bench";
+    linenum = 1;
+    pushed = FALSE;
+    yyin = in;
+
+    while (get_token())
+	ntokens++;
+    return(ntokens);
+}
+
+long sngc_bench_data(sng_input *in, png_uint_32 width, png_uint_32 height)
+/* decode a series of data segments in braces; return the bytes decoded */
+{
+    static SNG_TLS sng_pool pool;
+    volatile long	total = 0;
+    size_t		nbytes;
+    png_byte		*bytes;
+
+    file = "bench";
+    linenum = 1;
+    pushed = FALSE;
+    yyin = in;
+    conversion_pool = &pool;
+
+    /* P1 and P3 segments are checked against the image dimensions */
+    png_ptr = sng_create_write_struct();
+    if (png_ptr == NULL || (info_ptr = png_create_info_struct(png_ptr)) == NULL)
+    {
+	png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+	return(-1);
+    }
+
+    if (setjmp(png_jmpbuf(png_ptr)))
+	total = -1;
+    else
+    {
+	png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB,
+		     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+		     PNG_FILTER_TYPE_DEFAULT);
+	while (get_token())
+	{
+	    if (!token_is(KW_LBRACE))
+		fatal("unexpected token `%s' while waiting for {", token_buffer);
+	    collect_data(&nbytes, &bytes);
+	    require_or_die(KW_RBRACE);
+	    total += nbytes;
+	    pool_release(&pool);
+	}
+    }
+
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    pool_release(&pool);
+    conversion_pool = NULL;
+    return(total);
+}
+
 /* sngc.c ends here */
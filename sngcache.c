@@ -0,0 +1,583 @@
+/*****************************************************************************
+
+NAME
+   sngcache.c -- reuse the output of conversions whose input hasn't changed.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "config.h"
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif /* HAVE_MMAP */
+#ifdef HAVE_SYS_FILE_H
+#include <sys/file.h>
+#endif /* HAVE_SYS_FILE_H */
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif /* HAVE_LINUX_FS_H */
+#include "png.h"
+#include "sng.h"
+
+/*************************************************************************
+ *
+ * XXH64
+ *
+ * Yann Collet's xxHash, 64-bit version, written out from the published
+ * algorithm.  It runs at memory speed, which matters when every input of
+ * a build is hashed on every run.
+ *
+ ************************************************************************/
+
+#define PRIME64_1	0x9E3779B185EBCA87ULL
+#define PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3	0x165667B19E3779F9ULL
+#define PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define PRIME64_5	0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return((x << r) | (x >> (64 - r)));
+}
+
+static uint64_t read64(const unsigned char *p)
+/* little-endian, whatever the machine */
+{
+    return((uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+	   | (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40
+	   | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56);
+}
+
+static uint64_t read32(const unsigned char *p)
+{
+    return((uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+	   | (uint64_t)p[3] << 24);
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    return(rotl64(acc, 31) * PRIME64_1);
+}
+
+static uint64_t xxh_merge(uint64_t h, uint64_t v)
+{
+    h ^= xxh_round(0, v);
+    return(h * PRIME64_1 + PRIME64_4);
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+/* hash a buffer */
+{
+    const unsigned char	*p = data, *end = p + len;
+    uint64_t		h;
+
+    if (len >= 32)
+    {
+	uint64_t	v1 = seed + PRIME64_1 + PRIME64_2;
+	uint64_t	v2 = seed + PRIME64_2;
+	uint64_t	v3 = seed;
+	uint64_t	v4 = seed - PRIME64_1;
+
+	do {
+	    v1 = xxh_round(v1, read64(p));
+	    v2 = xxh_round(v2, read64(p + 8));
+	    v3 = xxh_round(v3, read64(p + 16));
+	    v4 = xxh_round(v4, read64(p + 24));
+	    p += 32;
+	} while (end - p >= 32);
+
+	h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+	h = xxh_merge(h, v1);
+	h = xxh_merge(h, v2);
+	h = xxh_merge(h, v3);
+	h = xxh_merge(h, v4);
+    }
+    else
+	h = seed + PRIME64_5;
+    h += (uint64_t)len;
+
+    for (; end - p >= 8; p += 8)
+	h = rotl64(h ^ xxh_round(0, read64(p)), 27) * PRIME64_1 + PRIME64_4;
+    if (end - p >= 4)
+    {
+	h = rotl64(h ^ read32(p) * PRIME64_1, 23) * PRIME64_2 + PRIME64_3;
+	p += 4;
+    }
+    for (; p < end; p++)
+	h = rotl64(h ^ *p * PRIME64_5, 11) * PRIME64_1;
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return(h);
+}
+
+/*************************************************************************
+ *
+ * The cache directory
+ *
+ * Each output is kept in a file named for its key, the hash of the input
+ * and the name it was given by, with the conversion options, sng, libpng
+ * and zlib versions folded in through the seed.  The manifest records
+ * which key each input path last had: a header, records sorted by path
+ * hash as of the last clean-up, and records appended since, each written
+ * by a single write() so that -j children can add to it at once.  At the
+ * end of a run the parent sorts the new records in, keeping the latest
+ * for each path, and removes the outputs that no path has any more.  Runs
+ * sharing a cache hold a shared lock on the manifest while they go, and
+ * an exclusive one to clean up.
+ *
+ ************************************************************************/
+
+/* the first record; the key field holds the count of sorted records */
+#define CACHE_MAGIC	0x53474e4341434831ULL
+
+/* left-overs of interrupted stores older than this are removed */
+#define STALE_SECONDS	(60 * 60)
+
+typedef struct
+{
+    uint64_t	name;		/* hash of the absolute path of the input */
+    uint64_t	key;		/* its output's key */
+}
+manifest_record;
+
+static char		*cache_dir;
+static uint64_t		cache_seed[2];	/* PNG to SNG, and back */
+static int		manifest_fd = -1;
+static manifest_record	*manifest;	/* as it was when the run began */
+static size_t		manifest_size;	/* bytes of it */
+
+static char *cache_path(const char *leaf)
+/* name a file in the cache directory, in a buffer from xalloc() */
+{
+    char *path = xalloc(strlen(cache_dir) + strlen(leaf) + 2);
+
+    sprintf(path, "%s/%s", cache_dir, leaf);
+    return(path);
+}
+
+static void object_name(uint64_t key, char *leaf)
+{
+    sprintf(leaf, "%016llx", (unsigned long long)key);
+}
+
+static manifest_record *load_manifest(size_t *size)
+/* get the manifest as it is now, mapped if we can */
+{
+    struct stat		sb;
+    manifest_record	*records;
+
+    if (fstat(manifest_fd, &sb) != 0
+	|| sb.st_size < (off_t)sizeof(manifest_record))
+	return(NULL);
+    *size = (size_t)sb.st_size - (size_t)sb.st_size % sizeof(manifest_record);
+#ifdef HAVE_MMAP
+    records = mmap(NULL, *size, PROT_READ, MAP_SHARED, manifest_fd, 0);
+    if (records != MAP_FAILED)
+	return(records);
+#endif /* HAVE_MMAP */
+    if ((records = malloc(*size)) == NULL)
+	return(NULL);
+    if (pread(manifest_fd, records, *size, 0) != (ssize_t)*size)
+    {
+	free(records);
+	return(NULL);
+    }
+    return(records);
+}
+
+static void unload_manifest(manifest_record *records, size_t size)
+{
+#ifdef HAVE_MMAP
+    if (munmap(records, size) == 0)
+	return;
+#endif /* HAVE_MMAP */
+    free(records);
+}
+
+static void lock_manifest(int how)
+{
+#ifdef HAVE_SYS_FILE_H
+    while (flock(manifest_fd, how) != 0 && errno == EINTR)
+	continue;
+#endif /* HAVE_SYS_FILE_H */
+}
+
+static int manifest_ok(void)
+/* is the manifest loaded, and one of ours? */
+{
+    return(manifest && manifest[0].name == CACHE_MAGIC
+	   && manifest[0].key < manifest_size / sizeof(manifest_record));
+}
+
+int cache_open(const char *dir, const char *options)
+/* use a cache directory, making it if need be; FALSE if it can't be had */
+{
+    char	*path;
+
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+	return(FALSE);
+    cache_dir = xalloc(strlen(dir) + 1);
+    strcpy(cache_dir, dir);
+    cache_seed[0] = xxh64(options, strlen(options), 0);
+    cache_seed[1] = xxh64(options, strlen(options), 1);
+
+    path = cache_path("manifest");
+    manifest_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    free(path);
+    if (manifest_fd < 0)
+	return(FALSE);
+    lock_manifest(LOCK_SH);
+
+    manifest = load_manifest(&manifest_size);
+    if (!manifest_ok())
+    {
+	manifest_record	header;
+
+	/* new, or not ours; start it over unless another run just has */
+	lock_manifest(LOCK_EX);
+	if (manifest)
+	    unload_manifest(manifest, manifest_size);
+	manifest = load_manifest(&manifest_size);
+	if (!manifest_ok())
+	{
+	    if (manifest)
+		unload_manifest(manifest, manifest_size);
+	    manifest = NULL;
+	    header.name = CACHE_MAGIC;
+	    header.key = 0;
+	    if (ftruncate(manifest_fd, 0) != 0
+		|| write(manifest_fd, &header, sizeof(header))
+		   != sizeof(header))
+	    {
+		close(manifest_fd);
+		manifest_fd = -1;
+		return(FALSE);
+	    }
+	}
+	lock_manifest(LOCK_SH);
+    }
+    return(TRUE);
+}
+
+static int by_name(const void *a, const void *b)
+{
+    uint64_t	x = ((const manifest_record *)a)->name;
+    uint64_t	y = ((const manifest_record *)b)->name;
+
+    return(x < y ? -1 : x > y);
+}
+
+static int copy_file(int from, int to)
+/* copy one open file to another, sharing the blocks if we can */
+{
+    char	buf[64 * 1024];
+    ssize_t	n;
+
+#ifdef FICLONE
+    if (ioctl(to, FICLONE, from) == 0)
+	return(TRUE);
+#endif /* FICLONE */
+    while ((n = read(from, buf, sizeof(buf))) > 0)
+	if (write(to, buf, n) != n)
+	    return(FALSE);
+    return(n == 0);
+}
+
+int cache_lookup(const char *name, int sng2png, cache_entry *entry)
+/* work out the key of a conversion; FALSE if the input can't be read */
+{
+    struct stat	sb;
+    char	*path;
+    void	*data;
+    int		fd;
+
+    if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &sb) != 0)
+    {
+	if (fd >= 0)
+	    close(fd);
+	return(FALSE);
+    }
+#ifdef HAVE_MMAP
+    data = sb.st_size ? mmap(NULL, (size_t)sb.st_size, PROT_READ,
+			     MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (data != MAP_FAILED)
+    {
+	entry->key = xxh64(data, (size_t)sb.st_size, cache_seed[sng2png]);
+	munmap(data, (size_t)sb.st_size);
+    }
+    else
+#endif /* HAVE_MMAP */
+    {
+	size_t	len = (size_t)sb.st_size;
+
+	data = xalloc(len + 1);
+	if (read(fd, data, len) != (ssize_t)len)
+	{
+	    free(data);
+	    close(fd);
+	    return(FALSE);
+	}
+	entry->key = xxh64(data, len, cache_seed[sng2png]);
+	free(data);
+    }
+    close(fd);
+
+    /* a decompile writes the name it was given into its output */
+    entry->key = xxh64(name, strlen(name), entry->key);
+
+    /* the same file reached by another path is the same input */
+    if ((path = realpath(name, NULL)) != NULL)
+    {
+	entry->name = xxh64(path, strlen(path), 0);
+	free(path);
+    }
+    else
+	entry->name = xxh64(name, strlen(name), 0);
+    return(TRUE);
+}
+
+static void note_entry(const cache_entry *entry)
+/* record that a path has a key, unless the manifest says so already */
+{
+    manifest_record	record, *found = NULL;
+
+    record.name = entry->name;
+    record.key = entry->key;
+    if (manifest)
+	found = bsearch(&record, manifest + 1, (size_t)manifest[0].key,
+			sizeof(manifest_record), by_name);
+    if (found == NULL || found->key != entry->key)
+	if (write(manifest_fd, &record, sizeof(record)) != sizeof(record))
+	    return;	/* it will just be converted again next time */
+}
+
+int cache_fetch(const cache_entry *entry, const char *outfile)
+/* make a conversion's output from the cache; FALSE if it isn't there */
+{
+    char	leaf[17], *path;
+    int		from, to, ok;
+
+    object_name(entry->key, leaf);
+    path = cache_path(leaf);
+    from = open(path, O_RDONLY);
+    free(path);
+    if (from < 0)
+	return(FALSE);
+    if ((to = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+	close(from);
+	return(FALSE);
+    }
+    ok = copy_file(from, to);
+    close(from);
+    if (close(to) != 0 || !ok)
+	return(FALSE);
+    note_entry(entry);
+    return(TRUE);
+}
+
+void cache_store(const cache_entry *entry, const char *outfile)
+/* keep the output of a conversion that went cleanly */
+{
+    char	leaf[17], *tmp, *path;
+    int		from, to, ok;
+    mode_t	mask;
+
+    if ((from = open(outfile, O_RDONLY)) < 0)
+	return;
+    tmp = cache_path("tmp.XXXXXX");
+    if ((to = mkstemp(tmp)) < 0)
+    {
+	close(from);
+	free(tmp);
+	return;
+    }
+    mask = umask(0);
+    umask(mask);
+    fchmod(to, 0666 & ~mask);
+    ok = copy_file(from, to);
+    close(from);
+    if (close(to) != 0)
+	ok = FALSE;
+
+    /* readers see the whole of it or nothing */
+    object_name(entry->key, leaf);
+    path = cache_path(leaf);
+    if (ok && rename(tmp, path) == 0)
+	note_entry(entry);
+    else
+	unlink(tmp);
+    free(path);
+    free(tmp);
+}
+
+typedef struct
+{
+    manifest_record	r;
+    size_t		seq;		/* place in the manifest */
+}
+numbered_record;
+
+static int by_name_newest(const void *a, const void *b)
+/* sort by path hash, the latest record for a path first */
+{
+    const numbered_record	*x = a, *y = b;
+
+    if (x->r.name != y->r.name)
+	return(x->r.name < y->r.name ? -1 : 1);
+    return(x->seq < y->seq ? 1 : x->seq > y->seq ? -1 : 0);
+}
+
+static int by_key(const void *a, const void *b)
+{
+    uint64_t	x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return(x < y ? -1 : x > y);
+}
+
+static int is_object(const char *leaf)
+/* is this the name of a cached output? */
+{
+    int	i;
+
+    for (i = 0; i < 16; i++)
+	if (leaf[i] == '\0' || strchr("0123456789abcdef", leaf[i]) == NULL)
+	    return(FALSE);
+    return(leaf[16] == '\0');
+}
+
+static void prune(const uint64_t *keys, size_t nkeys)
+/* remove the outputs no path has any more, and abandoned stores */
+{
+    DIR			*dp;
+    struct dirent	*de;
+    time_t		now = time(NULL);
+
+    if ((dp = opendir(cache_dir)) == NULL)
+	return;
+    while ((de = readdir(dp)) != NULL)
+    {
+	char		*path;
+	struct stat	sb;
+	uint64_t	key;
+	int		dead;
+
+	if (is_object(de->d_name))
+	{
+	    key = strtoull(de->d_name, NULL, 16);
+	    dead = bsearch(&key, keys, nkeys, sizeof(uint64_t), by_key)
+		   == NULL;
+	}
+	else if (strncmp(de->d_name, "tmp.", 4) == 0)
+	    dead = -1;		/* if it's old enough */
+	else
+	    continue;
+	path = cache_path(de->d_name);
+	if (dead > 0
+	    || (dead < 0 && stat(path, &sb) == 0
+		&& now - sb.st_mtime > STALE_SECONDS))
+	    unlink(path);
+	free(path);
+    }
+    closedir(dp);
+}
+
+void cache_close(void)
+/* fold this run's records into the manifest and prune dead outputs */
+{
+    manifest_record	*records;
+    numbered_record	*all;
+    uint64_t		*keys;
+    size_t		size, nrecords, nlive, nkeys, i;
+    char		*path;
+    int			fd;
+
+    if (manifest_fd < 0)
+	return;
+    if (manifest)
+	unload_manifest(manifest, manifest_size);
+    manifest = NULL;
+
+    /* there's only work to do when some run has added records */
+    lock_manifest(LOCK_EX);
+    if ((records = load_manifest(&size)) == NULL
+	|| records[0].name != CACHE_MAGIC
+	|| (size_t)records[0].key >= size / sizeof(manifest_record) - 1)
+    {
+	if (records)
+	    unload_manifest(records, size);
+	close(manifest_fd);
+	manifest_fd = -1;
+	return;
+    }
+
+    /* keep the latest record for each path */
+    nrecords = size / sizeof(manifest_record) - 1;
+    all = xalloc(nrecords * sizeof(numbered_record));
+    for (i = 0; i < nrecords; i++)
+    {
+	all[i].r = records[i + 1];
+	all[i].seq = i;
+    }
+    unload_manifest(records, size);
+    qsort(all, nrecords, sizeof(numbered_record), by_name_newest);
+    records = xalloc((nrecords + 1) * sizeof(manifest_record));
+    nlive = 0;
+    for (i = 0; i < nrecords; i++)
+	if (i == 0 || all[i].r.name != all[i - 1].r.name)
+	    records[++nlive] = all[i].r;
+    free(all);
+    records[0].name = CACHE_MAGIC;
+    records[0].key = nlive;
+
+    /* rewrite it in place, where the other runs' descriptors point */
+    path = cache_path("manifest");
+    if ((fd = open(path, O_WRONLY)) >= 0)
+    {
+	size = (nlive + 1) * sizeof(manifest_record);
+	if (write(fd, records, size) == (ssize_t)size)
+	{
+	    if (ftruncate(fd, (off_t)size) != 0)
+		nlive = 0;	/* don't prune what might still be wanted */
+	}
+	else
+	    nlive = 0;
+	close(fd);
+    }
+    else
+	nlive = 0;
+    free(path);
+
+    if (nlive)
+    {
+	keys = xalloc(nlive * sizeof(uint64_t));
+	for (i = 0; i < nlive; i++)
+	    keys[i] = records[i + 1].key;
+	qsort(keys, nlive, sizeof(uint64_t), by_key);
+	for (nkeys = 0, i = 0; i < nlive; i++)
+	    if (i == 0 || keys[i] != keys[i - 1])
+		keys[nkeys++] = keys[i];
+	prune(keys, nkeys);
+	free(keys);
+    }
+    free(records);
+    close(manifest_fd);
+    manifest_fd = -1;
+}
+
+/* sngcache.c ends here */
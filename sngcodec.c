@@ -0,0 +1,911 @@
+/*****************************************************************************
+
+NAME
+   sngcodec.c -- bulk encoding and decoding of SNG data segments.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include "config.h"
+#include "png.h"
+#include "sng.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif /* __AVX2__ */
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SNG_NEON
+#endif /* __ARM_NEON && __aarch64__ */
+
+/*************************************************************************
+ *
+ * Character tables
+ *
+ ************************************************************************/
+
+/* value of each hex digit; 0xff for anything else */
+const unsigned char hex_value[256] =
+{
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+/* value of each character of the SNG base64 alphabet (BASE64); 0xff if none */
+const unsigned char base64_value[256] =
+{
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+    0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32,
+    0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+/* value of each character of the RFC 4648 base64 alphabet; 0xff if none */
+const unsigned char rfc4648_value[256] =
+{
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+/*************************************************************************
+ *
+ * Vector kernels
+ *
+ * Each one decodes a fixed-size block of input, or returns FALSE without
+ * storing anything if the block contains a character that isn't a
+ * digit, so the caller can finish the job one character at a time.
+ *
+ ************************************************************************/
+
+#if defined(__SSE2__)
+/* lanes of v in the range lo..hi; the ranges we need are all ASCII */
+#define IN_RANGE(v, lo, hi)	_mm_and_si128( \
+				    _mm_cmpgt_epi8(v, _mm_set1_epi8((lo) - 1)), \
+				    _mm_cmplt_epi8(v, _mm_set1_epi8((hi) + 1)))
+
+static int hex_block_sse2(const unsigned char *src, png_byte *dst)
+/* decode 16 hex digits into 8 bytes */
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+    __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i digit = IN_RANGE(v, '0', '9');
+    __m128i alpha = IN_RANGE(folded, 'a', 'f');
+    __m128i nibble, pair;
+
+    if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff)
+	return(FALSE);
+
+    nibble = _mm_or_si128(
+	_mm_and_si128(digit, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+	_mm_and_si128(alpha, _mm_sub_epi8(folded, _mm_set1_epi8('a' - 10))));
+
+    /* the first digit of each pair is the low byte of a 16-bit lane */
+    pair = _mm_or_si128(
+	_mm_slli_epi16(_mm_and_si128(nibble, _mm_set1_epi16(0x00ff)), 4),
+	_mm_srli_epi16(nibble, 8));
+    _mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(pair, pair));
+    return(TRUE);
+}
+
+static int base64_block_sse2(const unsigned char *src, png_byte *dst)
+/* decode 16 SNG base64 characters into 16 bytes */
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+    __m128i digit = IN_RANGE(v, '0', '9');
+    __m128i upper = IN_RANGE(v, 'A', 'Z');
+    __m128i lower = IN_RANGE(v, 'a', 'z');
+    __m128i plus = _mm_cmpeq_epi8(v, _mm_set1_epi8('+'));
+    __m128i slash = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+    __m128i value;
+
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(digit, upper),
+		_mm_or_si128(lower, _mm_or_si128(plus, slash)))) != 0xffff)
+	return(FALSE);
+
+    value = _mm_or_si128(
+	_mm_or_si128(
+	    _mm_and_si128(digit, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+	    _mm_and_si128(upper, _mm_sub_epi8(v, _mm_set1_epi8('A' - 10)))),
+	_mm_or_si128(
+	    _mm_and_si128(lower, _mm_sub_epi8(v, _mm_set1_epi8('a' - 36))),
+	    _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62)),
+			 _mm_and_si128(slash, _mm_set1_epi8(63)))));
+    _mm_storeu_si128((__m128i *)dst, value);
+    return(TRUE);
+}
+static int rfc4648_block_sse2(const unsigned char *src, png_byte *dst)
+/* decode 16 RFC 4648 base64 characters into 12 bytes */
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+    __m128i upper = IN_RANGE(v, 'A', 'Z');
+    __m128i lower = IN_RANGE(v, 'a', 'z');
+    __m128i digit = IN_RANGE(v, '0', '9');
+    __m128i plus = _mm_cmpeq_epi8(v, _mm_set1_epi8('+'));
+    __m128i slash = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+    __m128i value, pair;
+    unsigned int quad[4];
+    int i;
+
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(digit, upper),
+		_mm_or_si128(lower, _mm_or_si128(plus, slash)))) != 0xffff)
+	return(FALSE);
+
+    value = _mm_or_si128(
+	_mm_or_si128(
+	    _mm_and_si128(upper, _mm_sub_epi8(v, _mm_set1_epi8('A'))),
+	    _mm_and_si128(lower, _mm_sub_epi8(v, _mm_set1_epi8('a' - 26)))),
+	_mm_or_si128(
+	    _mm_and_si128(digit, _mm_add_epi8(v, _mm_set1_epi8(52 - '0'))),
+	    _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62)),
+			 _mm_and_si128(slash, _mm_set1_epi8(63)))));
+
+    /* join pairs of sextets into 12 bits, then pairs of those into 24 */
+    pair = _mm_or_si128(
+	_mm_slli_epi16(_mm_and_si128(value, _mm_set1_epi16(0x00ff)), 6),
+	_mm_srli_epi16(value, 8));
+    _mm_storeu_si128((__m128i *)quad,
+		     _mm_madd_epi16(pair, _mm_set1_epi32(0x00011000)));
+
+    /* without SSSE3 there's no byte shuffle to squeeze out the gaps */
+    for (i = 0; i < 4; i++)
+    {
+	*dst++ = quad[i] >> 16;
+	*dst++ = quad[i] >> 8;
+	*dst++ = quad[i];
+    }
+    return(TRUE);
+}
+#undef IN_RANGE
+#endif /* __SSE2__ */
+
+#if defined(__AVX2__)
+#define IN_RANGE(v, lo, hi)	_mm256_and_si256( \
+				    _mm256_cmpgt_epi8(v, _mm256_set1_epi8((lo) - 1)), \
+				    _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), v))
+
+static int hex_block_avx2(const unsigned char *src, png_byte *dst)
+/* decode 32 hex digits into 16 bytes */
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)src);
+    __m256i folded = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i digit = IN_RANGE(v, '0', '9');
+    __m256i alpha = IN_RANGE(folded, 'a', 'f');
+    __m256i nibble, pair, packed;
+
+    if (_mm256_movemask_epi8(_mm256_or_si256(digit, alpha)) != -1)
+	return(FALSE);
+
+    nibble = _mm256_or_si256(
+	_mm256_and_si256(digit, _mm256_sub_epi8(v, _mm256_set1_epi8('0'))),
+	_mm256_and_si256(alpha, _mm256_sub_epi8(folded, _mm256_set1_epi8('a' - 10))));
+    pair = _mm256_or_si256(
+	_mm256_slli_epi16(_mm256_and_si256(nibble, _mm256_set1_epi16(0x00ff)), 4),
+	_mm256_srli_epi16(nibble, 8));
+
+    /* packus works within 128-bit lanes; gather the two low halves */
+    packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(pair, pair), 0x08);
+    _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(packed));
+    return(TRUE);
+}
+#undef IN_RANGE
+#endif /* __AVX2__ */
+
+#ifdef SNG_NEON
+#define IN_RANGE(v, lo, hi)	vandq_u8(vcgeq_u8(v, vdupq_n_u8(lo)), \
+					 vcleq_u8(v, vdupq_n_u8(hi)))
+
+static int hex_block_neon(const unsigned char *src, png_byte *dst)
+/* decode 32 hex digits into 16 bytes */
+{
+    uint8x16x2_t v = vld2q_u8(src);	/* first and second digits of pairs */
+    uint8x16_t nibble[2];
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+	uint8x16_t folded = vorrq_u8(v.val[i], vdupq_n_u8(0x20));
+	uint8x16_t digit = IN_RANGE(v.val[i], '0', '9');
+	uint8x16_t alpha = IN_RANGE(folded, 'a', 'f');
+
+	if (vminvq_u8(vorrq_u8(digit, alpha)) != 0xff)
+	    return(FALSE);
+	nibble[i] = vorrq_u8(
+	    vandq_u8(digit, vsubq_u8(v.val[i], vdupq_n_u8('0'))),
+	    vandq_u8(alpha, vsubq_u8(folded, vdupq_n_u8('a' - 10))));
+    }
+    vst1q_u8(dst, vorrq_u8(vshlq_n_u8(nibble[0], 4), nibble[1]));
+    return(TRUE);
+}
+
+static int base64_block_neon(const unsigned char *src, png_byte *dst)
+/* decode 16 SNG base64 characters into 16 bytes */
+{
+    uint8x16_t v = vld1q_u8(src);
+    uint8x16_t digit = IN_RANGE(v, '0', '9');
+    uint8x16_t upper = IN_RANGE(v, 'A', 'Z');
+    uint8x16_t lower = IN_RANGE(v, 'a', 'z');
+    uint8x16_t plus = vceqq_u8(v, vdupq_n_u8('+'));
+    uint8x16_t slash = vceqq_u8(v, vdupq_n_u8('/'));
+
+    if (vminvq_u8(vorrq_u8(vorrq_u8(digit, upper),
+			   vorrq_u8(lower, vorrq_u8(plus, slash)))) != 0xff)
+	return(FALSE);
+
+    vst1q_u8(dst, vorrq_u8(
+	vorrq_u8(vandq_u8(digit, vsubq_u8(v, vdupq_n_u8('0'))),
+		 vandq_u8(upper, vsubq_u8(v, vdupq_n_u8('A' - 10)))),
+	vorrq_u8(vandq_u8(lower, vsubq_u8(v, vdupq_n_u8('a' - 36))),
+		 vorrq_u8(vandq_u8(plus, vdupq_n_u8(62)),
+			  vandq_u8(slash, vdupq_n_u8(63))))));
+    return(TRUE);
+}
+#undef IN_RANGE
+#endif /* SNG_NEON */
+
+/*************************************************************************
+ *
+ * Run decoders
+ *
+ ************************************************************************/
+
+size_t hex_decode_run(const unsigned char *src, size_t len, png_byte *dst)
+/*
+ * Decode hex digit pairs from src until len characters are used up or a
+ * non-digit turns up.  Returns the number of characters consumed, which
+ * is always even; dst receives half that many bytes.
+ */
+{
+    const unsigned char *cp = src;
+
+#if defined(__AVX2__)
+    while (len - (cp - src) >= 32 && hex_block_avx2(cp, dst))
+    {
+	cp += 32;
+	dst += 16;
+    }
+#elif defined(SNG_NEON)
+    while (len - (cp - src) >= 32 && hex_block_neon(cp, dst))
+    {
+	cp += 32;
+	dst += 16;
+    }
+#endif
+#if defined(__SSE2__)
+    while (len - (cp - src) >= 16 && hex_block_sse2(cp, dst))
+    {
+	cp += 16;
+	dst += 8;
+    }
+#endif /* __SSE2__ */
+
+    while (len - (cp - src) >= 2)
+    {
+	unsigned char	hi = hex_value[cp[0]], lo = hex_value[cp[1]];
+
+	if ((hi | lo) > 15)
+	    break;
+	*dst++ = (hi << 4) | lo;
+	cp += 2;
+    }
+
+    return(cp - src);
+}
+
+size_t base64_decode_run(const unsigned char *src, size_t len, png_byte *dst)
+/*
+ * Decode SNG base64 characters from src until len characters are used up
+ * or a character outside the alphabet turns up.  Returns the number of
+ * characters consumed; dst receives that many bytes.
+ */
+{
+    const unsigned char *cp = src;
+
+#if defined(SNG_NEON)
+    while (len - (cp - src) >= 16 && base64_block_neon(cp, dst))
+    {
+	cp += 16;
+	dst += 16;
+    }
+#elif defined(__SSE2__)
+    while (len - (cp - src) >= 16 && base64_block_sse2(cp, dst))
+    {
+	cp += 16;
+	dst += 16;
+    }
+#endif
+
+    while (cp < src + len)
+    {
+	unsigned char	value = base64_value[*cp];
+
+	if (value > 63)
+	    break;
+	*dst++ = value;
+	cp++;
+    }
+
+    return(cp - src);
+}
+
+size_t rfc4648_decode_run(const unsigned char *src, size_t len, png_byte *dst)
+/*
+ * Decode whole groups of four RFC 4648 base64 characters from src until
+ * len characters are used up or a group has a character outside the
+ * alphabet, padding included.  Returns the number of characters
+ * consumed, which is always a multiple of four; dst receives three bytes
+ * for every four.
+ */
+{
+    const unsigned char *cp = src;
+
+#if defined(__SSE2__)
+    while (len - (cp - src) >= 16 && rfc4648_block_sse2(cp, dst))
+    {
+	cp += 16;
+	dst += 12;
+    }
+#endif /* __SSE2__ */
+
+    while (len - (cp - src) >= 4)
+    {
+	unsigned char	a = rfc4648_value[cp[0]], b = rfc4648_value[cp[1]];
+	unsigned char	c = rfc4648_value[cp[2]], d = rfc4648_value[cp[3]];
+
+	if ((a | b | c | d) > 63)
+	    break;
+	*dst++ = (a << 2) | (b >> 4);
+	*dst++ = (b << 4) | (c >> 2);
+	*dst++ = (c << 6) | d;
+	cp += 4;
+    }
+
+    return(cp - src);
+}
+
+size_t pbm_decode_run(const unsigned char *src, size_t len, png_byte *dst,
+		      size_t room, size_t *ndst)
+/*
+ * Decode P1 pixels, 0 or 1 with any spaces or tabs between, from src
+ * until len characters are used up, room bytes are filled or anything
+ * else turns up.  Returns the number of characters consumed; *ndst gets
+ * the number of bytes stored, one for each pixel.
+ */
+{
+    const unsigned char *cp = src, *end = src + len;
+    png_byte		*out = dst;
+
+    for (; cp < end; cp++)
+	if (*cp == '0' || *cp == '1')
+	{
+	    if (out == dst + room)
+		break;
+	    *out++ = *cp - '0';
+	}
+	else if (*cp != ' ' && *cp != '\t')
+	    break;
+
+    *ndst = out - dst;
+    return(cp - src);
+}
+
+static int ppm_delimiter(int c)
+/* may this follow a number for ppm_decode_run() to take it? */
+{
+    switch (c)
+    {
+    case ' ': case '\t': case '\n': case '\r': case '\v': case '\f':
+    case ';': case '}': case ',': case '#':
+	return(1);
+    default:
+	return(0);
+    }
+}
+
+size_t ppm_decode_run(const unsigned char *src, size_t len, png_byte *dst,
+		      size_t room, unsigned int maxval, size_t *ndst)
+/*
+ * Decode P3 samples, decimal numbers with spaces or tabs between, from
+ * src until len characters are used up, room bytes are filled or
+ * anything else turns up.  That includes newlines, so the caller can
+ * count lines, and any number the tokenizer might read differently or
+ * complain about: one with a leading zero, one over maxval, and one that
+ * might go on past len.  Returns the number of characters consumed; *ndst
+ * gets the number of bytes stored, one per sample, or two, most
+ * significant first, if maxval is over 255.
+ */
+{
+    const unsigned char *cp = src, *end = src + len;
+    png_byte		*out = dst;
+    size_t		width = maxval > 255 ? 2 : 1;
+
+    while (cp < end)
+    {
+	const unsigned char	*np = cp;
+	unsigned int		value = 0;
+
+	if (*cp == ' ' || *cp == '\t')
+	{
+	    cp++;
+	    continue;
+	}
+	if (*cp < '0' || *cp > '9'
+		|| (*cp == '0' && cp + 1 < end && cp[1] >= '0' && cp[1] <= '9'))
+	    break;
+	while (np < end && *np >= '0' && *np <= '9' && np - cp < 6)
+	    value = 10 * value + (*np++ - '0');
+	if (np == end || !ppm_delimiter(*np) || value > maxval
+		|| (size_t)(dst + room - out) < width)
+	    break;
+	if (width == 2)
+	    *out++ = value >> 8;
+	*out++ = value;
+	cp = np;
+    }
+
+    *ndst = out - dst;
+    return(cp - src);
+}
+
+/*************************************************************************
+ *
+ * Encoders
+ *
+ * These produce exactly the text sngd has always written for the hex
+ * and base64 formats; the caller supplies the framing and the buffer.
+ *
+ ************************************************************************/
+
+/* how safeprint() shows each byte inside a string */
+const char string_escape[256][5] =
+{
+    "\\^@", "\\^A", "\\^B", "\\^C", "\\^D", "\\^E", "\\^F", "\\^G",
+    "\\b", "\\^I", "\\n", "\\^K", "\\^L", "\\r", "\\^N", "\\^O",
+    "\\^P", "\\^Q", "\\^R", "\\^S", "\\^T", "\\^U", "\\^V", "\\^W",
+    "\\^X", "\\^Y", "\\^Z", "\\^[", "\\^\\", "\\^]", "\\^^", "\\^_",
+    " ", "!", "\\\"", "#", "$", "%", "&", "'",
+    "(", ")", "*", "+", ",", "-", ".", "/",
+    "0", "1", "2", "3", "4", "5", "6", "7",
+    "8", "9", ":", ";", "<", "=", ">", "?",
+    "@", "A", "B", "C", "D", "E", "F", "G",
+    "H", "I", "J", "K", "L", "M", "N", "O",
+    "P", "Q", "R", "S", "T", "U", "V", "W",
+    "X", "Y", "Z", "[", "\\\\", "]", "^", "_",
+    "`", "a", "b", "c", "d", "e", "f", "g",
+    "h", "i", "j", "k", "l", "m", "n", "o",
+    "p", "q", "r", "s", "t", "u", "v", "w",
+    "x", "y", "z", "{", "|", "}", "~", "\\x7f",
+    "\\x80", "\\x81", "\\x82", "\\x83", "\\x84", "\\x85", "\\x86", "\\x87",
+    "\\x88", "\\x89", "\\x8a", "\\x8b", "\\x8c", "\\x8d", "\\x8e", "\\x8f",
+    "\\x90", "\\x91", "\\x92", "\\x93", "\\x94", "\\x95", "\\x96", "\\x97",
+    "\\x98", "\\x99", "\\x9a", "\\x9b", "\\x9c", "\\x9d", "\\x9e", "\\x9f",
+    "\\xa0", "\\xa1", "\\xa2", "\\xa3", "\\xa4", "\\xa5", "\\xa6", "\\xa7",
+    "\\xa8", "\\xa9", "\\xaa", "\\xab", "\\xac", "\\xad", "\\xae", "\\xaf",
+    "\\xb0", "\\xb1", "\\xb2", "\\xb3", "\\xb4", "\\xb5", "\\xb6", "\\xb7",
+    "\\xb8", "\\xb9", "\\xba", "\\xbb", "\\xbc", "\\xbd", "\\xbe", "\\xbf",
+    "\\xc0", "\\xc1", "\\xc2", "\\xc3", "\\xc4", "\\xc5", "\\xc6", "\\xc7",
+    "\\xc8", "\\xc9", "\\xca", "\\xcb", "\\xcc", "\\xcd", "\\xce", "\\xcf",
+    "\\xd0", "\\xd1", "\\xd2", "\\xd3", "\\xd4", "\\xd5", "\\xd6", "\\xd7",
+    "\\xd8", "\\xd9", "\\xda", "\\xdb", "\\xdc", "\\xdd", "\\xde", "\\xdf",
+    "\\xe0", "\\xe1", "\\xe2", "\\xe3", "\\xe4", "\\xe5", "\\xe6", "\\xe7",
+    "\\xe8", "\\xe9", "\\xea", "\\xeb", "\\xec", "\\xed", "\\xee", "\\xef",
+    "\\xf0", "\\xf1", "\\xf2", "\\xf3", "\\xf4", "\\xf5", "\\xf6", "\\xf7",
+    "\\xf8", "\\xf9", "\\xfa", "\\xfb", "\\xfc", "\\xfd", "\\xfe", "\\xff",
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+#if defined(__SSE2__)
+static void hex_encode_sse2(const png_byte *src, unsigned char *dst)
+/* encode 16 bytes as 32 hex digits */
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+    __m128i lo = _mm_and_si128(v, mask);
+    __m128i nine = _mm_set1_epi8(9);
+    __m128i zero = _mm_set1_epi8('0');
+    __m128i gap = _mm_set1_epi8('a' - '0' - 10);
+
+    hi = _mm_add_epi8(_mm_add_epi8(hi, zero),
+		      _mm_and_si128(_mm_cmpgt_epi8(hi, nine), gap));
+    lo = _mm_add_epi8(_mm_add_epi8(lo, zero),
+		      _mm_and_si128(_mm_cmpgt_epi8(lo, nine), gap));
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi8(hi, lo));
+}
+
+static int base64_encode_sse2(const png_byte *src, unsigned char *dst)
+/* encode 16 bytes in SNG base64, or return FALSE if any exceeds 63 */
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+    __m128i offset = _mm_set1_epi8('0');
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v,
+	    _mm_set1_epi8((char)0xc0)), _mm_setzero_si128())) != 0xffff)
+	return(FALSE);
+
+    /* step from the digits to 'A', 'a', '+' and '/' */
+    offset = _mm_add_epi8(offset, _mm_and_si128(
+		 _mm_cmpgt_epi8(v, _mm_set1_epi8(9)), _mm_set1_epi8('A' - 10 - '0')));
+    offset = _mm_add_epi8(offset, _mm_and_si128(
+		 _mm_cmpgt_epi8(v, _mm_set1_epi8(35)), _mm_set1_epi8(('a' - 36) - ('A' - 10))));
+    offset = _mm_add_epi8(offset, _mm_and_si128(
+		 _mm_cmpgt_epi8(v, _mm_set1_epi8(61)), _mm_set1_epi8(('+' - 62) - ('a' - 36))));
+    offset = _mm_add_epi8(offset, _mm_and_si128(
+		 _mm_cmpgt_epi8(v, _mm_set1_epi8(62)), _mm_set1_epi8(('/' - 63) - ('+' - 62))));
+    _mm_storeu_si128((__m128i *)dst, _mm_add_epi8(v, offset));
+    return(TRUE);
+}
+#endif /* __SSE2__ */
+
+#ifdef SNG_NEON
+static void hex_encode_neon(const png_byte *src, unsigned char *dst)
+/* encode 16 bytes as 32 hex digits */
+{
+    uint8x16_t	v = vld1q_u8(src);
+    uint8x16_t	digits = vld1q_u8((const uint8_t *)hex_digits);
+    uint8x16x2_t	out;
+
+    out.val[0] = vqtbl1q_u8(digits, vshrq_n_u8(v, 4));
+    out.val[1] = vqtbl1q_u8(digits, vandq_u8(v, vdupq_n_u8(0x0f)));
+    vst2q_u8(dst, out);
+}
+
+static int base64_encode_neon(const png_byte *src, unsigned char *dst)
+/* encode 16 bytes in SNG base64, or return FALSE if any exceeds 63 */
+{
+    uint8x16_t	v = vld1q_u8(src);
+    uint8x16x4_t	alphabet;
+
+    if (vmaxvq_u8(v) > 63)
+	return(FALSE);
+    alphabet.val[0] = vld1q_u8((const uint8_t *)BASE64);
+    alphabet.val[1] = vld1q_u8((const uint8_t *)BASE64 + 16);
+    alphabet.val[2] = vld1q_u8((const uint8_t *)BASE64 + 32);
+    alphabet.val[3] = vld1q_u8((const uint8_t *)BASE64 + 48);
+    vst1q_u8(dst, vqtbl4q_u8(alphabet, v));
+    return(TRUE);
+}
+#endif /* SNG_NEON */
+
+size_t hex_encode(const png_byte *src, size_t len, int group, unsigned char *dst)
+/*
+ * Encode len bytes as hex digit pairs, with a space after each group
+ * bytes (counting from src) unless group is 0.  Returns the number of
+ * characters stored, at most 3 * len.
+ */
+{
+    unsigned char	*tp = dst;
+    size_t		i = 0;
+
+    if (group == 0)
+    {
+#if defined(SNG_NEON)
+	for (; i + 16 <= len; i += 16, tp += 32)
+	    hex_encode_neon(src + i, tp);
+#elif defined(__SSE2__)
+	for (; i + 16 <= len; i += 16, tp += 32)
+	    hex_encode_sse2(src + i, tp);
+#endif
+	for (; i < len; i++)
+	{
+	    *tp++ = hex_digits[src[i] >> 4];
+	    *tp++ = hex_digits[src[i] & 0x0f];
+	}
+    }
+    else
+    {
+	int	g;
+
+	while (i < len)
+	{
+	    for (g = 0; g < group && i < len; g++, i++)
+	    {
+		*tp++ = hex_digits[src[i] >> 4];
+		*tp++ = hex_digits[src[i] & 0x0f];
+	    }
+	    if (g == group)
+		*tp++ = ' ';
+	}
+    }
+
+    return(tp - dst);
+}
+
+size_t base64_encode(const png_byte *src, size_t len, unsigned char *dst)
+/*
+ * Encode bytes in SNG base64, stopping early at any byte too large to
+ * represent.  Returns the number of bytes encoded, and so stored.
+ */
+{
+    size_t	i = 0;
+
+#if defined(SNG_NEON)
+    for (; i + 16 <= len && base64_encode_neon(src + i, dst + i); i += 16)
+	continue;
+#elif defined(__SSE2__)
+    for (; i + 16 <= len && base64_encode_sse2(src + i, dst + i); i += 16)
+	continue;
+#endif
+    for (; i < len && src[i] < 64; i++)
+	dst[i] = BASE64[src[i]];
+
+    return(i);
+}
+
+size_t rfc4648_encode(const png_byte *src, size_t len, unsigned char *dst)
+/*
+ * Encode bytes in RFC 4648 base64, padding the last group with `=' if
+ * len isn't a multiple of three.  Returns the number of characters
+ * stored, which is four for every three bytes or part of three.
+ */
+{
+    static const char	alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned char	*tp = dst;
+    size_t		i;
+
+    for (i = 0; i + 3 <= len; i += 3)
+    {
+	unsigned long	group = (src[i] << 16) | (src[i+1] << 8) | src[i+2];
+
+	*tp++ = alphabet[group >> 18];
+	*tp++ = alphabet[(group >> 12) & 0x3f];
+	*tp++ = alphabet[(group >> 6) & 0x3f];
+	*tp++ = alphabet[group & 0x3f];
+    }
+    if (i < len)
+    {
+	unsigned long	group = src[i] << 16;
+
+	if (i + 1 < len)
+	    group |= src[i+1] << 8;
+	*tp++ = alphabet[group >> 18];
+	*tp++ = alphabet[(group >> 12) & 0x3f];
+	*tp++ = i + 1 < len ? alphabet[(group >> 6) & 0x3f] : '=';
+	*tp++ = '=';
+    }
+
+    return(tp - dst);
+}
+
+/*************************************************************************
+ *
+ * Packed pixels
+ *
+ * Rows of 1, 2 and 4-bit images are kept packed the way the PNG holds
+ * them, the leftmost pixel in the most significant bits of each byte.
+ * These go between that and one sample per byte, or straight to one SNG
+ * base64 digit per sample, which is what sngd writes for such images.
+ *
+ ************************************************************************/
+
+#if defined(__SSE2__)
+static __m128i digits_sse2(__m128i v)
+/* map sample values below 16 to their SNG base64 digits */
+{
+    return(_mm_add_epi8(_mm_add_epi8(v, _mm_set1_epi8('0')),
+			_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(9)),
+				      _mm_set1_epi8('A' - '0' - 10))));
+}
+
+static void expand_sse2(const png_byte *src, int depth, int digits,
+			png_byte *dst)
+/* expand 16 bytes of packed pixels, as samples or as digits */
+{
+    __m128i	v, out[8];
+    int		i, nout;
+
+    if (depth == 1)
+    {
+	const __m128i	bit = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, (char)128,
+					   1, 2, 4, 8, 16, 32, 64, (char)128);
+
+	/* each pair of bytes goes across the sixteen lanes */
+	for (i = 0; i < 8; i++)
+	{
+	    v = _mm_cvtsi32_si128(src[2*i] | (src[2*i+1] << 8));
+	    v = _mm_unpacklo_epi8(v, v);
+	    v = _mm_unpacklo_epi16(v, v);
+	    v = _mm_unpacklo_epi32(v, v);
+	    out[i] = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(v, bit), bit),
+				   _mm_set1_epi8(1));
+	}
+	nout = 8;
+    }
+    else if (depth == 2)
+    {
+	const __m128i	m = _mm_set1_epi8(3);
+	__m128i		c0, c1, c2, c3, a, b;
+
+	v = _mm_loadu_si128((const __m128i *)src);
+	c0 = _mm_and_si128(_mm_srli_epi16(v, 6), m);
+	c1 = _mm_and_si128(_mm_srli_epi16(v, 4), m);
+	c2 = _mm_and_si128(_mm_srli_epi16(v, 2), m);
+	c3 = _mm_and_si128(v, m);
+	a = _mm_unpacklo_epi8(c0, c1);
+	b = _mm_unpacklo_epi8(c2, c3);
+	out[0] = _mm_unpacklo_epi16(a, b);
+	out[1] = _mm_unpackhi_epi16(a, b);
+	a = _mm_unpackhi_epi8(c0, c1);
+	b = _mm_unpackhi_epi8(c2, c3);
+	out[2] = _mm_unpacklo_epi16(a, b);
+	out[3] = _mm_unpackhi_epi16(a, b);
+	nout = 4;
+    }
+    else
+    {
+	const __m128i	m = _mm_set1_epi8(0x0f);
+	__m128i		hi, lo;
+
+	v = _mm_loadu_si128((const __m128i *)src);
+	hi = _mm_and_si128(_mm_srli_epi16(v, 4), m);
+	lo = _mm_and_si128(v, m);
+	out[0] = _mm_unpacklo_epi8(hi, lo);
+	out[1] = _mm_unpackhi_epi8(hi, lo);
+	nout = 2;
+    }
+
+    for (i = 0; i < nout; i++)
+	_mm_storeu_si128((__m128i *)(dst + 16 * i),
+			 digits ? digits_sse2(out[i]) : out[i]);
+}
+
+static int pack_sse2(const png_byte *src, int depth, png_byte *dst)
+/* pack 16 bytes' worth of samples, or return FALSE if any won't fit */
+{
+    __m128i	v[8], acc = _mm_setzero_si128(), lo, hi;
+    int		i, bits, n = 8 / depth;
+
+    /* everything is loaded before anything is stored, for dst == src */
+    for (i = 0; i < n; i++)
+	acc = _mm_or_si128(acc, v[i] = _mm_loadu_si128((const __m128i *)src + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(acc,
+	    _mm_set1_epi8((char)(0xff << depth))), _mm_setzero_si128())) != 0xffff)
+	return(FALSE);
+
+    if (depth == 1)
+    {
+	/* reverse each run of eight lanes, so movemask puts the first high */
+	for (i = 0; i < 8; i++)
+	{
+	    __m128i	r = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v[i], 0x1b), 0x1b);
+
+	    r = _mm_or_si128(_mm_slli_epi16(r, 8), _mm_srli_epi16(r, 8));
+	    bits = _mm_movemask_epi8(_mm_slli_epi16(r, 7));
+	    dst[2*i] = bits;
+	    dst[2*i+1] = bits >> 8;
+	}
+	return(TRUE);
+    }
+
+    /* each step joins neighbouring bytes, doubling the bits in each */
+    for (; depth < 8; depth *= 2, n /= 2)
+	for (i = 0; i < n / 2; i++)
+	{
+	    lo = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v[2*i],
+			      _mm_set1_epi16(0xff)), depth),
+			      _mm_srli_epi16(v[2*i], 8));
+	    hi = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v[2*i+1],
+			      _mm_set1_epi16(0xff)), depth),
+			      _mm_srli_epi16(v[2*i+1], 8));
+	    v[i] = _mm_packus_epi16(lo, hi);
+	}
+    _mm_storeu_si128((__m128i *)dst, v[0]);
+    return(TRUE);
+}
+#endif /* __SSE2__ */
+
+static void expand_pixels(const png_byte *src, size_t n, int depth,
+			  int digits, png_byte *dst)
+/* expand n packed pixels to a byte each, as samples or as digits */
+{
+    static const char	nibble_digits[] = "0123456789ABCDEF";
+    size_t		i = 0, per_block = 128 / depth;
+    int			mask = (1 << depth) - 1;
+
+#if defined(__SSE2__)
+    for (; i + per_block <= n; i += per_block)
+	expand_sse2(src + i / (8 / depth), depth, digits, dst + i);
+#endif /* __SSE2__ */
+    for (; i < n; i++)
+    {
+	int	v = (src[i * depth / 8] >> (8 - depth - i * depth % 8)) & mask;
+
+	dst[i] = digits ? nibble_digits[v] : v;
+    }
+}
+
+void unpack_samples(const png_byte *src, size_t n, int depth, png_byte *dst)
+/* expand n pixels of a 1, 2 or 4-bit row to one sample per byte */
+{
+    expand_pixels(src, n, depth, FALSE, dst);
+}
+
+void base64_encode_packed(const png_byte *src, size_t n, int depth,
+			  unsigned char *dst)
+/*
+ * Encode n pixels of a 1, 2 or 4-bit row in SNG base64, one digit per
+ * pixel.  Every sample value that fits in four bits has a digit, so all
+ * n are stored; this is the text base64_encode() gives for the unpacked
+ * row.
+ */
+{
+    expand_pixels(src, n, depth, TRUE, dst);
+}
+
+int pack_samples(const png_byte *src, size_t n, int depth, png_byte *dst)
+/*
+ * Pack n samples, one per byte, into a row of a 1, 2 or 4-bit image,
+ * zeroing the bits left over in its last byte.  src and dst may be the
+ * same buffer.  Returns FALSE if any sample doesn't fit in depth bits.
+ */
+{
+    size_t	i = 0, j = 0, per_byte = 8 / depth;
+    int		acc = 0, all = 0;
+
+#if defined(__SSE2__)
+    for (; i + 128 / depth <= n; i += 128 / depth, j += 16)
+	if (!pack_sse2(src + i, depth, dst + j))
+	    return(FALSE);
+#endif /* __SSE2__ */
+    for (; i < n; i++)
+    {
+	acc = (acc << depth) | src[i];
+	all |= src[i];
+	if ((i + 1) % per_byte == 0)
+	{
+	    dst[j++] = acc;
+	    acc = 0;
+	}
+    }
+    if (n % per_byte)
+	dst[j] = acc << (depth * (per_byte - n % per_byte));
+
+    return(!(all >> depth));
+}
+
+/* sngcodec.c ends here */
@@ -8,9 +8,20 @@ NAME
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "config.h"	/* for RGBTXT */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
 #include "png.h"
+#include "zlib.h"
 #include "sng.h"
+#include "sngbench.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
 
 static char *image_type[] = {
     "grayscale",
@@ -29,205 +40,472 @@ static char *rendering_intent[] = {
   "absolute colorimetric"
 };
 
-static char *current_file;
+static SNG_TLS char *current_file;
 
 /* Error status for the file being processed; reset to 0 at the top of sngd() */
-static int sng_error;
+static SNG_TLS int sng_error;
+
+/* IDAT chunks set aside by -i, pointing into the input */
+static SNG_TLS raw_chunk *raw_idat;
+static SNG_TLS int raw_count;
 
 /*****************************************************************************
  *
- * Interface to RGB database
+ * Low-level helper code
  *
  *****************************************************************************/
 
-#define COLOR_HASH(r, g, b)	(((r<<16)|(g<<8)|(b))%COLOR_HASH_MODULUS)
+char *safeprint(const char *buf)
+/* visibilize a given string -- inverse of sngc.c:escapes() */
+{
+    static SNG_TLS char vbuf[PNG_STRING_MAX_LENGTH*4+1];
+    char *tp = vbuf;
+
+    while (*buf)
+    {
+	const char	*ep = string_escape[(unsigned char)*buf++];
 
-static color_item *rgb_hashbuckets[COLOR_HASH_MODULUS];
-static int rgb_initialized;
+	while (*ep)
+	    *tp++ = *ep++;
+    }
+    *tp++ = '\0';
+    return(vbuf);
+}
 
-static int hash_by_rgb(color_item *cp)
-/* hash by color's RGB value */
+/*
+ * Data is classified in one pass, sixteen bytes at a time where SSE2 is
+ * available, and the pass stops at the first byte that rules out both
+ * string and base64; that is within the first few bytes of most images.
+ * Bytes are printable in the sense of isprint() or isspace() in the C
+ * locale.
+ */
+static void classify_run(const unsigned char *p, size_t n,
+			 int *printable, int *base64)
+/* clear the flags for the formats a run of bytes rules out */
 {
-    return(COLOR_HASH(cp->r, cp->g, cp->b));
+    const unsigned char	*end = p + n;
+
+#ifdef __SSE2__
+    const __m128i	high = _mm_set1_epi8((char)0xc0), zero = _mm_setzero_si128();
+    const __m128i	sp = _mm_set1_epi8(0x1f), del = _mm_set1_epi8(0x7f);
+    const __m128i	tab = _mm_set1_epi8(0x08), cr = _mm_set1_epi8(0x0e);
+
+    for (; end - p >= 16 && (*printable || *base64); p += 16)
+    {
+	__m128i	v = _mm_loadu_si128((const __m128i *)p);
+
+	/* bytes from 0x80 up compare as negative, so fail both ranges */
+	__m128i	text = _mm_or_si128(
+	    _mm_and_si128(_mm_cmpgt_epi8(v, sp), _mm_cmplt_epi8(v, del)),
+	    _mm_and_si128(_mm_cmpgt_epi8(v, tab), _mm_cmplt_epi8(v, cr)));
+
+	if (_mm_movemask_epi8(text) != 0xffff)
+	    *printable = FALSE;
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, high), zero)) != 0xffff)
+	    *base64 = FALSE;
+    }
+#endif /* __SSE2__ */
+
+    for (; p < end && (*printable || *base64); p++)
+    {
+	if (!((*p >= 0x20 && *p < 0x7f) || (*p >= 0x09 && *p <= 0x0d)))
+	    *printable = FALSE;
+	if (*p >= 64)
+	    *base64 = FALSE;
+    }
 }
 
-static char *find_by_rgb(int r, int g, int b)
+static int classify_data(size_t width, png_uint_32 height, unsigned char *data[])
+/* choose the most readable format that can represent all the given rows */
 {
-    color_item sc, *hp;
+    png_uint_32 i;
+    int all_printable = 1, base64 = 1;
+
+    for (i = 0; i < height && (all_printable || base64); i++)
+	classify_run(data[i], width, &all_printable, &base64);
 
-   sc.r = r; sc.g = g; sc.b = b;
+    if (all_printable)
+	return(DATA_STRING);
+    else if (base64)
+	return(DATA_BASE64);
+    else
+	return(DATA_HEX);
+}
 
-    for (hp = rgb_hashbuckets[hash_by_rgb(&sc)]; hp; hp = hp->next)
-	if (hp->r == r && hp->g == g && hp->b == b)
-	    return(hp->name);
+#define SHORT_DATA	50
 
-    return((char *)NULL);
+/*
+ * Data segments are encoded into this buffer and written out in large
+ * blocks.  Rows longer than the buffer go out in pieces of ENCODE_CHUNK
+ * bytes, which is a multiple of every hex spacer interval (2, 3, 4, 6 and
+ * 8 bytes), and small enough that no encoding can overrun the buffer.
+ */
+#define OUTPUT_BLOCK	(256 * 1024)
+#define ENCODE_CHUNK	((OUTPUT_BLOCK / 5 / 24) * 24)
+
+static SNG_TLS unsigned char *output_buffer;
+
+/* rfc4648 groups run across rows; bytes left over from the last one */
+static SNG_TLS png_byte rfc4648_carry[3];
+static SNG_TLS int rfc4648_pending;
+
+/* bit depth of the packed image rows going out a digit per pixel, or 0 */
+static SNG_TLS int packed_depth;
+
+static int hex_group(void)
+/* the bytes between hex spacers in image rows, or 0 for none */
+{
+    png_byte	bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    png_byte	channels = png_get_channels(png_ptr, info_ptr);
+
+    /* only insert spacers for 8-bit images if > 1 channel */
+    if (bit_depth == 8 && channels > 1)
+	return(channels);
+    else if (bit_depth == 16)
+	return(channels * 2);
+    return(0);
 }
 
-/*****************************************************************************
- *
- * Low-level helper code
- *
- *****************************************************************************/
+/*
+ * rle image data is a list of pixels, each in hex or as one hex digit
+ * when packed, with a count and `*' before any pixel repeated in a run.
+ * Runs go out a row at a time here, though the compiler lets them run on.
+ */
+#define PACKED_PIXEL(row, i, bits) \
+    (((row)[(i) * (bits) / 8] >> (8 - (bits) - (i) * (bits) % 8)) \
+     & ((1 << (bits)) - 1))
+
+static size_t rle_run_length(const unsigned char *row, size_t i,
+			     size_t pixels, int bits)
+/* count the pixels from i on that are the same as pixel i */
+{
+    size_t	j, size = bits / 8;
 
-char *safeprint(const char *buf)
-/* visibilize a given string -- inverse of sngc.c:escapes() */
+    if (bits < 8)
+    {
+	int	v = PACKED_PIXEL(row, i, bits);
+
+	for (j = i + 1; j < pixels && PACKED_PIXEL(row, j, bits) == v; j++)
+	    continue;
+    }
+    else
+	for (j = i + 1; j < pixels
+		 && memcmp(row + j * size, row + i * size, size) == 0; j++)
+	    continue;
+    return(j - i);
+}
+
+static int rle_pixel_bits(void)
+/* the bits in a pixel of the image rows */
 {
-    static char vbuf[PNG_STRING_MAX_LENGTH*4+1];
-    char *tp = vbuf;
+    return(png_get_bit_depth(png_ptr, info_ptr)
+	   * png_get_channels(png_ptr, info_ptr));
+}
 
-    while (*buf)
+static uint64_t dump_length(const unsigned char *row, int fmt)
+/* the characters dump_row() writes for a row of the image in a format */
+{
+    png_uint_32	pixels = png_get_image_width(png_ptr, info_ptr);
+    png_size_t	rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    const unsigned char *cp, *end = row + rowbytes;
+    uint64_t	len = 0;
+    int		group;
+
+    /* a lone row ends with ";\n" rather than a newline, except in string */
+    if (png_get_image_height(png_ptr, info_ptr) == 1 && fmt != DATA_STRING)
+	len++;
+
+    if (fmt == DATA_RLE)
     {
-	if (*buf == '"')
+	int	bits = rle_pixel_bits();
+	size_t	i, n, d, digits = bits < 8 ? 1 : bits / 4;
+
+	for (i = 0; i < pixels; i += n)
 	{
-	    *tp++ = '\\'; *tp++ = '"';
-	    buf++;
+	    n = rle_run_length(row, i, pixels, bits);
+	    len += digits + 1;
+	    for (d = n; n > 1 && d > 0; d /= 10)
+		len++;
+	    if (n > 1)
+		len++;
 	}
-	else if (*buf == '\\')
+	return(len);
+    }
+    else if (fmt == DATA_STRING)
+    {
+	for (cp = row; cp < end; cp++)
 	{
-	    *tp++ = '\\'; *tp++ = '\\';
-	    buf++;
+	    len += strlen(string_escape[*cp]);
+	    if (*cp == '\n' && cp < end - 1)
+		len += 3;
 	}
-	else if (isprint(*buf) || *buf == ' ')
-	    *tp++ = *buf++;
-	else if (*buf == '\n')
+	return(len + 4);
+    }
+    else if (fmt == DATA_BASE64 && packed_depth)
+	return(len + pixels + 1);
+    else if (fmt == DATA_BASE64)
+	return(len + rowbytes + 1);
+    group = hex_group();
+    return(len + 2 * rowbytes + (group ? rowbytes / group : 0) + 1);
+}
+
+/*
+ * rle has to save this fraction of the other format, and at least
+ * SHORT_DATA characters, to be chosen for it; small images keep the
+ * format they have always had.
+ */
+#define RLE_SAVING	4
+
+static int rle_pays(unsigned char *rows[], png_uint_32 nrows, int fmt)
+/* is rle clearly shorter for these image rows than the given format? */
+{
+    uint64_t	plain, len;
+    png_uint_32	i;
+
+    /* the format's name after the leader, then a space or newline */
+    plain = fmt == DATA_STRING ? 2 : fmt == DATA_HEX ? 4 : 7;
+    len = 4;
+
+    for (i = 0; i < nrows; i++)
+	plain += dump_length(rows[i], fmt);
+    if (plain <= SHORT_DATA)
+	return(FALSE);
+    plain -= plain / RLE_SAVING > SHORT_DATA ? plain / RLE_SAVING : SHORT_DATA;
+    for (i = 0; i < nrows && len < plain; i++)
+	len += dump_length(rows[i], DATA_RLE);
+    return(len < plain);
+}
+
+static void dump_row(FILE *fpout, int fmt, char *leader, size_t width,
+		     png_uint_32 height, png_uint_32 i, unsigned char *row)
+/* dump row i of a height-row data segment in a given format */
+{
+    unsigned char *cp, *tp, *end = row + width;
+    size_t	n, len;
+
+    if (fmt == DATA_STRING)
+    {
+	if (i == 0)
 	{
-	    *tp++ = '\\'; *tp++ = 'n';
-	    buf++;
+	    fprintf(fpout, "%s ", leader);
+	    if (height == 1 && width < SHORT_DATA)
+		fprintf(fpout, " ");
+	    else
+		fprintf(fpout, "\n");
 	}
-	else if (*buf == '\r')
+
+	fputc('"', fpout);
+	tp = output_buffer;
+	for (cp = row; cp < end; cp++)
 	{
-	    *tp++ = '\\'; *tp++ = 'r';
-	    buf++;
+	    const char	*ep = string_escape[*cp];
+
+	    if (ep[1] == '\0')
+		*tp++ = *cp;
+	    else
+		while (*ep)
+		    *tp++ = *ep++;
+
+	    if (*cp == '\n' && cp < end - 1)
+	    {
+		*tp++ = '"'; *tp++ = '\n'; *tp++ = '"';
+	    }
+
+	    /* each byte can take up to 7 characters */
+	    if (tp > output_buffer + OUTPUT_BLOCK - 8)
+	    {
+		fwrite(output_buffer, 1, tp - output_buffer, fpout);
+		tp = output_buffer;
+	    }
 	}
-	else if (*buf == '\b')
+	fwrite(output_buffer, 1, tp - output_buffer, fpout);
+	fprintf(fpout, "\"%c\n", height == 1 ? ';' : ' ');
+    }
+    else if (fmt == DATA_BASE64 && packed_depth)
+    {
+	png_uint_32	pixels = png_get_image_width(png_ptr, info_ptr);
+
+	if (i == 0)
 	{
-	    *tp++ = '\\'; *tp++ = 'b';
-	    buf++;
+	    fprintf(fpout, "%sbase64", leader);
+	    if (height == 1 && pixels < SHORT_DATA)
+		fprintf(fpout, " ");
+	    else
+		fprintf(fpout, "\n");
 	}
-	else if ((unsigned char) *buf < ' ')
+	for (n = 0; n < pixels; n += len)
 	{
-	    *tp++ = '\\'; *tp++ = '^'; *tp++ = '@' + *buf;
-	    buf++;
+	    len = pixels - n < ENCODE_CHUNK ? pixels - n : ENCODE_CHUNK;
+	    base64_encode_packed(row + n * packed_depth / 8, len, packed_depth,
+				 output_buffer);
+	    fwrite(output_buffer, 1, len, fpout);
 	}
+	if (height == 1)
+	    fprintf(fpout, ";\n");
 	else
+	    fprintf(fpout, "\n");
+    }
+    else if (fmt == DATA_BASE64)
+    {
+	if (i == 0)
+	{
+	    fprintf(fpout, "%sbase64", leader);
+	    if (height == 1 && width < SHORT_DATA)
+		fprintf(fpout, " ");
+	    else
+		fprintf(fpout, "\n");
+	}
+	for (cp = row; cp < end; cp += n)
 	{
-	    (void) sprintf(tp, "\\x%02x", (unsigned char) *buf++);
-	    tp += strlen(tp);
+	    len = end - cp < ENCODE_CHUNK ? end - cp : ENCODE_CHUNK;
+	    n = base64_encode(cp, len, output_buffer);
+	    fwrite(output_buffer, 1, n, fpout);
+	    if (n < len)
+	       fatal("invalid base64 data (%d)", cp[n]);
 	}
+	if (height == 1)
+	    fprintf(fpout, ";\n");
+	else
+	    fprintf(fpout, "\n");
     }
-    *tp++ = '\0';
-    return(vbuf);
-}
-
-static void multi_dump(FILE *fpout, char *leader,
-		       int width, int height,
-		       unsigned char *data[])
-/* dump data in a recompilable form */
-{
-    unsigned char *cp;
-    int i, all_printable = 1, base64 = 1;
-    png_byte	bit_depth = png_get_bit_depth(png_ptr, info_ptr);
-    png_byte	channels = png_get_channels(png_ptr, info_ptr);
-
-#define SHORT_DATA	50
+    else if (fmt == DATA_RFC4648)
+    {
+	if (i == 0)
+	{
+	    fprintf(fpout, "%srfc4648", leader);
+	    if (height == 1 && width < SHORT_DATA)
+		fprintf(fpout, " ");
+	    else
+		fprintf(fpout, "\n");
+	    rfc4648_pending = 0;
+	}
 
-    for (i = 0; i < height; i++)
-	for (cp = data[i]; cp < data[i] + width; cp++)
+	cp = row;
+	while (rfc4648_pending && rfc4648_pending < 3 && cp < end)
+	    rfc4648_carry[rfc4648_pending++] = *cp++;
+	if (rfc4648_pending == 3)
+	{
+	    n = rfc4648_encode(rfc4648_carry, 3, output_buffer);
+	    fwrite(output_buffer, 1, n, fpout);
+	    rfc4648_pending = 0;
+	}
+	for (; end - cp >= 3; cp += len)
+	{
+	    len = end - cp < ENCODE_CHUNK ? end - cp : ENCODE_CHUNK;
+	    len -= len % 3;
+	    n = rfc4648_encode(cp, len, output_buffer);
+	    fwrite(output_buffer, 1, n, fpout);
+	}
+	while (cp < end)
+	    rfc4648_carry[rfc4648_pending++] = *cp++;
+	if (i == height - 1 && rfc4648_pending)
 	{
-	    if (!isprint(*cp) && !isspace(*cp))
-		all_printable = 0;
-	    if (*cp >= 64)
-		base64 = 0;
+	    n = rfc4648_encode(rfc4648_carry, rfc4648_pending, output_buffer);
+	    fwrite(output_buffer, 1, n, fpout);
 	}
 
-    for (i = 0; i < height; i++)
+	if (height == 1)
+	    fprintf(fpout, ";\n");
+	else
+	    fprintf(fpout, "\n");
+    }
+    else if (fmt == DATA_RLE)
     {
-	if (all_printable)
+	png_uint_32	pixels = png_get_image_width(png_ptr, info_ptr);
+	int		bits = rle_pixel_bits();
+
+	if (i == 0)
 	{
-	    unsigned char *cp;
+	    fprintf(fpout, "%srle", leader);
+	    if (height == 1 && pixels < SHORT_DATA)
+		fprintf(fpout, " ");
+	    else
+		fprintf(fpout, "\n");
+	}
 
-	    if (i == 0)
-	    {
-		fprintf(fpout, "%s ", leader);
-		if (height == 1 && width < SHORT_DATA)
-		    fprintf(fpout, " ");
-		else
-		    fprintf(fpout, "\n");
-	    }
+	tp = output_buffer;
+	for (n = 0; n < pixels; n += len)
+	{
+	    len = rle_run_length(row, n, pixels, bits);
+	    if (n > 0)
+		*tp++ = ' ';
+	    if (len > 1)
+		tp += sprintf((char *)tp, "%lu*", (unsigned long)len);
+	    if (bits < 8)
+		*tp++ = "0123456789abcdef"[PACKED_PIXEL(row, n, bits)];
+	    else
+		tp += hex_encode(row + n * bits / 8, bits / 8, 0, tp);
 
-	    fputc('"', fpout);
-	    for (cp = data[i]; cp < data[i] + width; cp++)
+	    /* a run can take up to 40 characters */
+	    if (tp > output_buffer + OUTPUT_BLOCK - 64)
 	    {
-		char	cbuf[2];
-
-		cbuf[0] = *cp;
-		cbuf[1] = '\0';
-		fputs(safeprint(cbuf), fpout); 
-
-		if (*cp == '\n' && cp < data[i] + width - 1)
-		    fprintf(fpout, "\"\n\"");
+		fwrite(output_buffer, 1, tp - output_buffer, fpout);
+		tp = output_buffer;
 	    }
-	    fprintf(fpout, "\"%c\n", height == 1 ? ';' : ' ');
 	}
-	else if (base64)
+	fwrite(output_buffer, 1, tp - output_buffer, fpout);
+	if (height == 1)
+	    fprintf(fpout, ";\n");
+	else
+	    fprintf(fpout, "\n");
+    }
+    else
+    {
+	int	group = hex_group();
+
+	if (i == 0)
 	{
-	    if (i == 0)
-	    {
-		fprintf(fpout, "%sbase64", leader);
-		if (height == 1 && width < SHORT_DATA)
-		    fprintf(fpout, " ");
-		else
-		    fprintf(fpout, "\n");
-	    }
-	    for (cp = data[i]; cp < data[i] + width; cp++) {
-	        if (*cp >= 64)
-		   fatal("invalid base64 data (%d)", *cp);
-		fputc(BASE64[*cp], fpout);
-	    }
-	    if (height == 1)
-		fprintf(fpout, ";\n");
+	    fprintf(fpout, "%shex", leader);
+	    if (height == 1 && width < SHORT_DATA)
+		fprintf(fpout, " ");
 	    else
 		fprintf(fpout, "\n");
 	}
-	else
+
+	for (cp = row; cp < end; cp += len)
 	{
-	    if (i == 0)
-	    {
-		fprintf(fpout, "%shex", leader);
-		if (height == 1 && width < SHORT_DATA)
-		    fprintf(fpout, " ");
-		else
-		    fprintf(fpout, "\n");
-	    }
-	    for (cp = data[i]; cp < data[i] + width; cp++)
-	    {
-		fprintf(fpout, "%02x", *cp & 0xff);
-
-		/* only insert spacers for 8-bit images if > 1 channel */
-		if (bit_depth == 8 && channels > 1)
-		{
-		    if (((cp - data[i]) % channels) == channels - 1)
-			fputc(' ', fpout);
-		}
-		else if (bit_depth == 16)
-		    if (((cp - data[i]) % (channels*2)) == channels*2-1)
-			fputc(' ', fpout);
-	    }
-	    if (height == 1)
-		fprintf(fpout, ";\n");
-	    else
-		fprintf(fpout, "\n");
+	    len = end - cp < ENCODE_CHUNK ? end - cp : ENCODE_CHUNK;
+	    n = hex_encode(cp, len, group, output_buffer);
+	    fwrite(output_buffer, 1, n, fpout);
 	}
+	if (height == 1)
+	    fprintf(fpout, ";\n");
+	else
+	    fprintf(fpout, "\n");
     }
 }
 
+static void multi_dump(FILE *fpout, char *leader, int fmt,
+		       size_t width, png_uint_32 height,
+		       unsigned char *data[])
+/* dump data in a recompilable form, choosing the format if it's DATA_AUTO */
+{
+    png_uint_32 i;
+    int printable = FALSE, base64 = TRUE;
+
+    if (fmt == DATA_AUTO)
+	fmt = classify_data(width, height, data);
+    else if (fmt == DATA_STRING || fmt == DATA_BASE64)
+    {
+	/* a format that can't hold the data gives way to hex */
+	printable = (fmt == DATA_STRING);
+	base64 = (fmt == DATA_BASE64);
+	for (i = 0; i < height && (printable || base64); i++)
+	    classify_run(data[i], width, &printable, &base64);
+	if (!printable && !base64)
+	    fmt = DATA_HEX;
+    }
+
+    for (i = 0; i < height; i++)
+	dump_row(fpout, fmt, leader, width, height, i, data[i]);
+}
+
 static void dump_data(FILE *fpout, char *leader, int size, unsigned char *data)
 {
     unsigned char *dope[1];
 
     dope[0] = data;
-    multi_dump(fpout, leader, size, 1, dope);
+    multi_dump(fpout, leader, DATA_AUTO, size, 1, dope);
 }
 
 static void printerr(int err, const char *fmt, ... )
@@ -243,7 +521,7 @@ static void printerr(int err, const char *fmt, ... )
     va_end(ap);
 
     strcat(buf, "\n");
-    fputs(buf, stderr);
+    fputs(buf, SNG_STDERR);
 
     sng_error = err;
 }
@@ -321,14 +599,12 @@ static void dump_PLTE(FILE *fpout)
 
     png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette);
 
-    initialize_hash(hash_by_rgb, rgb_hashbuckets, &rgb_initialized);
-
     if (color_type & PNG_COLOR_MASK_PALETTE)
     {
 	fprintf(fpout, "PLTE {\n");
 	for (i = 0;  i < num_palette;  i++)
 	{
-	    char	*name = NULL;
+	    const char	*name;
 
 	    fprintf(fpout, 
 		    "    (%3u,%3u,%3u)     # rgb = (0x%02x,0x%02x,0x%02x)",
@@ -339,10 +615,9 @@ static void dump_PLTE(FILE *fpout)
 		    palette[i].green,
 		    palette[i].blue);
 
-	    if (rgb_initialized)
-		name = find_by_rgb(palette[i].red,
-				   palette[i].green,
-				   palette[i].blue);
+	    name = find_by_rgb(palette[i].red,
+			       palette[i].green,
+			       palette[i].blue);
 	    if (name)
 		fprintf(fpout, " %s", name);
 	    fputc('\n', fpout);
@@ -352,24 +627,163 @@ static void dump_PLTE(FILE *fpout)
     }
 }
 
+static FILE *open_sidecar(FILE *fpout)
+/* start a file beside the input for the image data, or return NULL */
+{
+    png_byte	color_type = png_get_color_type(png_ptr, info_ptr);
+    png_byte	bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    size_t	stem = strlen(current_file);
+    const char	*suffix = ".raw", *base;
+    char	path[BUFSIZ];
+    FILE	*fp;
+
+    /* plain gray and RGB samples are what PGM and PPM hold */
+    if (color_type == PNG_COLOR_TYPE_GRAY)
+	suffix = ".pgm";
+    else if (color_type == PNG_COLOR_TYPE_RGB)
+	suffix = ".ppm";
+
+    if (stem > 4 && strcmp(current_file + stem - 4, ".png") == 0)
+	stem -= 4;
+    if (stem + strlen(suffix) >= sizeof(path))
+    {
+	printerr(1, "name too long for an image data file");
+	return(NULL);
+    }
+    sprintf(path, "%.*s%s", (int)stem, current_file, suffix);
+
+    if ((fp = fopen(path, "wb")) == NULL)
+    {
+	printerr(1, "couldn't write %s (%s), dumping image data inline",
+		 path, strerror(errno));
+	return(NULL);
+    }
+    sidecar_files++;
+    if (strcmp(suffix, ".raw") != 0)
+	fprintf(fp, "P%c\n%lu %lu\n%d\n",
+		color_type == PNG_COLOR_TYPE_GRAY ? '5' : '6',
+		(unsigned long)png_get_image_width(png_ptr, info_ptr),
+		(unsigned long)png_get_image_height(png_ptr, info_ptr),
+		(1 << bit_depth) - 1);
+
+    /* the compiler looks for it beside the SNG, which goes beside the input */
+    base = strrchr(path, '/');
+    fprintf(fpout, "    pixels file \"%s\"\n", safeprint(base ? base + 1 : path));
+    return(fp);
+}
+
+static FILE *open_netpbm(FILE *fpout)
+/* start binary PGM or PPM image data inline, or return NULL if it won't do */
+{
+    png_byte	color_type = png_get_color_type(png_ptr, info_ptr);
+    png_byte	bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    png_uint_32	width = png_get_image_width(png_ptr, info_ptr);
+    int		channels = color_type == PNG_COLOR_TYPE_RGB ? 3 : 1;
+
+    /* only plain gray and RGB samples; everything else gets hex */
+    if (color_type != PNG_COLOR_TYPE_GRAY && color_type != PNG_COLOR_TYPE_RGB)
+	return(NULL);
+
+    fprintf(fpout, "    pixels P%c %lu %lu %d\n",
+	    channels == 3 ? '6' : '5', (unsigned long)width,
+	    (unsigned long)png_get_image_height(png_ptr, info_ptr),
+	    (1 << bit_depth) - 1);
+    return(fpout);
+}
+
+static void write_raster(FILE *fp, png_bytep row)
+/* write an image row to a data file, spreading packed gray out to samples */
+{
+    png_byte	bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    png_uint_32	n, len, width = png_get_image_width(png_ptr, info_ptr);
+
+    /* a PGM wants a byte per sample; packed palette rows go out as they are */
+    if (bit_depth < 8 && png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_GRAY)
+	for (n = 0; n < width; n += len)
+	{
+	    len = width - n < OUTPUT_BLOCK ? width - n : OUTPUT_BLOCK;
+	    unpack_samples(row + n * bit_depth / 8, len, bit_depth,
+			   output_buffer);
+	    fwrite(output_buffer, 1, len, fp);
+	}
+    else
+	fwrite(row, 1, png_get_rowbytes(png_ptr, info_ptr), fp);
+}
+
+static int packed_digits(void)
+/* the bit depth if the image rows are packed and will be digits, else 0 */
+{
+    png_byte	bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+
+    /* samples that fit in four bits always have a base64 digit */
+    if (bit_depth < 8 && (data_format == DATA_AUTO || data_format == DATA_BASE64))
+	return(bit_depth);
+    return(0);
+}
+
+static void close_sidecar(FILE *fp)
+/* finish an image data file, reporting any write error */
+{
+    if (ferror(fp) | fclose(fp))
+	printerr(1, "error writing image data file (%s)", strerror(errno));
+}
+
 static void dump_image(png_bytepp rows, FILE *fpout)
 {
     if (idat)
     {
 	int	i;
 
-	for (i = 0; i < idat; i++)
+	for (i = 0; i < raw_count; i++)
 	{
 	    fprintf(fpout, "IDAT {\n");
+	    dump_data(fpout, "    ", raw_idat[i].size,
+		      (unsigned char *)raw_idat[i].data);
 	    fprintf(fpout, "}\n");
 	}
     }
     else
     {
+	png_size_t	rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+	png_uint_32	i, height = png_get_image_height(png_ptr, info_ptr);
+	FILE		*sidecar = NULL;
+
 	fprintf(fpout, "IMAGE {\n");
-	multi_dump(fpout, "    pixels ", 
-		   png_get_rowbytes(png_ptr, info_ptr),  png_get_image_height(png_ptr, info_ptr),
-		   rows);
+	if ((data_format == DATA_FILE && (sidecar = open_sidecar(fpout)))
+	    || (data_format == DATA_NETPBM && (sidecar = open_netpbm(fpout))))
+	{
+	    for (i = 0; i < height; i++)
+		TIMED(PHASE_IO, write_raster(sidecar, rows[i]));
+	    if (sidecar == fpout)
+		fputc('\n', fpout);
+	    else
+		close_sidecar(sidecar);
+	}
+	else
+	{
+	    int	fmt = data_format;
+
+	    /* what multi_dump() would choose, unless rle clearly beats it */
+	    if ((packed_depth = packed_digits()) != 0)
+		fmt = DATA_BASE64;
+	    else if (fmt == DATA_AUTO)
+		fmt = classify_data(rowbytes, height, rows);
+	    if (data_format == DATA_AUTO && rle_pays(rows, height, fmt))
+	    {
+		fmt = DATA_RLE;
+		packed_depth = 0;
+	    }
+
+	    if (fmt == DATA_RLE || packed_depth)
+		for (i = 0; i < height; i++)
+		    dump_row(fpout, fmt, "    pixels ",
+			     rowbytes, height, i, rows[i]);
+	    else
+		multi_dump(fpout, "    pixels ",
+			   data_format >= DATA_FILE ? DATA_HEX : data_format,
+			   rowbytes, height, rows);
+	    packed_depth = 0;
+	}
 	fprintf(fpout, "}\n");
     }
 }
@@ -709,15 +1123,13 @@ static void dump_sPLT(FILE *fpout)
     {
 	png_sPLT_tp ep = entries + j;
 
-	initialize_hash(hash_by_rgb, rgb_hashbuckets, &rgb_initialized);
-
 	fprintf(fpout, "sPLT {\n");
 	fprintf(fpout, "    name: \"%s\";\n", safeprint(ep->name));
 	fprintf(fpout, "    depth: %u;\n", ep->depth);
 
 	for (i = 0;  i < ep->nentries;  i++)
 	{
-	    char *name = 0;
+	    const char *name;
 
 	    fprintf(fpout, "    (%3u,%3u,%3u), %3u, %3u "
 		    "    # rgba = [0x%02x,0x%02x,0x%02x,0x%02x]",
@@ -731,10 +1143,9 @@ static void dump_sPLT(FILE *fpout)
 		    ep->entries[i].blue,
 		    ep->entries[i].alpha);
 
-	    if (rgb_initialized)
-		name = find_by_rgb(ep->entries[i].red,
-				   ep->entries[i].green,
-				   ep->entries[i].blue);
+	    name = find_by_rgb(ep->entries[i].red,
+			       ep->entries[i].green,
+			       ep->entries[i].blue);
 	    if (name)
 		fprintf(fpout, ", name = %s", name);
 
@@ -828,7 +1239,8 @@ static void dump_tIME(FILE *fpout)
     }
 }
 
-static void dump_text(FILE *fpout)
+static int dump_text(FILE *fpout, int first)
+/* dump text chunks from index first on; return the number of text chunks */
 {
     png_textp text_ptr;
     int num_text;
@@ -836,7 +1248,7 @@ static void dump_text(FILE *fpout)
     if (png_get_text(png_ptr, info_ptr, &text_ptr, &num_text)) {
 	int	i;
 
-	for (i = 0; i < num_text; i++)
+	for (i = first; i < num_text; i++)
 	{
 	    switch (text_ptr[i].compression)
 	    {
@@ -873,6 +1285,7 @@ static void dump_text(FILE *fpout)
 	    fprintf(fpout, "}\n");
 	}
     }
+    return(num_text);
 }
 
 static void dump_unknown_chunks(int after_idat, FILE *fpout)
@@ -891,6 +1304,10 @@ static void dump_unknown_chunks(int after_idat, FILE *fpout)
 	if (after_idat != !!(up->location & PNG_AFTER_IDAT))
 	    continue;
 
+	/* the stand-in for raw image data; see split_idat() */
+	if (!memcmp(up->name, "IDAT", 5))
+	    continue;
+
 /* macros to extract big-endian short and long ints */
 #define SH(p) ((unsigned short)((p)[1]) | (((p)[0]) << 8))
 #define LG(p) ((unsigned long)(SH((p)+2)) | ((ulg)(SH(p)) << 16))
@@ -919,16 +1336,234 @@ static void dump_unknown_chunks(int after_idat, FILE *fpout)
     }
 }
 
+/*****************************************************************************
+ *
+ * Raw IDAT passthrough
+ *
+ * With -i the image data is dumped as the IDAT chunks it came in, without
+ * being inflated.  The chunks are picked out of the PNG before libpng
+ * sees it; libpng gets the rest, with one empty IDAT left to show where
+ * the image data was.
+ *
+ *****************************************************************************/
+
+/* unsigned big-endian long at p */
+#define GET_UINT32(p)	(((png_uint_32)(p)[0] << 24) | ((p)[1] << 16) \
+			 | ((p)[2] << 8) | (p)[3])
+
+/* length, type and CRC of a chunk of size n */
+#define CHUNK_SIZE(n)	((size_t)(n) + 12)
+
+static int whole_chunk(png_const_bytep p, png_const_bytep end)
+/* does a complete chunk start at p? */
+{
+    return(end - p >= 12 && CHUNK_SIZE(GET_UINT32(p)) <= (size_t)(end - p));
+}
+
+static void split_idat(sng_input *in, sng_input *rest)
+/* set aside the IDAT chunks of a PNG, and make rest the remainder */
+{
+    static const png_byte placeholder[12] =
+	{0, 0, 0, 0, 'I', 'D', 'A', 'T', 0x35, 0xaf, 0x06, 0x1e};
+    size_t		len, keep;
+    png_const_bytep	png = input_slurp(in, &len), end = png + len, p;
+    png_bytep		out, op;
+    int			n = 0;
+
+    /* anything that isn't a PNG is libpng's to complain about */
+    if (len < 8 || png_sig_cmp((png_bytep)png, 0, 8))
+    {
+	input_open_mem(rest, png, len);
+	return;
+    }
+
+    keep = len + sizeof(placeholder);
+    for (p = png + 8; whole_chunk(p, end); p += CHUNK_SIZE(GET_UINT32(p)))
+	if (!memcmp(p + 4, "IDAT", 4))
+	{
+	    keep -= CHUNK_SIZE(GET_UINT32(p));
+	    n++;
+	}
+
+    raw_idat = pool_alloc(conversion_pool, (n ? n : 1) * sizeof(raw_chunk));
+    raw_count = 0;
+    op = out = pool_alloc(conversion_pool, keep);
+    memcpy(op, png, 8);
+    op += 8;
+    for (p = png + 8; whole_chunk(p, end); p += CHUNK_SIZE(GET_UINT32(p)))
+    {
+	png_uint_32	size = GET_UINT32(p);
+
+	if (memcmp(p + 4, "IDAT", 4))
+	{
+	    memcpy(op, p, CHUNK_SIZE(size));
+	    op += CHUNK_SIZE(size);
+	    continue;
+	}
+
+	/* libpng won't be checking these; nobody looks at them if no_pixels */
+	if (!no_pixels && crc32(crc32(0L, Z_NULL, 0), p + 4, size + 4) != GET_UINT32(p + 8 + size))
+	    png_error(png_ptr, "IDAT: CRC error");
+	if (raw_count == 0)
+	{
+	    memcpy(op, placeholder, sizeof(placeholder));
+	    op += sizeof(placeholder);
+	}
+	raw_idat[raw_count].data = p + 8;
+	raw_idat[raw_count].size = size;
+	raw_count++;
+    }
+
+    /* a truncated chunk, or whatever else trails the last whole one */
+    memcpy(op, p, end - p);
+    op += end - p;
+
+    input_open_mem(rest, out, op - out);
+}
+
+static void mark_after_idat(void)
+/* tell libpng which unknown chunks followed the image data */
+{
+    png_unknown_chunkp entries;
+    int num_unknown_chunks, i, after = FALSE;
+
+    num_unknown_chunks = png_get_unknown_chunks(png_ptr, info_ptr, &entries);
+    for (i = 0; i < num_unknown_chunks; i++)
+	if (!memcmp(entries[i].name, "IDAT", 5))
+	    after = TRUE;
+	else if (after)
+	    png_set_unknown_chunk_location(png_ptr, info_ptr, i, PNG_AFTER_IDAT);
+}
+
+/*****************************************************************************
+ *
+ * Excerpts
+ *
+ * With --rows or --crop only a window of the image is dumped.  Once the
+ * reader is set up the window is clipped to the image, and IHDR in the
+ * info structure is made over to the window's size, so that everything
+ * that dumps the image sees just the window.  Rows are still decoded
+ * whole, into a buffer of their own, and cut down to the window as they
+ * are read; the rows under the window of a non-interlaced image aren't
+ * decoded at all.
+ *
+ *****************************************************************************/
+
+static SNG_TLS int cropping;		/* is a window being taken? */
+static SNG_TLS png_uint_32 crop_x, crop_y;
+static SNG_TLS png_uint_32 full_width, full_height;
+static SNG_TLS png_size_t full_rowbytes;
+static SNG_TLS png_bytep crop_buffer;	/* a whole row, before cutting */
+
+static void excerpt_begin(void)
+/* clip the excerpt to the image, and shrink IHDR down to it */
+{
+    png_uint_32	width, height;
+    int		bit_depth, color_type, interlace_type, compression, filter;
+
+    cropping = FALSE;
+    if (excerpt.width == 0)
+	return;
+
+    png_get_IHDR(png_ptr, info_ptr, &full_width, &full_height, &bit_depth,
+		 &color_type, &interlace_type, &compression, &filter);
+    if (excerpt.x >= full_width || excerpt.y >= full_height)
+	fatal("excerpt at %lu,%lu is outside the %lux%lu image",
+	      (unsigned long)excerpt.x, (unsigned long)excerpt.y,
+	      (unsigned long)full_width, (unsigned long)full_height);
+    width = full_width - excerpt.x;
+    if (excerpt.width < width)
+	width = excerpt.width;
+    height = full_height - excerpt.y;
+    if (excerpt.height < height)
+	height = excerpt.height;
+
+    crop_x = excerpt.x;
+    crop_y = excerpt.y;
+    full_rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    crop_buffer = pool_alloc(conversion_pool, full_rowbytes);
+    png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth, color_type,
+		 interlace_type, compression, filter);
+    cropping = TRUE;
+}
+
+static void crop_row(png_const_bytep row, png_bytep out)
+/* cut the window's part out of a whole row */
+{
+    int		bits = png_get_bit_depth(png_ptr, info_ptr)
+		       * png_get_channels(png_ptr, info_ptr);
+    png_uint_32	i, width = png_get_image_width(png_ptr, info_ptr);
+
+    if (bits >= 8)
+    {
+	memcpy(out, row + (size_t)crop_x * (bits / 8),
+	       (size_t)width * (bits / 8));
+	return;
+    }
+
+    /* packed pixels move bit by bit, leaving the padding clear */
+    memset(out, '\0', png_get_rowbytes(png_ptr, info_ptr));
+    for (i = 0; i < width; i++)
+    {
+	size_t	from = (size_t)(crop_x + i) * bits, to = (size_t)i * bits;
+	int	pixel = (row[from / 8] >> (8 - bits - from % 8)) & ((1 << bits) - 1);
+
+	out[to / 8] |= pixel << (8 - bits - to % 8);
+    }
+}
+
+static void read_row(png_bytep row)
+/* decode the next row of the image, or of the window */
+{
+    if (!cropping)
+	TIMED(PHASE_PNG, png_read_row(png_ptr, row, NULL));
+    else
+    {
+	TIMED(PHASE_PNG, png_read_row(png_ptr, crop_buffer, NULL));
+	crop_row(crop_buffer, row);
+    }
+}
+
+static void excerpt_warning(png_structp png_ptr, png_const_charp msg)
+/* pass on libpng's warnings but the one about rows left undecoded */
+{
+    if (strstr(msg, "Too much image data") == NULL)
+	sng_png_warning(png_ptr, msg);
+}
+
+static void excerpt_end(void)
+/* get ready to skip the rows under the window and read on */
+{
+    if (cropping)
+	png_set_error_fn(png_ptr, png_get_error_ptr(png_ptr),
+			 sng_png_error, excerpt_warning);
+}
+
+static void skip_rows(void)
+/* decode and drop the rows above the window */
+{
+    png_uint_32	i;
+
+    for (i = 0; cropping && i < crop_y; i++)
+	TIMED(PHASE_PNG, png_read_row(png_ptr, crop_buffer, NULL));
+}
+
 /*****************************************************************************
  *
  * Compiler main sequence
  *
  *****************************************************************************/
 
-void sngdump(png_byte *row_pointers[], FILE *fpout)
-/* dump a canonicalized SNG form of a PNG file */
+static void sngdump_head(FILE *fpout)
+/* dump the chunks that have to precede the image data */
 {
     fprintf(fpout, "#SNG: from %s\n", current_file);
+    if (cropping)
+	fprintf(fpout, "# excerpt: %lux%lu at %lu,%lu of a %lux%lu image\n",
+		(unsigned long)png_get_image_width(png_ptr, info_ptr),
+		(unsigned long)png_get_image_height(png_ptr, info_ptr),
+		(unsigned long)crop_x, (unsigned long)crop_y,
+		(unsigned long)full_width, (unsigned long)full_height);
 
     dump_IHDR(fpout);			/* first critical chunk */
 
@@ -950,6 +1585,12 @@ void sngdump(png_byte *row_pointers[], FILE *fpout)
     dump_sCAL(fpout);
 
     dump_unknown_chunks(FALSE, fpout);
+}
+
+void sngdump(png_byte *row_pointers[], FILE *fpout)
+/* dump a canonicalized SNG form of a PNG file */
+{
+    sngdump_head(fpout);
 
     /*
      * This is the earliest point at which we could write the image data;
@@ -959,36 +1600,451 @@ void sngdump(png_byte *row_pointers[], FILE *fpout)
      */
 
     dump_tIME(fpout);
-    dump_text(fpout);
+    dump_text(fpout, 0);
+
+    if (!no_pixels)
+	dump_image(row_pointers, fpout);	/* third critical chunk */
+
+    dump_unknown_chunks(TRUE, fpout);
+}
+
+/* decoded bytes streaming mode looks at before choosing a data format */
+/*****************************************************************************
+ *
+ * Pipelined row dumping
+ *
+ * With more than one thread allowed, the rest of a streamed image goes
+ * through three stages at once: this thread reads rows from libpng, a
+ * second formats them as SNG text, and a third writes the text out.
+ * Batches of rows go round a small ring, and a stage only waits when it
+ * gets a lap ahead of the one before, so the time taken approaches that
+ * of the slowest stage.  The text is exactly what dump_row() would have
+ * written straight to the output.
+ *
+ * The formatting thread borrows whatever per-thread state dump_row()
+ * reads.  It never calls fatal(), because stream_image() only picks a
+ * format every row can be written in.
+ *
+ *****************************************************************************/
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_OPEN_MEMSTREAM)
+#define PIPELINE_BATCH	(256 * 1024)	/* rough bytes of rows per batch */
+#define PIPELINE_DEPTH	4		/* batches in the ring */
+
+typedef struct
+{
+    png_bytep	rows;		/* the batch's rows, end to end */
+    png_uint_32	first, nrows;	/* which rows they are */
+    FILE	*text;		/* memory stream for the formatted rows */
+    char	*textbuf;	/* its buffer and length, once flushed */
+    size_t	textlen;
+}
+batch;
+
+typedef struct
+{
+    batch	ring[PIPELINE_DEPTH];
+    FILE	*fpout;
+    int		fmt;
+    png_uint_32	height;
+    png_size_t	rowbytes;
+
+    /* batches through each stage so far, and the ends of the first two */
+    unsigned long	nread, nformatted, nwritten;
+    int		reading_done, formatting_done;
+    pthread_mutex_t	lock;
+    pthread_cond_t	moved;
+
+    /* state of this thread that dump_row() needs in the formatter */
+    png_structp	png_ptr;
+    png_infop	info_ptr;
+    FILE	*errfp;
+    unsigned char *output_buffer;
+    png_byte	carry[3];
+    int		pending;
+    int		packed_depth;
+}
+pipeline;
+
+static void *format_stage(void *p)
+/* format each batch of rows once it has been read */
+{
+    pipeline	*pl = p;
+    batch	*bp;
+    png_uint_32	r;
+
+    png_ptr = pl->png_ptr;
+    info_ptr = pl->info_ptr;
+    errfp = pl->errfp;
+    memcpy(rfc4648_carry, pl->carry, sizeof(rfc4648_carry));
+    rfc4648_pending = pl->pending;
+    packed_depth = pl->packed_depth;
+    output_buffer = pl->output_buffer;
+
+    for (;;)
+    {
+	pthread_mutex_lock(&pl->lock);
+	while (pl->nformatted == pl->nread && !pl->reading_done)
+	    pthread_cond_wait(&pl->moved, &pl->lock);
+	if (pl->nformatted == pl->nread)
+	{
+	    pl->formatting_done = TRUE;
+	    pthread_cond_broadcast(&pl->moved);
+	    pthread_mutex_unlock(&pl->lock);
+	    break;
+	}
+	bp = &pl->ring[pl->nformatted % PIPELINE_DEPTH];
+	pthread_mutex_unlock(&pl->lock);
+
+	rewind(bp->text);
+	for (r = 0; r < bp->nrows; r++)
+	    dump_row(bp->text, pl->fmt, "    pixels ", pl->rowbytes,
+		     pl->height, bp->first + r, bp->rows + r * pl->rowbytes);
+	fflush(bp->text);
+	bp->textlen = ftell(bp->text);
+
+	pthread_mutex_lock(&pl->lock);
+	pl->nformatted++;
+	pthread_cond_broadcast(&pl->moved);
+	pthread_mutex_unlock(&pl->lock);
+    }
+
+    return(NULL);
+}
+
+static void *write_stage(void *p)
+/* write out each batch of text once it has been formatted */
+{
+    pipeline	*pl = p;
+    batch	*bp;
+
+    for (;;)
+    {
+	pthread_mutex_lock(&pl->lock);
+	while (pl->nwritten == pl->nformatted && !pl->formatting_done)
+	    pthread_cond_wait(&pl->moved, &pl->lock);
+	if (pl->nwritten == pl->nformatted)
+	{
+	    pthread_mutex_unlock(&pl->lock);
+	    return(NULL);
+	}
+	bp = &pl->ring[pl->nwritten % PIPELINE_DEPTH];
+	pthread_mutex_unlock(&pl->lock);
 
-    dump_image(row_pointers, fpout);	/* third critical chunk */
+	fwrite(bp->textbuf, 1, bp->textlen, pl->fpout);
+
+	pthread_mutex_lock(&pl->lock);
+	pl->nwritten++;
+	pthread_cond_broadcast(&pl->moved);
+	pthread_mutex_unlock(&pl->lock);
+    }
+}
+
+static int pipeline_rows(FILE *fpout, int fmt, png_uint_32 first)
+/* dump the rows of the image from first on through the pipeline */
+{
+    pipeline	*pl;
+    png_uint_32	height = png_get_image_height(png_ptr, info_ptr);
+    png_size_t	rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    png_uint_32	batchrows = PIPELINE_BATCH / rowbytes + 1;
+    pthread_t	formatter, writer;
+    jmp_buf	outer;
+    int		i, failed = FALSE, nstreams;
+
+    if (threads < 2 || height - first <= batchrows)
+	return(FALSE);
+
+    pl = pool_alloc(conversion_pool, sizeof(pipeline));
+    memset(pl, '\0', sizeof(pipeline));
+    for (nstreams = 0; nstreams < PIPELINE_DEPTH; nstreams++)
+    {
+	batch	*bp = &pl->ring[nstreams];
+
+	bp->text = open_memstream(&bp->textbuf, &bp->textlen);
+	if (bp->text == NULL)
+	    break;
+	bp->rows = pool_alloc(conversion_pool, batchrows * rowbytes);
+    }
+    if (nstreams < PIPELINE_DEPTH)
+    {
+	/* no pipeline; the caller does it all the slow way */
+	for (i = 0; i < nstreams; i++)
+	{
+	    fclose(pl->ring[i].text);
+	    free(pl->ring[i].textbuf);
+	}
+	return(FALSE);
+    }
+
+    pl->fpout = fpout;
+    pl->fmt = fmt;
+    pl->height = height;
+    pl->rowbytes = rowbytes;
+    pl->png_ptr = png_ptr;
+    pl->info_ptr = info_ptr;
+    pl->errfp = errfp;
+    pl->output_buffer = pool_alloc(conversion_pool, OUTPUT_BLOCK);
+    memcpy(pl->carry, rfc4648_carry, sizeof(rfc4648_carry));
+    pl->pending = rfc4648_pending;
+    pl->packed_depth = packed_depth;
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->moved, NULL);
+
+    if (pthread_create(&formatter, NULL, format_stage, pl) != 0)
+	goto nothreads;
+    if (pthread_create(&writer, NULL, write_stage, pl) != 0)
+    {
+	pthread_mutex_lock(&pl->lock);
+	pl->reading_done = TRUE;
+	pthread_cond_broadcast(&pl->moved);
+	pthread_mutex_unlock(&pl->lock);
+	pthread_join(formatter, NULL);
+	goto nothreads;
+    }
+
+    /*
+     * A libpng error while reading ends the image at the rows read so
+     * far, as it would without the pipeline, and is rethrown once the
+     * other stages have finished with them.
+     */
+    memcpy(outer, png_jmpbuf(png_ptr), sizeof(jmp_buf));
+    if (setjmp(png_jmpbuf(png_ptr)))
+	failed = TRUE;
+    else
+	while (first < height)
+	{
+	    batch	*bp;
+
+	    pthread_mutex_lock(&pl->lock);
+	    while (pl->nread - pl->nwritten == PIPELINE_DEPTH)
+		pthread_cond_wait(&pl->moved, &pl->lock);
+	    bp = &pl->ring[pl->nread % PIPELINE_DEPTH];
+	    pthread_mutex_unlock(&pl->lock);
+
+	    bp->first = first;
+	    for (bp->nrows = 0; bp->nrows < batchrows && first < height;
+		 bp->nrows++, first++)
+		read_row(bp->rows + bp->nrows * rowbytes);
+
+	    pthread_mutex_lock(&pl->lock);
+	    pl->nread++;
+	    pthread_cond_broadcast(&pl->moved);
+	    pthread_mutex_unlock(&pl->lock);
+	}
+    memcpy(png_jmpbuf(png_ptr), outer, sizeof(jmp_buf));
+
+    /* a batch cut short by an error goes out with the rows it has */
+    pthread_mutex_lock(&pl->lock);
+    if (failed && pl->ring[pl->nread % PIPELINE_DEPTH].nrows > 0)
+	pl->nread++;
+    pl->reading_done = TRUE;
+    pthread_cond_broadcast(&pl->moved);
+    pthread_mutex_unlock(&pl->lock);
+    pthread_join(formatter, NULL);
+    pthread_join(writer, NULL);
+
+    /* the formatter's copy of the group carried between rows is done */
+    rfc4648_pending = 0;
+    for (i = 0; i < PIPELINE_DEPTH; i++)
+    {
+	fclose(pl->ring[i].text);
+	free(pl->ring[i].textbuf);
+    }
+    pthread_mutex_destroy(&pl->lock);
+    pthread_cond_destroy(&pl->moved);
+
+    if (failed)
+	png_longjmp(png_ptr, 1);
+    return(TRUE);
+
+nothreads:
+    for (i = 0; i < PIPELINE_DEPTH; i++)
+    {
+	fclose(pl->ring[i].text);
+	free(pl->ring[i].textbuf);
+    }
+    pthread_mutex_destroy(&pl->lock);
+    pthread_cond_destroy(&pl->moved);
+    return(FALSE);
+}
+#else
+#define pipeline_rows(fpout, fmt, first)	FALSE
+#endif /* HAVE_PTHREAD_H && HAVE_OPEN_MEMSTREAM */
+
+#define STREAM_LOOKAHEAD	(1024 * 1024)
+
+static void stream_image(FILE *fpout, int base64_safe)
+/* decode and dump a non-interlaced image a row at a time */
+{
+    png_uint_32	height = png_get_image_height(png_ptr, info_ptr);
+    png_size_t	rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    png_uint_32	i, nlook = STREAM_LOOKAHEAD / rowbytes;
+    png_bytepp	rows;
+    png_bytep	buf;
+    FILE	*sidecar = NULL;
+    int		fmt;
+
+    /* with the format given there's nothing to look ahead for */
+    if (nlook < 1 || data_format != DATA_AUTO)
+	nlook = 1;
+    if (nlook > height)
+	nlook = height;
+
+    buf = pool_alloc(conversion_pool, nlook * rowbytes);
+    rows = pool_alloc(conversion_pool, nlook * sizeof(png_bytep));
+    skip_rows();
+    for (i = 0; i < nlook; i++)
+    {
+	rows[i] = buf + i * rowbytes;
+	read_row(rows[i]);
+    }
+
+    /*
+     * If the look-ahead window covered the whole image this is exactly
+     * the choice multi_dump() would have made.  Otherwise we can't see
+     * the rest of the data, so only commit to base64 when the image
+     * type guarantees no sample value can reach 64, and never to string.
+     * A --data-format is held to the same rules.  rle can hold anything,
+     * so the look-ahead alone decides whether it pays.
+     */
+    if (data_format == DATA_RLE)
+	fmt = DATA_RLE;
+    else if ((packed_depth = packed_digits()) != 0)
+	fmt = DATA_BASE64;
+    else if (data_format == DATA_AUTO)
+    {
+	fmt = classify_data(rowbytes, nlook, rows);
+	if (nlook < height && fmt != DATA_HEX)
+	    fmt = base64_safe ? DATA_BASE64 : DATA_HEX;
+    }
+    else if ((data_format == DATA_BASE64 && base64_safe)
+	     || data_format == DATA_RFC4648)
+	fmt = data_format;
+    else
+	fmt = DATA_HEX;
+    if (data_format == DATA_AUTO && rle_pays(rows, nlook, fmt))
+    {
+	fmt = DATA_RLE;
+	packed_depth = 0;
+    }
+
+    fprintf(fpout, "IMAGE {\n");
+    if (data_format == DATA_FILE)
+	sidecar = open_sidecar(fpout);
+    else if (data_format == DATA_NETPBM)
+	sidecar = open_netpbm(fpout);
+    for (i = 0; i < nlook; i++)
+	if (sidecar)
+	    TIMED(PHASE_IO, write_raster(sidecar, rows[i]));
+	else
+	    dump_row(fpout, fmt, "    pixels ", rowbytes, height, i, rows[i]);
+    if (sidecar || !pipeline_rows(fpout, fmt, nlook))
+	for (; i < height; i++)
+	{
+	    read_row(buf);
+	    if (sidecar)
+		TIMED(PHASE_IO, write_raster(sidecar, buf));
+	    else
+		dump_row(fpout, fmt, "    pixels ", rowbytes, height, i, buf);
+	}
+    if (sidecar == fpout)
+	fputc('\n', fpout);
+    else if (sidecar)
+	close_sidecar(sidecar);
+    fprintf(fpout, "}\n");
+    packed_depth = 0;
+}
+
+static void sngdump_stream(FILE *fpout, int base64_safe)
+/* dump a PNG whose pre-IDAT chunks have been read, decoding as we go */
+{
+    int ntext, had_tIME = png_get_valid(png_ptr, info_ptr, PNG_INFO_tIME);
+
+    sngdump_head(fpout);
+
+    /* only the chunks seen before the first IDAT are available here */
+    if (had_tIME)
+	dump_tIME(fpout);
+    ntext = dump_text(fpout, 0);
+
+    stream_image(fpout, base64_safe);	/* third critical chunk */
+
+    /* pick up whatever followed the image data */
+    excerpt_end();
+    TIMED(PHASE_PNG, png_read_end(png_ptr, info_ptr));
+    if (!had_tIME)
+	dump_tIME(fpout);
+    dump_text(fpout, ntext);
 
     dump_unknown_chunks(TRUE, fpout);
 }
 
+static off_t output_offset(FILE *fp)
+/* where a stream stands, or -1 if that won't tell how much is written */
+{
+    struct stat	sb;
+    int		fd = fileno(fp);
+
+    /* pipes and devices like /dev/null have no useful position */
+    if (fd >= 0 && (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)))
+	return(-1);
+    return(ftello(fp));
+}
+
 int sngd(FILE *fp, char *name, FILE *fpout)
-/* read and decompile an SNG image presented on stdin */
+/* read and decompile a PNG image presented on fp */
+{
+    static SNG_TLS sng_input input;
+    int status;
+    off_t start;
+
+    stats_begin(PHASE_OTHER);
+    start = output_offset(fpout);
+    input_open(&input, fp);
+    status = sngd_io(&input, name, fpout);
+    input_close(&input);
+    if (timing)
+    {
+	/* the SNG is only all written once stdio lets go of it */
+	TIMED(PHASE_IO, fflush(fpout));
+	conversion_stats.bytes_out = start < 0 ? -1 : ftello(fpout) - start;
+	stats_report(SNG_STDERR, name, "decompile", status);
+    }
+
+    return(status);
+}
+
+int sngd_io(sng_input *in, char *name, FILE *fpout)
+/* decompile a PNG image read from an input buffer */
 {
-#ifndef PNG_INFO_IMAGE_SUPPORTED
     png_bytepp row_pointers;
+    png_bytep image;
+    png_size_t rowbytes;
     png_uint_32 row;
     png_uint_32 height;
-#endif
+    png_colorp palette;
+    int num_palette, base64_safe, passes;
+    sng_input rest;
+    static SNG_TLS sng_pool pool;
 
    current_file = name;
    sng_error = 0;
-
-   /* Create and initialize the png_struct with the desired error handler
-    * functions.  If you want to use the default stderr and longjump method,
-    * you can supply NULL for the last three parameters.  We also supply the
-    * the compiler header file version, so that we know if the application
-    * was compiled with a compatible version of the library.  REQUIRED
+   sidecar_files = 0;
+   conversion_pool = &pool;
+   output_buffer = pool_alloc(conversion_pool, OUTPUT_BLOCK);
+   packed_depth = 0;
+   cropping = FALSE;
+
+   /* Create and initialize the png_struct with sng's error handler
+    * functions and allocators.  We also supply the compiler header file
+    * version, so that we know if the application was compiled with a
+    * compatible version of the library.  REQUIRED
     */
-   png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+   png_ptr = sng_create_read_struct();
 
    if (png_ptr == NULL)
    {
-      fclose(fp);
+      pool_release(&pool);
       return(1);
    }
 
@@ -996,8 +2052,8 @@ int sngd(FILE *fp, char *name, FILE *fpout)
    info_ptr = png_create_info_struct(png_ptr);
    if (info_ptr == NULL)
    {
-      fclose(fp);
       png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+      pool_release(&pool);
       return 1;
    }
 
@@ -1009,7 +2065,7 @@ int sngd(FILE *fp, char *name, FILE *fpout)
    {
       /* Free all of the memory associated with the png_ptr and info_ptr */
       png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-      fclose(fp);
+      pool_release(&pool);
       /* If we get here, we had a problem reading the file */
       return(1);
    }
@@ -1017,63 +2073,149 @@ int sngd(FILE *fp, char *name, FILE *fpout)
    /* keep all unknown chunks, we'll dump them later */
    png_set_keep_unknown_chunks(png_ptr, 2, NULL, 0);
 
-   /* treat IDAT as unknown so it gets passed through raw */
-   if (idat)
+   /*
+    * Pass IDAT through raw, keeping the placeholder as an unknown chunk.
+    * Without pixels the same path reads the other chunks and never
+    * inflates, or even touches, the image data.
+    */
+   if (idat || no_pixels)
    {
-       png_set_keep_unknown_chunks(png_ptr, 2, (png_byte *)"IDAT", 1);
+       split_idat(in, &rest);
+       in = &rest;
+       png_set_keep_unknown_chunks(png_ptr, PNG_HANDLE_CHUNK_ALWAYS,
+				   (png_byte *)"IDAT", 1);
    }
 
+   /* libpng reads straight out of the input buffer or mapping */
+   png_set_read_fn(png_ptr, in, input_read_png);
 
-   /* Set up the input control if you are using standard C streams */
-   png_init_io(png_ptr, fp);
+   if (idat || no_pixels)
+   {
+       /* nothing to decode; just collect the chunks around the IDATs */
+       TIMED(PHASE_PNG, png_read_info(png_ptr, info_ptr));
+       TIMED(PHASE_PNG, png_read_end(png_ptr, info_ptr));
+       mark_after_idat();
 
+       TIMED(PHASE_DUMP, sngdump(NULL, fpout));
+   }
+   else
 
    /*
-    * Unpack images with bit depth < 8 into bytes per sample.
-    * We'll cheat, later on, by referring to png_ptr->bit_depth.
-    * This preserves the bit depth of the file, as opposed to
-    * the unpacked bit depth of the image.  But this is
-    * undocumented.  If it ever breaks, the regression test
-    * will start failing on images of depth 1, 2, and 4.
+    * Rows of images with bit depth < 8 stay packed, as in the file;
+    * dump_row() spreads their pixels out to a digit each as it writes.
     */
 #ifdef PNG_INFO_IMAGE_SUPPORTED
-   png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_PACKING, NULL);
-
-   /* dump the image */
-   sngdump(png_get_rows(png_ptr, info_ptr), fpout);
-#else
-   png_set_packing(png_ptr);
-
-   /* The call to png_read_info() gives us all of the information from the
-    * PNG file before the first IDAT (image data chunk).  REQUIRED
-    */
-   png_read_info(png_ptr, info_ptr);
-
-   png_read_update_info(png_ptr, info_ptr);
-
-   height = png_get_image_height(png_ptr, info_ptr);
-
-   row_pointers = (png_bytepp)malloc(height * sizeof(png_bytep));
-   for (row = 0; row < height; row++)
-       row_pointers[row] = malloc(png_get_rowbytes(png_ptr, info_ptr));
-
-   png_read_image(png_ptr, row_pointers);
-
-   /* read rest of file, and get additional chunks in info_ptr - REQUIRED */
-   png_read_end(png_ptr, info_ptr);
+   if (!stream && memory_budget == 0 && excerpt.width == 0)
+   {
+       TIMED(PHASE_PNG,
+	     png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL));
 
-   /* dump the image */
-   sngdump(row_pointers, fpout);
+       /* dump the image */
+       TIMED(PHASE_DUMP, sngdump(png_get_rows(png_ptr, info_ptr), fpout));
+   }
+   else
 #endif
+   {
+       /* The call to png_read_info() gives us all of the information from
+	* the PNG file before the first IDAT (image data chunk).  REQUIRED
+	*/
+       TIMED(PHASE_PNG, png_read_info(png_ptr, info_ptr));
+
+       /* can every sample be written in base64? */
+       base64_safe = png_get_bit_depth(png_ptr, info_ptr) < 8;
+       if (png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette))
+	   base64_safe |= num_palette <= 64;
+
+       passes = png_set_interlace_handling(png_ptr);
+       png_read_update_info(png_ptr, info_ptr);
+       excerpt_begin();
+
+       if (passes == 1 && stream)
+       {
+	   /* rows are dumped as they are decoded */
+	   TIMED(PHASE_DUMP, sngdump_stream(fpout, base64_safe));
+       }
+       else
+       {
+	   /*
+	    * Adam7 rows aren't complete until the last pass, and without
+	    * --stream the format is chosen from the whole image; read it
+	    * all, into a mapped file if it's over the memory budget.
+	    */
+	   height = png_get_image_height(png_ptr, info_ptr);
+
+	   rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+	   if (height > (size_t)-1 / rowbytes)
+	       fatal("image is too large to hold in memory");
+	   image = pool_spill(conversion_pool, height * rowbytes);
+	   row_pointers = pool_spill(conversion_pool, height * sizeof(png_bytep));
+	   for (row = 0; row < height; row++)
+	       row_pointers[row] = image + (size_t)row * rowbytes;
+
+	   if (cropping && passes == 1)
+	   {
+	       /* stop decoding at the bottom of the window */
+	       skip_rows();
+	       for (row = 0; row < height; row++)
+		   read_row(row_pointers[row]);
+	   }
+	   else if (cropping)
+	   {
+	       /* every pass has rows in the window; decode it all, then cut */
+	       png_bytep	whole;
+	       png_bytepp	whole_rows;
+
+	       if (full_height > (size_t)-1 / full_rowbytes)
+		   fatal("image is too large to hold in memory");
+	       whole = pool_spill(conversion_pool, full_height * full_rowbytes);
+	       whole_rows = pool_spill(conversion_pool,
+				       full_height * sizeof(png_bytep));
+	       for (row = 0; row < full_height; row++)
+		   whole_rows[row] = whole + (size_t)row * full_rowbytes;
+	       TIMED(PHASE_PNG, png_read_image(png_ptr, whole_rows));
+	       for (row = 0; row < height; row++)
+		   crop_row(whole_rows[crop_y + row], row_pointers[row]);
+	   }
+	   else
+	       TIMED(PHASE_PNG, png_read_image(png_ptr, row_pointers));
+	   excerpt_end();
+
+	   /* read rest of file, and get additional chunks in info_ptr */
+	   TIMED(PHASE_PNG, png_read_end(png_ptr, info_ptr));
+
+	   /* dump the image */
+	   TIMED(PHASE_DUMP, sngdump(row_pointers, fpout));
+       }
+   }
 
    /* clean up after the read, and free any memory allocated - REQUIRED */
    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-
-   /* close the file */
-   fclose(fp);
+   pool_release(&pool);
 
    /* that's it; return this file's error status */
    return sng_error;
 }
 
+/*****************************************************************************
+ *
+ * Benchmark hooks
+ *
+ * For sngbench, which times the dump path apart from libpng.
+ *
+ *****************************************************************************/
+
+void sngd_bench_dump(FILE *fpout, int width, int height, unsigned char *rows[])
+/* dump rows of data in whichever format suits them, as chunk data is */
+{
+    static SNG_TLS sng_pool pool;
+
+    conversion_pool = &pool;
+    output_buffer = pool_alloc(conversion_pool, OUTPUT_BLOCK);
+
+    multi_dump(fpout, "    pixels ", DATA_AUTO, width, height, rows);
+
+    pool_release(&pool);
+    conversion_pool = NULL;
+}
+
 /* sngd.c ends here */
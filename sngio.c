@@ -0,0 +1,319 @@
+/*****************************************************************************
+
+NAME
+   sngio.c -- buffered and memory-mapped I/O for the SNG compiler and
+	      decompiler.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "config.h"
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif /* HAVE_MMAP */
+#include "png.h"
+#include "sng.h"
+
+/* size of the blocks read from input that can't be mapped */
+#define INPUT_BLOCK	(256 * 1024)
+
+void input_open(sng_input *in, FILE *fp)
+/* set up to read the remainder of a stream */
+{
+    memset(in, '\0', sizeof(sng_input));
+    in->fp = fp;
+
+#ifdef HAVE_MMAP
+    /*
+     * A regular file can be scanned in place.  Start at the stream's
+     * current offset, which accounts for anything already read from it.
+     */
+    {
+	struct stat	sb;
+	off_t		offset = ftello(fp);
+
+	if (offset >= 0 && fstat(fileno(fp), &sb) == 0
+			&& S_ISREG(sb.st_mode) && sb.st_size > offset)
+	{
+	    void *map = mmap(NULL, (size_t)sb.st_size,
+			     PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+
+	    if (map != MAP_FAILED)
+	    {
+#ifdef MADV_SEQUENTIAL
+		madvise(map, (size_t)sb.st_size, MADV_SEQUENTIAL);
+#endif /* MADV_SEQUENTIAL */
+		in->map = map;
+		in->maplen = (size_t)sb.st_size;
+		conversion_stats.bytes_in += sb.st_size - offset;
+		in->cp = (unsigned char *)map + offset;
+		in->end = (unsigned char *)map + sb.st_size;
+		return;
+	    }
+	}
+    }
+#endif /* HAVE_MMAP */
+
+    /* pipes, terminals and the like get read a block at a time */
+    in->buf = xalloc(INPUT_BLOCK);
+    in->cp = in->end = in->buf;
+}
+
+void input_open_mem(sng_input *in, const void *data, size_t len)
+/* set up to read a buffer the caller owns */
+{
+    memset(in, '\0', sizeof(sng_input));
+    in->cp = data;
+    in->end = in->cp + len;
+}
+
+int input_fill(sng_input *in)
+/* refill an exhausted input buffer; return FALSE at end of input */
+{
+    size_t	len;
+
+    if (in->fp == NULL || in->map || feof(in->fp))
+	return(FALSE);
+
+    TIMED(PHASE_IO, len = fread(in->buf, 1, INPUT_BLOCK, in->fp));
+    conversion_stats.bytes_in += len;
+    in->cp = in->buf;
+    in->end = in->buf + len;
+    return(len > 0);
+}
+
+int input_skip_line(sng_input *in)
+/* advance to the next newline, leaving it unread; FALSE if EOF first */
+{
+    for (;;)
+    {
+	const unsigned char *nl = memchr(in->cp, '\n', in->end - in->cp);
+
+	if (nl)
+	{
+	    in->cp = nl;
+	    return(TRUE);
+	}
+	in->cp = in->end;
+	if (!input_fill(in))
+	    return(FALSE);
+    }
+}
+
+const unsigned char *input_slurp(sng_input *in, size_t *len)
+/* get all the remaining input in one piece, lasting as long as the pool */
+{
+    unsigned char	*all;
+    size_t		size;
+
+    /* mapped and in-memory input is in one piece already */
+    if (in->buf == NULL)
+    {
+	const unsigned char *p = in->cp;
+
+	*len = in->end - in->cp;
+	in->cp = in->end;
+	return(p);
+    }
+
+    size = INPUT_BLOCK;
+    all = pool_alloc(conversion_pool, size);
+    *len = 0;
+    for (;;)
+    {
+	size_t	n = in->end - in->cp;
+
+	if (size - *len < n)
+	{
+	    all = pool_realloc(conversion_pool, all, size, size * 2);
+	    size *= 2;
+	}
+	memcpy(all + *len, in->cp, n);
+	*len += n;
+	in->cp = in->end;
+	if (!input_fill(in))
+	    return(all);
+    }
+}
+
+void input_close(sng_input *in)
+/* release the buffer or mapping; the stream itself is left alone */
+{
+#ifdef HAVE_MMAP
+    if (in->map)
+	munmap(in->map, in->maplen);
+#endif /* HAVE_MMAP */
+    if (in->buf)
+	note_memory(-INPUT_BLOCK);
+    free(in->buf);
+    memset(in, '\0', sizeof(sng_input));
+}
+
+/*
+ * Files that data segments take their bytes from stay open, mapped if
+ * possible, until the end of the conversion, so that the compiler can
+ * use their contents where they lie.
+ */
+typedef struct data_file_t
+{
+    struct data_file_t	*next;
+    sng_input		in;
+}
+data_file;
+
+static SNG_TLS data_file *data_files;
+
+const unsigned char *input_map_file(const char *name, size_t *len)
+/* get the whole of a file until input_unmap_files(), or NULL on error */
+{
+    data_file		*df;
+    FILE		*fp;
+    const unsigned char	*data;
+
+    if ((fp = fopen(name, "rb")) == NULL)
+	return(NULL);
+    df = pool_alloc(conversion_pool, sizeof(data_file));
+    input_open(&df->in, fp);
+    data = input_slurp(&df->in, len);
+    if (ferror(fp))
+	data = NULL;
+    fclose(fp);
+
+    df->next = data_files;
+    data_files = df;
+    return(data);
+}
+
+void input_unmap_files(void)
+/* release the files input_map_file() got; call before the pool goes */
+{
+    for (; data_files; data_files = data_files->next)
+	input_close(&data_files->in);
+}
+
+void input_read_png(png_structp png_ptr, png_bytep data, png_size_t len)
+/* libpng read callback: copy bytes straight out of the input */
+{
+    sng_input	*in = png_get_io_ptr(png_ptr);
+
+    while (len > 0)
+    {
+	size_t	n;
+
+	if (in->cp == in->end && !input_fill(in))
+	    png_error(png_ptr, "Read Error");
+	n = in->end - in->cp;
+	if (n > len)
+	    n = len;
+	memcpy(data, in->cp, n);
+	in->cp += n;
+	data += n;
+	len -= n;
+    }
+}
+
+/*
+ * PNG output is collected in a large buffer.  Going to a stream, each
+ * full buffer is handed to fwrite() at once, and writes bigger than the
+ * buffer bypass it; stdio passes requests that size straight through to
+ * the descriptor without copying them.  Going to memory, the buffer just
+ * grows and becomes the result.
+ */
+
+/* size of the blocks written to output streams */
+#define OUTPUT_BLOCK	(256 * 1024)
+
+/* initial size of in-memory output */
+#define OUTPUT_MEMORY	(16 * 1024)
+
+void output_open(sng_output *out, FILE *fp)
+/* set up to write PNG data to a stream */
+{
+    out->fp = fp;
+    out->buf = xalloc(OUTPUT_BLOCK);
+    out->len = 0;
+    out->size = OUTPUT_BLOCK;
+}
+
+void output_open_mem(sng_output *out)
+/* set up to collect PNG data in memory */
+{
+    out->fp = NULL;
+    out->buf = xalloc(OUTPUT_MEMORY);
+    out->len = 0;
+    out->size = OUTPUT_MEMORY;
+}
+
+static int output_flush(sng_output *out)
+/* write out the buffer; FALSE if the stream says no */
+{
+    size_t	len = out->len, n;
+
+    out->len = 0;
+    TIMED(PHASE_IO, n = fwrite(out->buf, 1, len, out->fp));
+    return(n == len);
+}
+
+void output_write_png(png_structp png_ptr, png_bytep data, png_size_t len)
+/* libpng write callback */
+{
+    sng_output	*out = png_get_io_ptr(png_ptr);
+    size_t	n;
+
+    conversion_stats.bytes_out += len;
+    if (out->fp == NULL)
+    {
+	if (out->size - out->len < len)
+	{
+	    size_t	size = out->size;
+
+	    while (size - out->len < len)
+		size *= 2;
+	    out->buf = xrealloc(out->buf, size);
+	    note_memory(size - out->size);
+	    out->size = size;
+	}
+    }
+    else if (out->size - out->len < len)
+    {
+	if (!output_flush(out))
+	    png_error(png_ptr, "Write Error");
+	if (len >= out->size)
+	{
+	    TIMED(PHASE_IO, n = fwrite(data, 1, len, out->fp));
+	    if (n != len)
+		png_error(png_ptr, "Write Error");
+	    return;
+	}
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+void output_flush_png(png_structp png_ptr)
+/* libpng flush callback; also used to push out the last block */
+{
+    sng_output	*out = png_get_io_ptr(png_ptr);
+    int		ok;
+
+    TIMED(PHASE_IO, ok = out->fp == NULL
+	  || (output_flush(out) && fflush(out->fp) == 0));
+    if (!ok)
+	png_error(png_ptr, "Write Error");
+}
+
+void output_close(sng_output *out)
+/* release the buffer of a stream; memory output is left to the caller */
+{
+    if (out->fp)
+    {
+	note_memory(-(long)out->size);
+	free(out->buf);
+    }
+    memset(out, '\0', sizeof(sng_output));
+}
+
+/* sngio.c ends here */
@@ -0,0 +1,657 @@
+/*****************************************************************************
+
+NAME
+   sngzip.c -- filter and deflate image data and chunk payloads on threads.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "config.h"
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
+#include "png.h"
+#include "zlib.h"
+#include "sng.h"
+
+/*************************************************************************
+ *
+ * Work queue
+ *
+ * Tasks are numbered; each worker takes the next number until they are
+ * all gone.  Tasks run on other threads, so they must not call fatal()
+ * or touch the per-conversion globals; they report trouble in their
+ * own data for the caller to act on afterwards.
+ *
+ ************************************************************************/
+
+typedef struct
+{
+    void	(*task)(void *, int);
+    void	*arg;
+    int		ntasks;
+    int		next;		/* next task to hand out */
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif /* HAVE_PTHREAD_H */
+}
+work_queue;
+
+static void *worker(void *p)
+/* run tasks off the queue until it is empty */
+{
+    work_queue	*q = p;
+
+    for (;;)
+    {
+	int	i;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&q->lock);
+#endif /* HAVE_PTHREAD_H */
+	i = q->next++;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&q->lock);
+#endif /* HAVE_PTHREAD_H */
+	if (i >= q->ntasks)
+	    return(NULL);
+	q->task(q->arg, i);
+    }
+}
+
+void run_parallel(int ntasks, void task(void *, int), void *arg, int nthreads)
+/* run tasks 0..ntasks-1 on up to nthreads threads, this one included */
+{
+    work_queue	q;
+
+    q.task = task;
+    q.arg = arg;
+    q.ntasks = ntasks;
+    q.next = 0;
+
+#ifdef HAVE_PTHREAD_H
+    /* the worker takes the lock even when it is the only one */
+    pthread_mutex_init(&q.lock, NULL);
+    if (nthreads > ntasks)
+	nthreads = ntasks;
+    if (nthreads > 1)
+    {
+	pthread_t	*tids = xalloc(sizeof(pthread_t) * (nthreads - 1));
+	int		i, started;
+
+	for (started = 0; started < nthreads - 1; started++)
+	    if (pthread_create(&tids[started], NULL, worker, &q) != 0)
+		break;		/* make do with the threads we got */
+	worker(&q);
+	for (i = 0; i < started; i++)
+	    pthread_join(tids[i], NULL);
+	note_memory(-(long)(sizeof(pthread_t) * (nthreads - 1)));
+	free(tids);
+    }
+    else
+	worker(&q);
+    pthread_mutex_destroy(&q.lock);
+#else
+    worker(&q);
+#endif /* HAVE_PTHREAD_H */
+}
+
+/*************************************************************************
+ *
+ * Parallel IDAT encoding
+ *
+ * The image is cut into bands of rows.  Every band is filtered, then
+ * every band is deflated as a raw stream primed with the 32K of filtered
+ * data before it and ended with a sync flush, so the pieces join into one
+ * deflate stream the way pigz does it.  The zlib header and the combined
+ * Adler-32 go around them, and the result is written out as IDAT chunks.
+ *
+ ************************************************************************/
+
+/* rough amount of filtered data per band */
+#define BAND_BYTES	(128 * 1024)
+
+/* slack for the sync flush that ends each band */
+#define FLUSH_SLACK	16
+
+typedef struct
+{
+    png_uint_32	first, last;	/* rows in the band */
+    png_bytep	out;		/* deflated band */
+    size_t	outsize;	/* room allocated for it */
+    size_t	outlen;		/* bytes produced */
+    uLong	adler;		/* Adler-32 of the filtered band */
+    png_bytep	scratch[2];	/* candidate rows for filter selection */
+    int		failed;
+}
+band;
+
+typedef struct
+{
+    png_bytepp	rows;
+    png_bytep	zero;		/* the row above the first row */
+    png_bytep	filtered;	/* filter byte and filtered row, per row */
+    size_t	rowbytes;
+    int		bpp;		/* bytes per complete pixel, at least 1 */
+    int		filters;	/* PNG_FILTER_* mask to choose from */
+    int		level, strategy, window, memlevel;
+    band	*bands;
+    int		nbands;
+}
+encoder;
+
+static unsigned long filter_row(int type, png_const_bytep row, png_const_bytep prev,
+				png_bytep out, size_t n, int bpp)
+/* apply one PNG filter to a row; return libpng's heuristic cost */
+{
+    unsigned long	sum = 0;
+    size_t		i;
+
+    switch (type)
+    {
+    case PNG_FILTER_VALUE_SUB:
+	for (i = 0; i < n; i++)
+	    out[i] = row[i] - (i >= (size_t)bpp ? row[i - bpp] : 0);
+	break;
+    case PNG_FILTER_VALUE_UP:
+	for (i = 0; i < n; i++)
+	    out[i] = row[i] - prev[i];
+	break;
+    case PNG_FILTER_VALUE_AVG:
+	for (i = 0; i < n; i++)
+	    out[i] = row[i] - (((i >= (size_t)bpp ? row[i - bpp] : 0) + prev[i]) >> 1);
+	break;
+    case PNG_FILTER_VALUE_PAETH:
+	for (i = 0; i < n; i++)
+	{
+	    int a = i >= (size_t)bpp ? row[i - bpp] : 0;
+	    int b = prev[i];
+	    int c = i >= (size_t)bpp ? prev[i - bpp] : 0;
+	    int p = a + b - c;
+	    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+	    out[i] = row[i] - (pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+	}
+	break;
+    default:
+	memcpy(out, row, n);
+	break;
+    }
+
+    for (i = 0; i < n; i++)
+	sum += out[i] < 128 ? out[i] : 256 - out[i];
+    return(sum);
+}
+
+static void filter_band(void *arg, int n)
+/* filter the rows of one band, choosing filters as libpng would */
+{
+    static const int	masks[5] = {PNG_FILTER_NONE, PNG_FILTER_SUB,
+				    PNG_FILTER_UP, PNG_FILTER_AVG,
+				    PNG_FILTER_PAETH};
+    encoder	*enc = arg;
+    band	*b = &enc->bands[n];
+    png_uint_32	y;
+
+    for (y = b->first; y < b->last; y++)
+    {
+	png_const_bytep	row = enc->rows[y];
+	png_const_bytep	prev = y ? enc->rows[y - 1] : enc->zero;
+	png_bytep	dst = enc->filtered + y * (enc->rowbytes + 1);
+	unsigned long	best = (unsigned long)-1;
+	int		type, chosen = 0, candidate = 0;
+
+	for (type = 0; type < 5; type++)
+	    if (enc->filters == masks[type])
+	    {
+		/* only one filter allowed; no need to weigh it */
+		filter_row(type, row, prev, dst + 1, enc->rowbytes, enc->bpp);
+		dst[0] = type;
+		break;
+	    }
+	if (type < 5)
+	    continue;
+
+	for (type = 0; type < 5; type++)
+	    if (enc->filters & masks[type])
+	    {
+		unsigned long cost = filter_row(type, row, prev,
+						b->scratch[candidate],
+						enc->rowbytes, enc->bpp);
+
+		if (cost < best)
+		{
+		    best = cost;
+		    chosen = type;
+		    candidate ^= 1;	/* keep the winner, reuse the other */
+		}
+	    }
+	dst[0] = chosen;
+	memcpy(dst + 1, b->scratch[candidate ^ 1], enc->rowbytes);
+    }
+}
+
+static void deflate_band(void *arg, int n)
+/* compress one filtered band into its piece of the deflate stream */
+{
+    encoder	*enc = arg;
+    band	*b = &enc->bands[n];
+    size_t	stride = enc->rowbytes + 1;
+    png_bytep	start = enc->filtered + b->first * stride;
+    size_t	len = (b->last - b->first) * stride;
+    z_stream	zs;
+    int		ret;
+
+    memset(&zs, '\0', sizeof(zs));
+    if (deflateInit2(&zs, enc->level, Z_DEFLATED, -enc->window,
+		     enc->memlevel, enc->strategy) != Z_OK)
+    {
+	b->failed = TRUE;
+	return;
+    }
+
+    if (n > 0)
+    {
+	size_t	dictlen = (size_t)1 << enc->window;
+
+	if (dictlen > b->first * stride)
+	    dictlen = b->first * stride;
+	deflateSetDictionary(&zs, start - dictlen, (uInt)dictlen);
+    }
+
+    zs.next_in = start;
+    zs.avail_in = (uInt)len;
+    zs.next_out = b->out;
+    zs.avail_out = (uInt)b->outsize;
+    ret = deflate(&zs, n == enc->nbands - 1 ? Z_FINISH : Z_SYNC_FLUSH);
+    if (n == enc->nbands - 1 ? ret != Z_STREAM_END
+			     : ret != Z_OK || zs.avail_in || !zs.avail_out)
+	b->failed = TRUE;
+    b->outlen = zs.total_out;
+    deflateEnd(&zs);
+
+    b->adler = adler32(adler32(0L, Z_NULL, 0), start, (uInt)len);
+}
+
+int write_image_parallel(const sng_compression *sc, int nthreads)
+/* write the rows attached to info_ptr and finish the file; FALSE if unsuited */
+{
+    encoder	enc;
+    png_uint_32	height = png_get_image_height(png_ptr, info_ptr);
+    png_byte	color_type = png_get_color_type(png_ptr, info_ptr);
+    png_byte	bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    png_uint_32	rows_per_band;
+    png_byte	header[2], trailer[4];
+    png_bytep	*segs;
+    size_t	*lens, total, idat_size, sent, chunk;
+    z_stream	zs;
+    uLong	adler;
+    int		i, flevel;
+
+    /* raw IDAT specifications leave no rows to encode */
+    enc.rows = png_get_rows(png_ptr, info_ptr);
+    if (enc.rows == NULL
+	    || png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE)
+	return(FALSE);
+
+    enc.rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    rows_per_band = BAND_BYTES / (enc.rowbytes + 1);
+    if (rows_per_band < 1)
+	rows_per_band = 1;
+    enc.nbands = (height + rows_per_band - 1) / rows_per_band;
+    if (enc.nbands < 2)
+	return(FALSE);
+
+    /* settings not given are the ones libpng would have used */
+    enc.bpp = (png_get_channels(png_ptr, info_ptr) * bit_depth + 7) / 8;
+    if (sc->filters >= 0)
+	enc.filters = sc->filters;
+    else if (color_type == PNG_COLOR_TYPE_PALETTE || bit_depth < 8)
+	enc.filters = PNG_FILTER_NONE;
+    else
+	enc.filters = PNG_ALL_FILTERS;
+    enc.level = sc->level >= 0 ? sc->level : Z_DEFAULT_COMPRESSION;
+    if (sc->strategy >= 0)
+	enc.strategy = sc->strategy;
+    else
+	enc.strategy = enc.filters != PNG_FILTER_NONE ? Z_FILTERED : Z_DEFAULT_STRATEGY;
+    enc.window = sc->window >= 0 ? sc->window : 15;
+    if (enc.window < 9)
+	enc.window = 9;		/* zlib won't do raw deflate with 8 */
+    enc.memlevel = sc->memlevel >= 0 ? sc->memlevel : 8;
+    idat_size = sc->idat_size > 0 ? sc->idat_size : PNG_ZBUF_SIZE;
+
+    /* the workers can't allocate from the pool, so do it all here */
+    memset(&zs, '\0', sizeof(zs));
+    if (deflateInit2(&zs, enc.level, Z_DEFLATED, -enc.window,
+		     enc.memlevel, enc.strategy) != Z_OK)
+	fatal("can't set up compression");
+    enc.zero = pool_alloc(conversion_pool, enc.rowbytes);
+    memset(enc.zero, '\0', enc.rowbytes);
+    enc.filtered = pool_alloc(conversion_pool, height * (enc.rowbytes + 1));
+    enc.bands = pool_alloc(conversion_pool, enc.nbands * sizeof(band));
+    for (i = 0; i < enc.nbands; i++)
+    {
+	band	*b = &enc.bands[i];
+
+	b->first = i * rows_per_band;
+	b->last = b->first + rows_per_band;
+	if (b->last > height)
+	    b->last = height;
+	b->outsize = deflateBound(&zs, (b->last - b->first) * (enc.rowbytes + 1))
+	    + FLUSH_SLACK;
+	b->out = pool_alloc(conversion_pool, b->outsize);
+	b->scratch[0] = pool_alloc(conversion_pool, enc.rowbytes);
+	b->scratch[1] = pool_alloc(conversion_pool, enc.rowbytes);
+	b->failed = FALSE;
+    }
+    deflateEnd(&zs);
+
+    run_parallel(enc.nbands, filter_band, &enc, nthreads);
+    run_parallel(enc.nbands, deflate_band, &enc, nthreads);
+
+    /* zlib header, with the level hint zlib itself would give */
+    flevel = enc.level < 0 ? 6 : enc.level;
+    flevel = enc.strategy >= Z_HUFFMAN_ONLY || flevel < 2 ? 0
+	: flevel < 6 ? 1 : flevel == 6 ? 2 : 3;
+    header[0] = ((enc.window - 8) << 4) | Z_DEFLATED;
+    header[1] = flevel << 6;
+    header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+
+    /* the stream is the header, the bands in order, and the checksum */
+    segs = pool_alloc(conversion_pool, (enc.nbands + 2) * sizeof(png_bytep));
+    lens = pool_alloc(conversion_pool, (enc.nbands + 2) * sizeof(size_t));
+    segs[0] = header;
+    lens[0] = sizeof(header);
+    adler = enc.bands[0].adler;
+    total = sizeof(header) + sizeof(trailer);
+    for (i = 0; i < enc.nbands; i++)
+    {
+	band	*b = &enc.bands[i];
+
+	if (b->failed)
+	    fatal("out of memory");
+	if (i > 0)
+	    adler = adler32_combine(adler, b->adler,
+				    (b->last - b->first) * (enc.rowbytes + 1));
+	segs[i + 1] = b->out;
+	lens[i + 1] = b->outlen;
+	total += b->outlen;
+    }
+    trailer[0] = (adler >> 24) & 0xff;
+    trailer[1] = (adler >> 16) & 0xff;
+    trailer[2] = (adler >> 8) & 0xff;
+    trailer[3] = adler & 0xff;
+    segs[enc.nbands + 1] = trailer;
+    lens[enc.nbands + 1] = sizeof(trailer);
+
+    /* everything up to the image data */
+    png_write_info(png_ptr, info_ptr);
+
+    /* then the stream, cut into IDAT chunks */
+    i = 0;
+    for (sent = 0; sent < total; sent += chunk)
+    {
+	size_t	left;
+
+	chunk = total - sent < idat_size ? total - sent : idat_size;
+	png_write_chunk_start(png_ptr, (png_const_bytep)"IDAT", (png_uint_32)chunk);
+	for (left = chunk; left > 0; )
+	{
+	    size_t	n;
+
+	    while (lens[i] == 0)
+		i++;
+	    n = lens[i] < left ? lens[i] : left;
+	    png_write_chunk_data(png_ptr, segs[i], n);
+	    segs[i] += n;
+	    lens[i] -= n;
+	    left -= n;
+	}
+	png_write_chunk_end(png_ptr);
+    }
+
+    write_trailing_chunks();
+    return(TRUE);
+}
+
+/*************************************************************************
+ *
+ * Compressed ancillary chunks
+ *
+ * With more than one thread, the text of zTXt and compressed iTXt chunks
+ * and the iCCP profile are deflated by workers while the compiler reads
+ * on, and the finished chunks go to libpng as unknown chunks.  The zlib
+ * settings and header are the ones libpng would have used, so the bytes
+ * are the same as if it had compressed them itself.
+ *
+ ************************************************************************/
+
+struct sng_deflate_job_t
+{
+    png_const_bytep	in;
+    size_t		inlen;
+    png_bytep		out;		/* the prefix, then the stream */
+    size_t		outlen;		/* bytes of out in use so far */
+    size_t		outsize;
+    int			done, failed;
+    deflate_job		*next;		/* in the queue of jobs to start */
+};
+
+typedef struct
+{
+    deflate_job		*head, *tail;	/* jobs no worker has taken yet */
+    int			quitting;
+#ifdef HAVE_PTHREAD_H
+    pthread_t		*tids;
+    int			nworkers;
+    pthread_mutex_t	lock;
+    pthread_cond_t	work;		/* a job was queued, or quitting */
+    pthread_cond_t	finished;	/* a job was done */
+#endif /* HAVE_PTHREAD_H */
+}
+payload_pool;
+
+static SNG_TLS payload_pool *payloads;
+
+static void deflate_payload(deflate_job *job)
+/* compress one payload after its prefix, as png_text_compress() does */
+{
+    png_bytep	out = job->out + job->outlen;
+    z_stream	zs;
+    int		window = 15;
+
+    /* libpng shrinks the window to fit small data */
+    if (job->inlen <= 16384)
+    {
+	unsigned int	half = 1U << (window - 1);
+
+	while (job->inlen + 262 <= half)
+	{
+	    half >>= 1;
+	    window--;
+	}
+    }
+    if (window == 8)
+	window = 9;
+
+    /* libpng's defaults for text, which it also uses for iCCP */
+    memset(&zs, '\0', sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window,
+		     8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+	job->failed = TRUE;
+	return;
+    }
+    zs.next_in = (Bytef *)job->in;
+    zs.avail_in = (uInt)job->inlen;
+    zs.next_out = out;
+    zs.avail_out = (uInt)(job->outsize - job->outlen);
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+	job->failed = TRUE;
+    job->outlen += zs.total_out;
+    deflateEnd(&zs);
+
+    /* and it puts the smallest window that will do in the header */
+    if (job->inlen <= 16384 && (out[0] & 0x0f) == 8 && (out[0] & 0xf0) <= 0x70)
+    {
+	unsigned int	cinfo = out[0] >> 4, half = 1U << (cinfo + 7);
+
+	if (job->inlen <= half)
+	{
+	    do {
+		half >>= 1;
+		cinfo--;
+	    } while (cinfo > 0 && job->inlen <= half);
+	    out[0] = (out[0] & 0x0f) | (cinfo << 4);
+	    out[1] &= 0xe0;
+	    out[1] += 0x1f - ((out[0] << 8) + out[1]) % 0x1f;
+	}
+    }
+}
+
+#ifdef HAVE_PTHREAD_H
+static deflate_job *next_payload(payload_pool *pp)
+/* take the oldest job nobody has started; call with the lock held */
+{
+    deflate_job	*job = pp->head;
+
+    if (job)
+    {
+	pp->head = job->next;
+	if (pp->head == NULL)
+	    pp->tail = NULL;
+    }
+    return(job);
+}
+
+static void run_payload(payload_pool *pp, deflate_job *job)
+/* do a job taken off the queue; call with the lock held */
+{
+    pthread_mutex_unlock(&pp->lock);
+    deflate_payload(job);
+    pthread_mutex_lock(&pp->lock);
+    job->done = TRUE;
+    pthread_cond_broadcast(&pp->finished);
+}
+
+static void *payload_worker(void *p)
+/* deflate payloads as they are queued, until told to stop */
+{
+    payload_pool	*pp = p;
+    deflate_job		*job;
+
+    pthread_mutex_lock(&pp->lock);
+    while (!pp->quitting)
+	if ((job = next_payload(pp)) != NULL)
+	    run_payload(pp, job);
+	else
+	    pthread_cond_wait(&pp->work, &pp->lock);
+    pthread_mutex_unlock(&pp->lock);
+    return(NULL);
+}
+#endif /* HAVE_PTHREAD_H */
+
+deflate_job *payload_deflate(png_const_bytep prefix, size_t prefixlen,
+			     png_const_bytep in, size_t inlen)
+/* start compressing a payload, which must last the conversion */
+{
+    deflate_job	*job = pool_alloc(conversion_pool, sizeof(deflate_job));
+
+    job->in = in;
+    job->inlen = inlen;
+    job->outsize = prefixlen + deflateBound(Z_NULL, (uLong)inlen);
+    job->out = pool_alloc(conversion_pool, job->outsize);
+    memcpy(job->out, prefix, prefixlen);
+    job->outlen = prefixlen;
+    job->done = job->failed = FALSE;
+    job->next = NULL;
+
+#ifdef HAVE_PTHREAD_H
+    /* the workers start with the first job, and this thread makes one more */
+    if (payloads == NULL && threads > 1)
+    {
+	payloads = xalloc(sizeof(payload_pool));
+	memset(payloads, '\0', sizeof(payload_pool));
+	payloads->tids = xalloc(sizeof(pthread_t) * (threads - 1));
+	pthread_mutex_init(&payloads->lock, NULL);
+	pthread_cond_init(&payloads->work, NULL);
+	pthread_cond_init(&payloads->finished, NULL);
+	while (payloads->nworkers < threads - 1
+	       && pthread_create(&payloads->tids[payloads->nworkers], NULL,
+				 payload_worker, payloads) == 0)
+	    payloads->nworkers++;
+    }
+    if (payloads && payloads->nworkers)
+    {
+	pthread_mutex_lock(&payloads->lock);
+	if (payloads->tail)
+	    payloads->tail->next = job;
+	else
+	    payloads->head = job;
+	payloads->tail = job;
+	pthread_cond_signal(&payloads->work);
+	pthread_mutex_unlock(&payloads->lock);
+	return(job);
+    }
+#endif /* HAVE_PTHREAD_H */
+
+    /* no workers to be had, so do it now */
+    deflate_payload(job);
+    job->done = TRUE;
+    return(job);
+}
+
+png_bytep payload_wait(deflate_job *job, size_t *len)
+/* wait for a payload to be compressed; return the prefix and stream */
+{
+#ifdef HAVE_PTHREAD_H
+    if (payloads && payloads->nworkers)
+    {
+	payload_pool	*pp = payloads;
+	deflate_job	*next;
+
+	/* rather than sit idle, help with the jobs that are still queued */
+	pthread_mutex_lock(&pp->lock);
+	while (!job->done)
+	    if ((next = next_payload(pp)) != NULL)
+		run_payload(pp, next);
+	    else
+		pthread_cond_wait(&pp->finished, &pp->lock);
+	pthread_mutex_unlock(&pp->lock);
+    }
+#endif /* HAVE_PTHREAD_H */
+
+    if (job->failed)
+	fatal("out of memory");
+    *len = job->outlen;
+    return(job->out);
+}
+
+void payload_end(void)
+/* stop the workers, letting any running job finish; before pool release */
+{
+#ifdef HAVE_PTHREAD_H
+    payload_pool	*pp = payloads;
+    int			i;
+
+    if (pp == NULL)
+	return;
+    payloads = NULL;
+    pthread_mutex_lock(&pp->lock);
+    pp->quitting = TRUE;
+    pthread_cond_broadcast(&pp->work);
+    pthread_mutex_unlock(&pp->lock);
+    for (i = 0; i < pp->nworkers; i++)
+	pthread_join(pp->tids[i], NULL);
+    pthread_cond_destroy(&pp->finished);
+    pthread_cond_destroy(&pp->work);
+    pthread_mutex_destroy(&pp->lock);
+    note_memory(-(long)(sizeof(pthread_t) * (threads - 1) + sizeof(payload_pool)));
+    free(pp->tids);
+    free(pp);
+#endif /* HAVE_PTHREAD_H */
+}
+
+/* sngzip.c ends here */